@@ -129,7 +129,7 @@ fi
 case "$1" in
     *)
         case "$2" in
-            verifyjoinsplit)
+            verifyjoinsplit|verifyjoinsplitunbatched)
                 zcashd_start "${@:2}"
                 RAWJOINSPLIT=$(zcash_rpc zcsamplejoinsplit)
                 zcashd_stop
@@ -152,6 +152,9 @@ case "$1" in
             verifyjoinsplit)
                 zcash_rpc zcbenchmark verifyjoinsplit 1000 "\"$RAWJOINSPLIT\""
                 ;;
+            verifyjoinsplitunbatched)
+                zcash_rpc zcbenchmark verifyjoinsplitunbatched 1000 "\"$RAWJOINSPLIT\""
+                ;;
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 50 "${@:3}"
                 ;;
@@ -164,6 +167,9 @@ case "$1" in
             trydecryptnotes)
                 zcash_rpc zcbenchmark trydecryptnotes 1000 "${@:3}"
                 ;;
+            trydecryptnotesunbatched)
+                zcash_rpc zcbenchmark trydecryptnotesunbatched 1000 "${@:3}"
+                ;;
             incnotewitnesses)
                 zcash_rpc zcbenchmark incnotewitnesses 100 "${@:3}"
                 ;;
@@ -174,6 +180,12 @@ case "$1" in
             sendtoaddress)
                 zcash_rpc zcbenchmark sendtoaddress 10 "${@:4}"
                 ;;
+            selectcoins)
+                zcash_rpc zcbenchmark selectcoins 10 "${@:3}"
+                ;;
+            selectcoinsnobnb)
+                zcash_rpc zcbenchmark selectcoinsnobnb 10 "${@:3}"
+                ;;
             loadwallet)
                 zcash_rpc zcbenchmark loadwallet 10 
                 ;;
@@ -720,7 +720,7 @@ invalidsolution:
 #endif // ENABLE_MINING
 
 template<unsigned int N, unsigned int K>
-bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln)
+bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln)
 {
     if (soln.size() != SolutionWidth) {
         LogPrint("pow", "Invalid solution length: %d (expected %d)\n",
@@ -728,43 +728,91 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
         return false;
     }
 
-    std::vector<FullStepRow<FinalFullWidth>> X;
-    X.reserve(1 << K);
-    unsigned char tmpHash[HashOutput];
-    for (eh_index i : GetIndicesFromMinimal(soln, CollisionBitLength)) {
-        GenerateHash(base_state, i/IndicesPerHashOutput, tmpHash, HashOutput);
-        X.emplace_back(tmpHash+((i % IndicesPerHashOutput) * N/8),
-                       N/8, HashLength, CollisionBitLength, i);
+    // Everything below lives in fixed-size stack buffers; a header is
+    // validated without touching the heap.
+    enum : size_t { NumIndices=(1 << K) };
+    enum : size_t { IndexBytePad=sizeof(eh_index) - ((CollisionBitLength+1)+7)/8 };
+
+    unsigned char indexBytes[NumIndices*sizeof(eh_index)];
+    ExpandArray(soln.data(), soln.size(), indexBytes, sizeof(indexBytes),
+                CollisionBitLength+1, IndexBytePad);
+    eh_index indices[NumIndices];
+    for (size_t i = 0; i < NumIndices; i++) {
+        indices[i] = ArrayToEhIndex(indexBytes+(i*sizeof(eh_index)));
     }
 
-    size_t hashLen = HashLength;
-    size_t lenIndices = sizeof(eh_index);
-    while (X.size() > 1) {
-        std::vector<FullStepRow<FinalFullWidth>> Xc;
-        for (int i = 0; i < X.size(); i += 2) {
-            if (!HasCollision(X[i], X[i+1], CollisionByteLength)) {
+    // The solution is a complete binary tree whose leaves are the indices in
+    // order. Walk it depth-first: stack[d] holds the pending left subtree of
+    // height d, its XORed expanded hash and its leftmost index. A subtree is
+    // checked as soon as its right sibling is complete, so an invalid
+    // solution is rejected after hashing only the leaves needed to find the
+    // first bad collision.
+    unsigned char stackHash[K+1][HashLength];
+    eh_index stackFirst[K+1];
+    bool stackUsed[K+1] = {};
+
+    unsigned char tmpHash[HashOutput];
+    eh_index tmpHashIndex = 0;
+    bool haveTmpHash = false;
+
+    unsigned char row[HashLength];
+    for (size_t leaf = 0; leaf < NumIndices; leaf++) {
+        eh_index i = indices[leaf];
+        // Adjacent indices often share a BLAKE2b output block
+        if (!haveTmpHash || tmpHashIndex != i/IndicesPerHashOutput) {
+            tmpHashIndex = i/IndicesPerHashOutput;
+            GenerateHash(base_state, tmpHashIndex, tmpHash, HashOutput);
+            haveTmpHash = true;
+        }
+        ExpandArray(tmpHash+((i % IndicesPerHashOutput) * N/8), N/8,
+                    row, HashLength, CollisionBitLength);
+        eh_index first = i;
+
+        size_t height = 0;
+        while (height < K && stackUsed[height]) {
+            const unsigned char* left = stackHash[height];
+            const size_t offset = height*CollisionByteLength;
+            if (memcmp(left+offset, row+offset, CollisionByteLength) != 0) {
                 LogPrint("pow", "Invalid solution: invalid collision length between StepRows\n");
-                LogPrint("pow", "X[i]   = %s\n", X[i].GetHex(hashLen));
-                LogPrint("pow", "X[i+1] = %s\n", X[i+1].GetHex(hashLen));
+                LogPrint("pow", "X[i]   = %s\n", HexStr(left+offset, left+HashLength));
+                LogPrint("pow", "X[i+1] = %s\n", HexStr(row+offset, row+HashLength));
                 return false;
             }
-            if (X[i+1].IndicesBefore(X[i], hashLen, lenIndices)) {
+            if (first < stackFirst[height]) {
                 LogPrint("pow", "Invalid solution: Index tree incorrectly ordered\n");
                 return false;
             }
-            if (!DistinctIndices(X[i], X[i+1], hashLen, lenIndices)) {
-                LogPrint("pow", "Invalid solution: duplicate indices\n");
-                return false;
+            for (size_t j = offset+CollisionByteLength; j < HashLength; j++) {
+                row[j] ^= left[j];
             }
-            Xc.emplace_back(X[i], X[i+1], hashLen, lenIndices, CollisionByteLength);
+            first = stackFirst[height];
+            stackUsed[height] = false;
+            height++;
+        }
+
+        if (height == K) {
+            // Root: the XOR of all 2^K hashes must vanish entirely
+            for (size_t j = K*CollisionByteLength; j < HashLength; j++) {
+                if (row[j] != 0) {
+                    return false;
+                }
+            }
+        } else {
+            memcpy(stackHash[height], row, HashLength);
+            stackFirst[height] = first;
+            stackUsed[height] = true;
         }
-        X = Xc;
-        hashLen -= CollisionByteLength;
-        lenIndices *= 2;
     }
 
-    assert(X.size() == 1);
-    return X[0].IsZero(hashLen);
+    // Equivalent to checking that every pair of sibling subtrees has
+    // disjoint indices, in O(2^K log 2^K) instead of O(4^K).
+    std::sort(indices, indices+NumIndices);
+    if (std::adjacent_find(indices, indices+NumIndices) != indices+NumIndices) {
+        LogPrint("pow", "Invalid solution: duplicate indices\n");
+        return false;
+    }
+
+    return true;
 }
 
 // Explicit instantiations for Equihash<96,3>
@@ -777,7 +825,7 @@ template bool Equihash<96,3>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<200,9>
 template int Equihash<200,9>::InitialiseState(eh_HashState& base_state);
@@ -789,7 +837,7 @@ template bool Equihash<200,9>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(std::vector<unsigned char>)> validBlock,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<96,5>
 template int Equihash<96,5>::InitialiseState(eh_HashState& base_state);
@@ -801,7 +849,7 @@ template bool Equihash<96,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
 
 // Explicit instantiations for Equihash<48,5>
 template int Equihash<48,5>::InitialiseState(eh_HashState& base_state);
@@ -813,4 +861,4 @@ template bool Equihash<48,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
-template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, const std::vector<unsigned char>& soln);
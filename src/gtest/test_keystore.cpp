@@ -83,6 +83,12 @@ TEST(keystore_tests, StoreAndRetrieveViewingKey) {
     EXPECT_TRUE(keyStore.GetNoteDecryptor(addr, decOut));
     EXPECT_EQ(ZCNoteDecryption(sk.receiving_key()), decOut);
 
+    // ... which is also among the viewing key decryptors
+    NoteDecryptorMap decryptors;
+    keyStore.GetViewingKeyDecryptors(decryptors);
+    EXPECT_EQ(1, decryptors.size());
+    EXPECT_EQ(ZCNoteDecryption(sk.receiving_key()), decryptors.at(addr));
+
     // ... and we should find it in our list of addresses
     addresses.clear();
     keyStore.GetPaymentAddresses(addresses);
@@ -101,6 +107,57 @@ TEST(keystore_tests, StoreAndRetrieveViewingKey) {
     // (and also we only remove viewing keys when adding a spending key)
     EXPECT_TRUE(keyStore.GetNoteDecryptor(addr, decOut));
     EXPECT_EQ(ZCNoteDecryption(sk.receiving_key()), decOut);
+
+    // but it is no longer a viewing key decryptor
+    keyStore.GetViewingKeyDecryptors(decryptors);
+    EXPECT_TRUE(decryptors.empty());
+}
+
+TEST(keystore_tests, KeyIDFilter) {
+    CKeyIDFilter filter;
+    std::vector<uint160> ids;
+    for (int i = 0; i < 50000; i++) {
+        uint256 r = GetRandHash();
+        ids.push_back(uint160(std::vector<unsigned char>(r.begin(), r.begin() + 20)));
+    }
+
+    // Spans several levels of the filter
+    for (int i = 0; i < 25000; i++) {
+        filter.Insert(ids[i]);
+    }
+    for (int i = 0; i < 25000; i++) {
+        EXPECT_TRUE(filter.MayContain(ids[i]));
+    }
+    int nFalsePositives = 0;
+    for (int i = 25000; i < 50000; i++) {
+        if (filter.MayContain(ids[i]))
+            nFalsePositives++;
+    }
+    EXPECT_LT(nFalsePositives, 250);
+}
+
+TEST(keystore_tests, WatchOnlyPrefixMatch) {
+    CBasicKeyStore keyStore;
+    CKey key;
+    key.MakeNewKey(true);
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptLonger = script;
+    scriptLonger << OP_DROP;
+
+    EXPECT_FALSE(keyStore.HaveWatchOnly());
+    EXPECT_FALSE(keyStore.HaveWatchOnly(script));
+
+    keyStore.AddWatchOnly(script);
+    EXPECT_TRUE(keyStore.HaveWatchOnly());
+    EXPECT_TRUE(keyStore.HaveWatchOnly(script));
+    // A script with extra opcodes at the end (e.g. OP_CHECKBLOCKATHEIGHT
+    // arguments) still matches, but a prefix of it doesn't
+    EXPECT_TRUE(keyStore.HaveWatchOnly(scriptLonger));
+    EXPECT_FALSE(keyStore.HaveWatchOnly(CScript(script.begin(), script.end() - 1)));
+
+    keyStore.RemoveWatchOnly(script);
+    EXPECT_FALSE(keyStore.HaveWatchOnly());
+    EXPECT_FALSE(keyStore.HaveWatchOnly(scriptLonger));
 }
 
 #ifdef ENABLE_WALLET
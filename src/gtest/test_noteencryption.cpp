@@ -104,6 +104,36 @@ TEST(noteencryption, api)
     }
 }
 
+TEST(noteencryption, shared_dhsecret)
+{
+    uint256 sk_enc = ZCNoteEncryption::generate_privkey(uint252(uint256S("21035d60bc1983e37950ce4803418a8fb33ea68d5b937ca382ecbae7564d6a07")));
+    uint256 pk_enc = ZCNoteEncryption::generate_pubkey(sk_enc);
+
+    std::array<unsigned char, ZC_NOTEPLAINTEXT_SIZE> message;
+    for (size_t i = 0; i < ZC_NOTEPLAINTEXT_SIZE; i++) {
+        message[i] = (unsigned char) i;
+    }
+
+    // Two outputs under one ephemeral key, as in a JoinSplit
+    ZCNoteEncryption b = ZCNoteEncryption(uint256());
+    auto ciphertext0 = b.encrypt(pk_enc, message);
+    auto ciphertext1 = b.encrypt(pk_enc, message);
+
+    ZCNoteDecryption decrypter(sk_enc);
+    uint256 dhsecret = decrypter.dhsecret(b.get_epk());
+
+    ASSERT_TRUE(decrypter.decryptWithSecret(ciphertext0, b.get_epk(), dhsecret, uint256(), 0) == message);
+    ASSERT_TRUE(decrypter.decryptWithSecret(ciphertext1, b.get_epk(), dhsecret, uint256(), 1) == message);
+
+    // A secret derived with another key must not decrypt
+    ZCNoteDecryption decrypter2(ZCNoteEncryption::generate_privkey(uint252()));
+    uint256 dhsecret2 = decrypter2.dhsecret(b.get_epk());
+    ASSERT_THROW(decrypter.decryptWithSecret(ciphertext0, b.get_epk(), dhsecret2, uint256(), 0),
+                 libzcash::note_decryption_failed);
+    ASSERT_THROW(decrypter2.decryptWithSecret(ciphertext0, b.get_epk(), dhsecret2, uint256(), 0),
+                 libzcash::note_decryption_failed);
+}
+
 uint256 test_prf(
     unsigned char distinguisher,
     uint252 seed_x,
@@ -517,6 +517,78 @@ TEST(proofs, zksnark_serializes_properly)
     }
 }
 
+TEST(proofs, multi_miller_loop)
+{
+    for (size_t n = 0; n < 5; n++) {
+        std::vector<curve_G1> P;
+        std::vector<curve_G2> Q;
+        curve_GT expected = curve_GT::one();
+        for (size_t i = 0; i < n; i++) {
+            P.push_back(i == 1 ? curve_G1::zero() : curve_G1::random_element());
+            Q.push_back(curve_G2::random_element());
+            expected = expected * curve_pp::reduced_pairing(P[i], Q[i]);
+        }
+
+        std::vector<libsnark::G1_precomp<curve_pp>> P_precomp;
+        std::vector<libsnark::G2_precomp<curve_pp>> Q_precomp;
+        for (size_t i = 0; i < n; i++) {
+            P_precomp.push_back(curve_pp::precompute_G1(P[i]));
+            Q_precomp.push_back(curve_pp::precompute_G2(Q[i]));
+        }
+        std::vector<const libsnark::G2_precomp<curve_pp>*> Q_ptrs;
+        for (size_t i = 0; i < n; i++) {
+            Q_ptrs.push_back(&Q_precomp[i]);
+        }
+
+        ASSERT_TRUE(
+            curve_pp::final_exponentiation(curve_pp::multi_miller_loop(P_precomp, Q_ptrs)) ==
+            expected
+        );
+    }
+}
+
+TEST(proofs, batched_verifier_matches_unbatched)
+{
+    auto example = libsnark::generate_r1cs_example_with_field_input<curve_Fr>(250, 4);
+    example.constraint_system.swap_AB_if_beneficial();
+    auto kp = libsnark::r1cs_ppzksnark_generator<curve_pp>(example.constraint_system);
+    auto vkprecomp = libsnark::r1cs_ppzksnark_verifier_process_vk(kp.vk);
+
+    auto proof = libsnark::r1cs_ppzksnark_prover<curve_pp>(
+        kp.pk,
+        example.primary_input,
+        example.auxiliary_input,
+        example.constraint_system
+    );
+
+    auto verifier = ProofVerifier::Strict();
+    auto verifierUnbatched = ProofVerifier::StrictUnbatched();
+    ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proof));
+    ASSERT_TRUE(verifierUnbatched.check(kp.vk, vkprecomp, example.primary_input, proof));
+
+    // Each of the five pairing checks is broken by one of these
+    std::vector<libsnark::r1cs_ppzksnark_proof<curve_pp>> badproofs(8, proof);
+    badproofs[0].g_A.g = proof.g_A.g + curve_G1::one();
+    badproofs[1].g_A.h = proof.g_A.h + curve_G1::one();
+    badproofs[2].g_B.g = proof.g_B.g + curve_G2::one();
+    badproofs[3].g_B.h = proof.g_B.h + curve_G1::one();
+    badproofs[4].g_C.g = proof.g_C.g + curve_G1::one();
+    badproofs[5].g_C.h = proof.g_C.h + curve_G1::one();
+    badproofs[6].g_H = proof.g_H + curve_G1::one();
+    badproofs[7].g_K = proof.g_K + curve_G1::one();
+
+    for (auto& badproof : badproofs) {
+        ASSERT_FALSE(verifier.check(kp.vk, vkprecomp, example.primary_input, badproof));
+        ASSERT_FALSE(verifierUnbatched.check(kp.vk, vkprecomp, example.primary_input, badproof));
+    }
+
+    // A wrong primary input is rejected as well
+    auto badinput = example.primary_input;
+    badinput[0] = badinput[0] + curve_Fr::one();
+    ASSERT_FALSE(verifier.check(kp.vk, vkprecomp, badinput, proof));
+    ASSERT_FALSE(verifierUnbatched.check(kp.vk, vkprecomp, badinput, proof));
+}
+
 TEST(proofs, g1_deserialization)
 {
     CompressedG1 g;
@@ -55,6 +55,7 @@
 #include <openssl/crypto.h>
 
 #include <libsnark/common/profiling.hpp>
+#include <libsnark/algebra/evaluation_domain/domains/basic_radix2_domain_aux.hpp>
 
 #if ENABLE_ZMQ
 #include "zmq/zmqnotificationinterface.h"
@@ -230,6 +231,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsAsyncFlush;
+        pcoinsAsyncFlush = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -353,15 +356,24 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-disabledeprecation=<version>", strprintf(_("Disable block-height node deprecation and automatic shutdown (example: -disabledeprecation=%s)"),
         FormatVersion(CLIENT_VERSION)));
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
+    strUsage += HelpMessageOpt("-asynccoinsflush", strprintf(_("Write the flushed UTXO cache to disk on a background thread; the in-memory UTXO set budget is split between the live and the flushed layer (default: %u)"), DEFAULT_ASYNC_COINS_FLUSH));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbcompactafter=<n>", strprintf(_("Fully compact the chain state database in the background after <n> MiB were written to it (default: %u, 0 = never)"), DEFAULT_DB_COMPACT_AFTER));
+    strUsage += HelpMessageOpt("-dbcompression", strprintf(_("Compress the chain state and block index databases with Snappy if LevelDB was built with it (default: %u)"), DEFAULT_DB_COMPRESSION));
+    strUsage += HelpMessageOpt("-dbindexcache=<n>", _("Set the block index database cache size in megabytes, taken out of -dbcache (default: derived from -dbcache)"));
+    strUsage += HelpMessageOpt("-dbmaxopenfiles=<n>", strprintf(_("Number of table files the chain state database may keep open (default: %u)"), DEFAULT_DB_MAX_OPEN_FILES));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory, 1/%u of it from any one peer (default: %u)"),
+        ORPHAN_TX_PEER_SHARE, DEFAULT_MAX_ORPHAN_TX_SIZE));
     strUsage += HelpMessageOpt("-mempooltxinputlimit=<n>", _("Set the maximum number of transparent inputs in a transaction that the mempool will accept (default: 0 = no limit applied)"));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "zend.pid"));
 #endif
+    strUsage += HelpMessageOpt("-prevalidationthreads=<n>", strprintf(_("Set the number of threads verifying the JoinSplit proofs of blocks downloaded ahead of the tip during initial block download (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        1, MAX_BLOCK_PREVALIDATION_THREADS, DEFAULT_BLOCK_PREVALIDATION_THREADS));
     strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet support and is incompatible with -txindex. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
@@ -369,6 +381,8 @@ std::string HelpMessage(HelpMessageMode mode)
 #if !defined(WIN32)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
+    strUsage += HelpMessageOpt("-txadmissionthreads=<n>", strprintf(_("Set the number of threads checking relayed transactions, JoinSplit proofs included, before they enter the mempool (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_TX_ADMISSION_THREADS, DEFAULT_TX_ADMISSION_THREADS));
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
@@ -387,6 +401,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-msghandlerthreads=<n>", strprintf(_("Set the number of threads processing peer messages (%u to %d, 0 = one per core, <0 = leave that many cores free, default: %d)"),
+        1, MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -403,6 +419,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-tlskeypwd=<password>", _("Password for a private key encryption (default: not set, i.e. private key will be stored unencrypted)"));
     strUsage += HelpMessageOpt("-tlscertpath=<path>", _("Full path to a certificate"));
     strUsage += HelpMessageOpt("-tlstrustdir=<path>", _("Full path to a trusted certificates directory"));
+    strUsage += HelpMessageOpt("-txreconciliation", strprintf(_("Reconcile sets of transactions with peers that support it instead of announcing every transaction to each of them (default: %u)"), DEFAULT_TXRECONCILIATION));
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += HelpMessageOpt("-upnp", _("Use UPnP to map the listening port (default: 1 when listening and no -proxy)"));
@@ -417,20 +434,26 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Wallet options:"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
-    strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), 100));
+    strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), DEFAULT_KEYPOOL_SIZE));
+    strUsage += HelpMessageOpt("-zkeypool=<n>", strprintf(_("Keep <n> spending keys generated ahead of z_getnewaddress, for unencrypted wallets (default: %u)"), DEFAULT_ZKEYPOOL_SIZE));
     if (showDebug)
         strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf("Fees (in %s/kB) smaller than this are considered zero fee for transaction creation (default: %s)",
             CURRENCY_UNIT, FormatMoney(CWallet::minTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
         CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Set the number of threads reading and matching blocks during a rescan, and trying viewing keys on new blocks (0 = one per core, default: %d, max: %d)"),
+        DEFAULT_RESCAN_THREADS, MAX_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-shieldthreads=<n>", strprintf(_("Set the number of threads proving the transactions of a z_shieldcoinbase split over several transactions (0 = one per core, default: %d, max: %d)"),
+        DEFAULT_SHIELD_THREADS, MAX_SHIELD_THREADS));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1));
     strUsage += HelpMessageOpt("-txconfirmtarget=<n>", strprintf(_("If paytxfee is not set, include enough fee so transactions begin confirmation on average within n blocks (default: %u)"), DEFAULT_TX_CONFIRM_TARGET));
     strUsage += HelpMessageOpt("-maxtxfee=<amt>", strprintf(_("Maximum total fees (in %s) to use in a single wallet transaction; setting this too low may abort large transactions (default: %s)"),
         CURRENCY_UNIT, FormatMoney(maxTxFee)));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-viewingkeythread", strprintf(_("Find notes to addresses we only have viewing keys for on a separate thread, rather than while connecting blocks (default: %u)"), DEFAULT_VIEWINGKEY_THREAD));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), true));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
@@ -466,7 +489,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", 1));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", 0));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
+    string debugCategories = "addrman, alert, bench, coindb, db, estimatefee, http, leveldb, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
                              "rand, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
         _("If <category> is not supplied or if <category> = 1, output all debugging information.") + " " + _("<category> can be:") + " " + debugCategories + ".");
@@ -490,6 +513,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", 1));
         strUsage += HelpMessageOpt("-regtest", "Enter regression test mode, which uses a special chain in which blocks can be solved instantly. "
             "This is intended for regression testing tools and app development.");
+        strUsage += HelpMessageOpt("-snarkfft=<alg>", "Radix-2 FFT used by zk-SNARK proving: serial, parallel or blocked (default: blocked)");
     }
     strUsage += HelpMessageOpt("-shrinkdebugfile", _("Shrink debug.log file on client startup (default: 1 when no -debug)"));
     strUsage += HelpMessageOpt("-limitdebuglogsize", _("Limit the debug.log file size to 10Mb (default: 1 when no -debug)"));
@@ -637,18 +661,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
-        }
+        ReindexBlockFiles();
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -940,13 +953,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
+    // table files the coins database may keep open on top of the default budget
+    int nMinCoreFD = MIN_CORE_FILEDESCRIPTORS + std::max((int)GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES) - DEFAULT_DB_MAX_OPEN_FILES, 0);
     nMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nMinCoreFD)), 0);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + nMinCoreFD);
+    if (nFD < nMinCoreFD)
         return InitError(_("Not enough file descriptors available."));
-    if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
-        nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
+    if (nFD - nMinCoreFD < nMaxConnections)
+        nMaxConnections = nFD - nMinCoreFD;
+
+    // Messages of a single peer are always handled in order by one thread at a time
+    nMessageHandlerThreads = GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads += GetNumCores();
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MSGHANDLER_THREADS));
+
+    fTxReconciliation = GetBoolArg("-txreconciliation", DEFAULT_TXRECONCILIATION);
 
     // if using block pruning, then disable txindex
     // also disable the wallet (for now, until SPV support is implemented in wallet)
@@ -1007,6 +1030,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // Unlike -par, a single admission thread still takes the checks out of cs_main
+    nTxAdmissionThreads = GetArg("-txadmissionthreads", DEFAULT_TX_ADMISSION_THREADS);
+    if (nTxAdmissionThreads <= 0)
+        nTxAdmissionThreads += GetNumCores();
+    nTxAdmissionThreads = std::max(1, std::min(nTxAdmissionThreads, MAX_TX_ADMISSION_THREADS));
+
+    nBlockPreValidationThreads = GetArg("-prevalidationthreads", DEFAULT_BLOCK_PREVALIDATION_THREADS);
+    if (nBlockPreValidationThreads <= 0)
+        nBlockPreValidationThreads += GetNumCores();
+    nBlockPreValidationThreads = std::max(1, std::min(nBlockPreValidationThreads, MAX_BLOCK_PREVALIDATION_THREADS));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MB) to allot for block & undo files
@@ -1183,10 +1217,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
+    LogPrintf("Using %u threads for transaction admission\n", nTxAdmissionThreads);
+    for (int i=0; i<nTxAdmissionThreads; i++)
+        threadGroup.create_thread(&ThreadTxAdmission);
+
+    LogPrintf("Using %u threads for block pre-validation\n", nBlockPreValidationThreads);
+    for (int i=0; i<nBlockPreValidationThreads; i++)
+        threadGroup.create_thread(&ThreadBlockPreValidation);
+
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
@@ -1207,6 +1251,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     libsnark::inhibit_profiling_info = true;
     libsnark::inhibit_profiling_counters = true;
 
+    std::string strSnarkFFT = GetArg("-snarkfft", "blocked");
+    if (strSnarkFFT == "serial")
+        libsnark::default_radix2_fft_algorithm = libsnark::radix2_fft_serial;
+    else if (strSnarkFFT == "parallel")
+        libsnark::default_radix2_fft_algorithm = libsnark::radix2_fft_parallel;
+    else if (strSnarkFFT == "blocked")
+        libsnark::default_radix2_fft_algorithm = libsnark::radix2_fft_blocked;
+    else
+        return InitError(strprintf(_("Unknown -snarkfft value: '%s'"), strSnarkFFT));
+
     // Initialize Zcash circuit parameters
     ZC_LoadParams();
 
@@ -1428,10 +1482,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
+    if (mapArgs.count("-dbindexcache")) // explicit block index cache, still taken out of -dbcache
+        nBlockTreeDBCache = std::min(std::max(GetArg("-dbindexcache", 0), (int64_t)1) << 20, nTotalCache / 2);
     nTotalCache -= nBlockTreeDBCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
+    bool fAsyncCoinsFlush = GetBoolArg("-asynccoinsflush", DEFAULT_ASYNC_COINS_FLUSH);
+    if (fAsyncCoinsFlush)
+        nCoinCacheUsage /= 2; // the other half is held by the layer being written
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
@@ -1449,13 +1508,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsAsyncFlush;
+                pcoinsAsyncFlush = NULL;
+                delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                if (fAsyncCoinsFlush) {
+                    pcoinsAsyncFlush = new CCoinsViewAsyncFlush(pcoinsdbview);
+                    pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsAsyncFlush);
+                } else {
+                    pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                }
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1651,6 +1717,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pindexRescan = FindForkInGlobalIndex(chainActive, locator);
             else
                 pindexRescan = chainActive.Genesis();
+
+            // Resume a rescan that was interrupted by shutdown
+            int nRescanHeight;
+            if (walletdb.ReadRescanHeight(nRescanHeight) && pindexRescan &&
+                    nRescanHeight < pindexRescan->nHeight && chainActive[nRescanHeight + 1]) {
+                LogPrintf("Resuming interrupted rescan after block %d\n", nRescanHeight);
+                pindexRescan = chainActive[nRescanHeight + 1];
+            }
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
@@ -1810,7 +1884,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         pwalletMain->ReacceptWalletTransactions();
 
         // Run a thread to flush wallet periodically
-        threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+        threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, pwalletMain));
+
+        // Run a thread to generate keys ahead of demand
+        threadGroup.create_thread(boost::bind(&ThreadTopUpKeyPool, pwalletMain));
+
+        // Run a thread to scan new blocks for notes to viewing keys
+        if (GetBoolArg("-viewingkeythread", DEFAULT_VIEWINGKEY_THREAD))
+            threadGroup.create_thread(boost::bind(&ThreadScanViewingKeys, pwalletMain));
     }
 #endif
 
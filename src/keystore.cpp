@@ -5,11 +5,79 @@
 
 #include "keystore.h"
 
+#include "crypto/common.h"
 #include "key.h"
+#include "random.h"
 #include "util.h"
 
 #include <boost/foreach.hpp>
 
+CKeyIDFilter::CKeyIDFilter() : nLevels(0), nElements(0)
+{
+    nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+CKeyIDFilter::~CKeyIDFilter()
+{
+    for (unsigned int i = 0; i < nLevels; i++)
+        delete[] levels[i].pWords;
+}
+
+void CKeyIDFilter::Hash(const uint160& id, uint64_t& h1, uint64_t& h2) const
+{
+    // IDs are hashes already, but ones that others choose: salt them so
+    // that nobody can aim at the bits we have set
+    h1 = (ReadLE64(id.begin()) ^ nSalt) * 0x9e3779b97f4a7c15ULL;
+    h2 = ((ReadLE64(id.begin() + 8) + nSalt) * 0xc2b2ae3d27d4eb4fULL) | 1;
+}
+
+bool CKeyIDFilter::Probe(const Level& level, uint64_t h1, uint64_t h2, bool fInsert)
+{
+    for (unsigned int i = 0; i < NUM_HASH_FUNCS; i++) {
+        uint64_t nBit = ((h1 + i * h2) >> 7) & level.nMask;
+        uint64_t nWordMask = (uint64_t)1 << (nBit & 63);
+        std::atomic<uint64_t>& word = level.pWords[nBit >> 6];
+        if (fInsert)
+            word.fetch_or(nWordMask, std::memory_order_relaxed);
+        else if (!(word.load(std::memory_order_relaxed) & nWordMask))
+            return false;
+    }
+    return true;
+}
+
+void CKeyIDFilter::Insert(const uint160& id)
+{
+    unsigned int n = nLevels.load(std::memory_order_relaxed);
+    // Past the last level (billions of keys) the false positive rate just rises
+    if (n == 0 || (nElements >= levels[n - 1].nCapacity && n < MAX_LEVELS)) {
+        Level& level = levels[n];
+        level.nCapacity = n == 0 ? BASE_CAPACITY : levels[n - 1].nCapacity * 4;
+        size_t nWords = level.nCapacity * BITS_PER_ELEMENT / 64;
+        level.nMask = nWords * 64 - 1;
+        level.pWords = new std::atomic<uint64_t>[nWords];
+        for (size_t i = 0; i < nWords; i++)
+            level.pWords[i].store(0, std::memory_order_relaxed);
+        nElements = 0;
+        nLevels.store(++n, std::memory_order_release);
+    }
+    uint64_t h1, h2;
+    Hash(id, h1, h2);
+    Probe(levels[n - 1], h1, h2, true);
+    nElements++;
+}
+
+bool CKeyIDFilter::MayContain(const uint160& id) const
+{
+    unsigned int n = nLevels.load(std::memory_order_acquire);
+    uint64_t h1, h2;
+    Hash(id, h1, h2);
+    for (unsigned int i = 0; i < n; i++) {
+        if (Probe(levels[i], h1, h2, false))
+            return true;
+    }
+    return false;
+}
+
 bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
 {
     CKey key;
@@ -26,6 +94,7 @@ bool CKeyStore::AddKey(const CKey &key) {
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
+    keyFilter.Insert(pubkey.GetID());
     mapKeys[pubkey.GetID()] = key;
     return true;
 }
@@ -36,18 +105,23 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
         return error("CBasicKeyStore::AddCScript(): redeemScripts > %i bytes are invalid", MAX_SCRIPT_ELEMENT_SIZE);
 
     LOCK(cs_KeyStore);
+    keyFilter.Insert(CScriptID(redeemScript));
     mapScripts[CScriptID(redeemScript)] = redeemScript;
     return true;
 }
 
 bool CBasicKeyStore::HaveCScript(const CScriptID& hash) const
 {
+    if (!keyFilter.MayContain(hash))
+        return false;
     LOCK(cs_KeyStore);
     return mapScripts.count(hash) > 0;
 }
 
 bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
 {
+    if (!keyFilter.MayContain(hash))
+        return false;
     LOCK(cs_KeyStore);
     ScriptMap::const_iterator mi = mapScripts.find(hash);
     if (mi != mapScripts.end())
@@ -61,53 +135,72 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
 bool CBasicKeyStore::AddWatchOnly(const CScript &dest)
 {
     LOCK(cs_KeyStore);
-    setWatchOnly.insert(dest);
+    if (setWatchOnly.insert(dest).second) {
+        mapWatchOnlyLengths[dest.size()]++;
+        nWatchOnly = setWatchOnly.size();
+    }
     return true;
 }
 
 bool CBasicKeyStore::RemoveWatchOnly(const CScript &dest)
 {
     LOCK(cs_KeyStore);
-    setWatchOnly.erase(dest);
+    if (setWatchOnly.erase(dest)) {
+        if (--mapWatchOnlyLengths[dest.size()] == 0)
+            mapWatchOnlyLengths.erase(dest.size());
+        nWatchOnly = setWatchOnly.size();
+    }
     return true;
 }
 
 bool CBasicKeyStore::HaveWatchOnly(const CScript &dest) const
 {
+    if (nWatchOnly == 0)
+        return false;
     LOCK(cs_KeyStore);
 
     /* We assume that dest could be a script with OP_CHECKBLOCKATHEIGHT. In this case we cant search
      * for full match with watchonly scripts, cause OP_CHECKBLOCKATHEIGHT arguments are different all the time.
-     * So, instead, check that dest starts with some of the scripts from setWatchOnly */
-    auto predicate = [&dest](const CScript& script) {
-        auto res = search(begin(dest), end(dest), begin(script), end(script));
-        return res == begin(dest);
-    };
-
-    return std::find_if(setWatchOnly.begin(), setWatchOnly.end(), predicate) != setWatchOnly.end();
+     * So, instead, check that dest starts with some of the scripts from setWatchOnly, looking up
+     * each prefix of dest whose length is that of a watch-only script */
+    for (const std::pair<const unsigned int, unsigned int>& item : mapWatchOnlyLengths) {
+        if (item.first > dest.size())
+            break;
+        if (setWatchOnly.count(CScript(dest.begin(), dest.begin() + item.first)))
+            return true;
+    }
+    return false;
 }
 
 bool CBasicKeyStore::HaveWatchOnly() const
 {
-    LOCK(cs_KeyStore);
-    return (!setWatchOnly.empty());
+    return nWatchOnly > 0;
 }
 
 bool CBasicKeyStore::AddSpendingKey(const libzcash::SpendingKey &sk)
+{
+    return AddSpendingKey(sk, sk.address(), ZCNoteDecryption(sk.receiving_key()));
+}
+
+bool CBasicKeyStore::AddSpendingKey(const libzcash::SpendingKey &sk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor)
 {
     LOCK(cs_SpendingKeyStore);
-    auto address = sk.address();
     mapSpendingKeys[address] = sk;
-    mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(sk.receiving_key())));
+    mapNoteDecryptors.insert(std::make_pair(address, decryptor));
     return true;
 }
 
 bool CBasicKeyStore::AddViewingKey(const libzcash::ViewingKey &vk)
+{
+    return AddViewingKey(vk, vk.address(), ZCNoteDecryption(vk.sk_enc));
+}
+
+bool CBasicKeyStore::AddViewingKey(const libzcash::ViewingKey &vk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor)
 {
     LOCK(cs_SpendingKeyStore);
-    auto address = vk.address();
     mapViewingKeys[address] = vk;
-    mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(vk.sk_enc)));
+    mapNoteDecryptors.insert(std::make_pair(address, decryptor));
+    mapViewingKeyDecryptors.insert(std::make_pair(address, decryptor));
     return true;
 }
 
@@ -115,6 +208,7 @@ bool CBasicKeyStore::RemoveViewingKey(const libzcash::ViewingKey &vk)
 {
     LOCK(cs_SpendingKeyStore);
     mapViewingKeys.erase(vk.address());
+    mapViewingKeyDecryptors.erase(vk.address());
     return true;
 }
 
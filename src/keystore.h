@@ -17,6 +17,8 @@
 #include <boost/signals2/signal.hpp>
 #include <boost/variant.hpp>
 
+#include <atomic>
+
 /** A virtual base class for key stores */
 class CKeyStore
 {
@@ -70,6 +72,44 @@ typedef std::map<libzcash::PaymentAddress, libzcash::SpendingKey> SpendingKeyMap
 typedef std::map<libzcash::PaymentAddress, libzcash::ViewingKey> ViewingKeyMap;
 typedef std::map<libzcash::PaymentAddress, ZCNoteDecryption> NoteDecryptorMap;
 
+/**
+ * A bloom filter over the key and script IDs in a key store. It lets
+ * IsMine reject the outputs of other people without taking cs_KeyStore,
+ * which matters for wallets with many keys. Lookups may run concurrently
+ * with inserts. Inserts must be serialized by the caller. Rather than being
+ * rebuilt as it fills up, the filter adds levels of four times the size
+ * of the previous one.
+ */
+class CKeyIDFilter
+{
+private:
+    static const unsigned int MAX_LEVELS = 12;
+    static const unsigned int BASE_CAPACITY = 4096;
+    static const unsigned int BITS_PER_ELEMENT = 16;
+    static const unsigned int NUM_HASH_FUNCS = 8;
+
+    struct Level {
+        uint64_t nMask;
+        size_t nCapacity;
+        std::atomic<uint64_t>* pWords;
+    };
+    Level levels[MAX_LEVELS];
+    std::atomic<unsigned int> nLevels;
+    size_t nElements;
+    uint64_t nSalt;
+
+    static bool Probe(const Level& level, uint64_t h1, uint64_t h2, bool fInsert);
+    void Hash(const uint160& id, uint64_t& h1, uint64_t& h2) const;
+
+public:
+    CKeyIDFilter();
+    ~CKeyIDFilter();
+
+    void Insert(const uint160& id);
+    //! False if id was never inserted; true if it probably was
+    bool MayContain(const uint160& id) const;
+};
+
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
 {
@@ -77,14 +117,25 @@ protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
+    //! Key IDs of mapKeys and mapCryptedKeys, and script IDs of mapScripts
+    CKeyIDFilter keyFilter;
+    //! Number of watch-only scripts of each length, for prefix matching
+    std::map<unsigned int, unsigned int> mapWatchOnlyLengths;
+    std::atomic<size_t> nWatchOnly;
     SpendingKeyMap mapSpendingKeys;
     ViewingKeyMap mapViewingKeys;
     NoteDecryptorMap mapNoteDecryptors;
+    //! The entries of mapNoteDecryptors for mapViewingKeys
+    NoteDecryptorMap mapViewingKeyDecryptors;
 
 public:
+    CBasicKeyStore() : nWatchOnly(0) {}
+
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
     {
+        if (!keyFilter.MayContain(address))
+            return false;
         bool result;
         {
             LOCK(cs_KeyStore);
@@ -107,6 +158,8 @@ public:
     }
     bool GetKey(const CKeyID &address, CKey &keyOut) const
     {
+        if (!keyFilter.MayContain(address))
+            return false;
         {
             LOCK(cs_KeyStore);
             KeyMap::const_iterator mi = mapKeys.find(address);
@@ -128,6 +181,8 @@ public:
     virtual bool HaveWatchOnly() const;
 
     bool AddSpendingKey(const libzcash::SpendingKey &sk);
+    //! Add a spending key whose address and note decryptor are derived already
+    bool AddSpendingKey(const libzcash::SpendingKey &sk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor);
     bool HaveSpendingKey(const libzcash::PaymentAddress &address) const
     {
         bool result;
@@ -184,9 +239,17 @@ public:
     }
 
     virtual bool AddViewingKey(const libzcash::ViewingKey &vk);
+    //! Add a viewing key whose address and note decryptor are derived already
+    bool AddViewingKey(const libzcash::ViewingKey &vk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor);
     virtual bool RemoveViewingKey(const libzcash::ViewingKey &vk);
     virtual bool HaveViewingKey(const libzcash::PaymentAddress &address) const;
     virtual bool GetViewingKey(const libzcash::PaymentAddress &address, libzcash::ViewingKey& vkOut) const;
+    //! Decryptors for the addresses we only have viewing keys for
+    void GetViewingKeyDecryptors(NoteDecryptorMap &decryptorsOut) const
+    {
+        LOCK(cs_SpendingKeyStore);
+        decryptorsOut = mapViewingKeyDecryptors;
+    }
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
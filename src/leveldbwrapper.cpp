@@ -4,9 +4,16 @@
 
 #include "leveldbwrapper.h"
 
+#include "sync.h"
 #include "util.h"
+#include "utilstrencodings.h"
 
+#include <set>
+#include <sstream>
+
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -27,14 +34,18 @@ void HandleError(const leveldb::Status& status)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    size_t nBlockCache = nCacheSize / 100 * profile.nBlockCachePercent;
+    options.block_cache = leveldb::NewLRUCache(nBlockCache);
+    options.write_buffer_size = (nCacheSize - nBlockCache) / 2; // up to two write buffers may be held in memory simultaneously
+    if (profile.nBloomBits > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(profile.nBloomBits);
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = profile.nMaxOpenFiles;
+    if (profile.nBlockSize > 0)
+        options.block_size = profile.nBlockSize;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +54,37 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+//! Open databases, for getdbstats
+static CCriticalSection cs_openDatabases;
+static std::set<const CLevelDBWrapper*> setOpenDatabases;
+
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe) :
+    profile(path.filename().string())
+{
+    Init(path, nCacheSize, fMemory, fWipe);
+}
+
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, const CLevelDBProfile& profileIn, bool fMemory, bool fWipe) :
+    profile(profileIn)
+{
+    Init(path, nCacheSize, fMemory, fWipe);
+}
+
+void CLevelDBWrapper::Init(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
 {
     penv = NULL;
+    nReads = 0;
+    nReadBytes = 0;
+    nWrites = 0;
+    nWriteBytes = 0;
+    nCompactions = 0;
+    nBytesSinceCompaction = 0;
+    fCompacting = false;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -64,13 +98,26 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
     }
+    LogPrint("leveldb", "LevelDB %s: max_open_files=%d bloom_bits=%d compression=%d block_cache=%u write_buffer=%u\n",
+             profile.strName, options.max_open_files, profile.nBloomBits, profile.fCompression,
+             nCacheSize / 100 * profile.nBlockCachePercent, options.write_buffer_size);
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+
+    LOCK(cs_openDatabases);
+    setOpenDatabases.insert(this);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper()
 {
+    {
+        LOCK(cs_openDatabases);
+        setOpenDatabases.erase(this);
+    }
+    // A running compaction cannot be interrupted, wait for it to finish
+    if (compactor.joinable())
+        compactor.join();
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -85,5 +132,95 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     HandleError(status);
+    nWrites++;
+    nWriteBytes += batch.nSize;
+    if (profile.nCompactAfterBytes > 0) {
+        nBytesSinceCompaction += batch.nSize;
+        bool fExpected = false;
+        // Writes go on while LevelDB compacts; if the previous compaction is
+        // still running the trigger is kept for the next batch.
+        if (nBytesSinceCompaction >= profile.nCompactAfterBytes && fCompacting.compare_exchange_strong(fExpected, true)) {
+            nBytesSinceCompaction = 0;
+            if (compactor.joinable())
+                compactor.join();
+            compactor = boost::thread(boost::bind(&CLevelDBWrapper::ThreadCompact, this));
+        }
+    }
     return true;
 }
+
+void CLevelDBWrapper::ThreadCompact()
+{
+    RenameThread("horizen-dbcompact");
+    int64_t nStart = GetTimeMillis();
+    pdb->CompactRange(NULL, NULL);
+    nCompactions++;
+    LogPrint("leveldb", "Compacted LevelDB %s in %dms\n", profile.strName, GetTimeMillis() - nStart);
+    fCompacting = false;
+}
+
+void CLevelDBWrapper::GetStats(CLevelDBStats& stats) const
+{
+    stats.strName = profile.strName;
+    stats.nReads = nReads;
+    stats.nReadBytes = nReadBytes;
+    stats.nWrites = nWrites;
+    stats.nWriteBytes = nWriteBytes;
+    stats.nCompactions = nCompactions;
+
+    std::string strValue;
+    for (int level = 0; ; level++) {
+        if (!pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", level), &strValue))
+            break;
+        stats.vFilesPerLevel.push_back(atoi(strValue));
+    }
+
+    if (pdb->GetProperty("leveldb.stats", &strValue))
+        ParseLevelDBStats(strValue, stats);
+}
+
+void ParseLevelDBStats(const std::string& strStats, CLevelDBStats& stats)
+{
+    // The compaction table of "leveldb.stats" has one line per level:
+    // Level Files Size(MB) Time(sec) Read(MB) Write(MB)
+    std::istringstream ss(strStats);
+    std::string strLine;
+    while (std::getline(ss, strLine)) {
+        int nLevel, nFiles;
+        double dSize, dTime, dRead, dWrite;
+        if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWrite) != 6)
+            continue;
+        stats.nSizeBytes += (uint64_t)(dSize * 1048576);
+        stats.nCompactionReadBytes += (uint64_t)(dRead * 1048576);
+        stats.nCompactionWriteBytes += (uint64_t)(dWrite * 1048576);
+    }
+}
+
+double CLevelDBStats::WriteAmplification() const
+{
+    if (nWriteBytes == 0)
+        return 0;
+    // Every byte is written once to the log, then by every compaction that moves it.
+    return (double)(nWriteBytes + nCompactionWriteBytes) / nWriteBytes;
+}
+
+int CLevelDBStats::ReadAmplification() const
+{
+    // Level 0 files may overlap and are all probed, deeper levels contribute one file each.
+    int nProbes = vFilesPerLevel.empty() ? 0 : vFilesPerLevel[0];
+    for (size_t i = 1; i < vFilesPerLevel.size(); i++) {
+        if (vFilesPerLevel[i] > 0)
+            nProbes++;
+    }
+    return nProbes;
+}
+
+void GetAllLevelDBStats(std::vector<CLevelDBStats>& vStats)
+{
+    LOCK(cs_openDatabases);
+    BOOST_FOREACH(const CLevelDBWrapper* pdb, setOpenDatabases) {
+        CLevelDBStats stats;
+        pdb->GetStats(stats);
+        vStats.push_back(stats);
+    }
+}
@@ -11,7 +11,11 @@
 #include "util.h"
 #include "version.h"
 
+#include <atomic>
+#include <vector>
+
 #include <boost/filesystem/path.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
@@ -24,6 +28,58 @@ public:
 
 void HandleError(const leveldb::Status& status);
 
+/**
+ * Per-database LevelDB tuning. The defaults reproduce the settings every
+ * database used before profiles were introduced.
+ */
+struct CLevelDBProfile
+{
+    //! Name used in the log and in getdbstats
+    std::string strName;
+    int nMaxOpenFiles;
+    //! Bits per key of the bloom filter, 0 disables the filter
+    int nBloomBits;
+    //! Snappy block compression; stored uncompressed if LevelDB was built without Snappy
+    bool fCompression;
+    //! Uncompressed size of a table block, 0 keeps the LevelDB default
+    size_t nBlockSize;
+    //! Share of the cache given to the block cache, the rest is split over two write buffers
+    int nBlockCachePercent;
+    //! Compact the whole database in the background after this many bytes were written, 0 disables
+    uint64_t nCompactAfterBytes;
+
+    CLevelDBProfile(const std::string& strNameIn = "leveldb") :
+        strName(strNameIn), nMaxOpenFiles(64), nBloomBits(10), fCompression(false),
+        nBlockSize(0), nBlockCachePercent(50), nCompactAfterBytes(0) {}
+};
+
+/** I/O counters and LevelDB internals of one open database */
+struct CLevelDBStats
+{
+    std::string strName;
+    uint64_t nReads;
+    uint64_t nReadBytes;
+    uint64_t nWrites;
+    uint64_t nWriteBytes;
+    uint64_t nCompactions;
+    //! Bytes read and written by background compactions
+    uint64_t nCompactionReadBytes;
+    uint64_t nCompactionWriteBytes;
+    uint64_t nSizeBytes;
+    std::vector<int> vFilesPerLevel;
+
+    CLevelDBStats() : nReads(0), nReadBytes(0), nWrites(0), nWriteBytes(0), nCompactions(0),
+                      nCompactionReadBytes(0), nCompactionWriteBytes(0), nSizeBytes(0) {}
+
+    //! Bytes written to disk per byte written by the application
+    double WriteAmplification() const;
+    //! Worst-case number of table files probed by a point lookup
+    int ReadAmplification() const;
+};
+
+/** Add the table sizes and compaction traffic of a "leveldb.stats" property value to stats */
+void ParseLevelDBStats(const std::string& strStats, CLevelDBStats& stats);
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -31,8 +87,11 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSize;
 
 public:
+    CLevelDBBatch() : nSize(0) {}
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +106,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSize += slKey.size() + slValue.size();
     }
 
     template <typename K>
@@ -58,6 +118,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSize += slKey.size();
     }
 };
 
@@ -85,8 +146,26 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    CLevelDBProfile profile;
+
+    //! I/O counters reported by getdbstats
+    mutable std::atomic<uint64_t> nReads;
+    mutable std::atomic<uint64_t> nReadBytes;
+    std::atomic<uint64_t> nWrites;
+    std::atomic<uint64_t> nWriteBytes;
+    std::atomic<uint64_t> nCompactions;
+    std::atomic<uint64_t> nBytesSinceCompaction;
+
+    //! Background compaction started by nCompactAfterBytes, at most one at a time
+    boost::thread compactor;
+    std::atomic<bool> fCompacting;
+
+    void Init(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe);
+    void ThreadCompact();
+
 public:
     CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, const CLevelDBProfile& profileIn, bool fMemory = false, bool fWipe = false);
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
@@ -99,6 +178,8 @@ public:
 
         std::string strValue;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        nReads++;
+        nReadBytes += strValue.size();
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -132,6 +213,8 @@ public:
 
         std::string strValue;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        nReads++;
+        nReadBytes += strValue.size();
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -168,6 +251,11 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    void GetStats(CLevelDBStats& stats) const;
 };
 
+/** Collect the statistics of every open database */
+void GetAllLevelDBStats(std::vector<CLevelDBStats>& vStats);
+
 #endif // BITCOIN_LEVELDBWRAPPER_H
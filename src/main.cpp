@@ -13,12 +13,14 @@
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "deprecation.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "pow.h"
 #include "txdb.h"
+#include "txrecon.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -27,6 +29,8 @@
 #include "wallet/asyncrpcoperation_sendmany.h"
 #include "wallet/asyncrpcoperation_shieldcoinbase.h"
 
+#include <atomic>
+#include <memory>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -66,6 +70,8 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nTxAdmissionThreads = 0;
+int nBlockPreValidationThreads = 0;
 bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
@@ -90,9 +96,17 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
+};
+struct COrphanPeer {
+    size_t nUsage;
+    set<uint256> setOrphans;
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer GUARDED_BY(cs_main);
+size_t nOrphanTxUsage GUARDED_BY(cs_main) = 0;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -243,6 +257,21 @@ namespace {
     set<int> setDirtyFileInfo;
 } // anon namespace
 
+int64_t UpdateMovingAverage(int64_t nAverage, int64_t nSample)
+{
+    if (nAverage == 0)
+        return nSample;
+    return nAverage + (nSample - nAverage) / 4;
+}
+
+int GetMaxBlocksInFlight(int64_t nBlockDeliveryTime)
+{
+    if (nBlockDeliveryTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = BLOCK_DOWNLOAD_QUEUE_TIME * 1000000LL / nBlockDeliveryTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nBlocks, MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER));
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -290,6 +319,14 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! When the last block we requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockDelivered;
+    //! Moving average of the time this peer takes to send one block (in microseconds), or 0 if not measured yet.
+    int64_t nBlockDeliveryTime;
+    //! Moving average of the rate at which this peer sends blocks, in bytes per second.
+    int64_t nBlockDownloadRate;
+    //! Moving average of the time from requesting a block to receiving it (in microseconds).
+    int64_t nBlockLatency;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -303,6 +340,10 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        nLastBlockDelivered = 0;
+        nBlockDeliveryTime = 0;
+        nBlockDownloadRate = 0;
+        nBlockLatency = 0;
     }
 };
 
@@ -371,12 +412,35 @@ void FinalizeNode(NodeId nodeid) {
     mapNodeState.erase(nodeid);
 }
 
+// Requires cs_main.
+// Record the delivery of a block we requested from this peer.
+void UpdateBlockDownloadStats(CNodeState *state, const QueuedBlock& entry, unsigned int nBlockSize)
+{
+    int64_t nNow = GetTimeMicros();
+    // Blocks arrive in the order they were requested, so the peer started on this one
+    // when it finished the previous one, or when we asked for it if it was idle.
+    int64_t nDeliveryTime = std::max<int64_t>(nNow - std::max(state->nLastBlockDelivered, entry.nTime), 1);
+    state->nLastBlockDelivered = nNow;
+    state->nBlockDeliveryTime = UpdateMovingAverage(state->nBlockDeliveryTime, nDeliveryTime);
+    state->nBlockDownloadRate = UpdateMovingAverage(state->nBlockDownloadRate, nBlockSize * 1000000LL / nDeliveryTime);
+    state->nBlockLatency = UpdateMovingAverage(state->nBlockLatency, nNow - entry.nTime);
+}
+
+// Requires cs_main.
+int GetMaxBlocksInFlight(const CNodeState *state)
+{
+    return ::GetMaxBlocksInFlight(state->nBlockDeliveryTime);
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// If the block was delivered by the peer we requested it from, nodeFrom and nBlockSize update its download statistics.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom && nBlockSize > 0)
+            UpdateBlockDownloadStats(state, *itInFlight->second.second, nBlockSize);
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -458,8 +522,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If nothing can be fetched because the download window is full, nodeStaller
+ *  and pindexStalled are set to the peer and the in-flight block holding the window back. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
     {
         LogPrint("forks", "%s():%d - peer has too many blocks in fligth\n", __func__, __LINE__);
@@ -498,6 +563,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -529,6 +595,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     LogPrint("forks", "%s():%d - could not fetch [%s]\n", __func__, __LINE__, pindex->GetBlockHash().ToString() );
                     return;
@@ -540,6 +607,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -559,6 +627,9 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nMaxBlocksInFlight = GetMaxBlocksInFlight(state);
+    stats.nBlockDownloadRate = state->nBlockDownloadRate;
+    stats.nBlockLatency = state->nBlockLatency;
     return true;
 }
 
@@ -597,6 +668,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewAsyncFlush *pcoinsAsyncFlush = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -614,8 +686,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is bounded by -maxorphantxsize, see LimitOrphanTxSize.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, tx.nVersion);
     if (sz > 5000)
     {
@@ -623,13 +694,27 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // Approximate memory held for the orphan: the transaction itself, its
+    // entry in mapOrphanTransactions and one index entry per input.
+    size_t nUsage = RecursiveDynamicUsage(tx) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const uint256, COrphanTx> >)) +
+        tx.vin.size() * memusage::MallocUsage(sizeof(memusage::stl_tree_node<uint256>));
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nUsage = nUsage;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+
+    COrphanPeer& orphanPeer = mapOrphanTransactionsByPeer[peer];
+    orphanPeer.nUsage += nUsage;
+    orphanPeer.setOrphans.insert(hash);
+    nOrphanTxUsage += nUsage;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTxUsage);
     return true;
 }
 
@@ -640,37 +725,99 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         return;
     BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end())
+    {
+        itPeer->second.nUsage -= it->second.nUsage;
+        itPeer->second.setOrphans.erase(hash);
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTxUsage -= it->second.nUsage;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+
+    // EraseOrphanTx drops the peer's entry along with its last orphan
+    vector<uint256> vErase(itPeer->second.setOrphans.begin(), itPeer->second.setOrphans.end());
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
+}
+
+/** Pick a random member of a non-empty set of hashes. */
+static const uint256& RandomOrphanHash(const set<uint256>& setHashes)
+{
+    set<uint256>::const_iterator it = setHashes.lower_bound(GetRandHash());
+    if (it == setHashes.end())
+        it = setHashes.begin();
+    return *it;
+}
+
+/**
+ * Bound the orphan pool: drop expired orphans, then make every peer holding
+ * more than 1/ORPHAN_TX_PEER_SHARE of nMaxUsage bytes shed its own orphans,
+ * then evict at random until at most nMaxOrphans orphans using at most
+ * nMaxUsage bytes are left.  Returns the number of orphans evicted for
+ * space, expired ones not included.
+ */
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    static int64_t nNextSweep = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow)
     {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
+        // Sweep out expired orphans, then wait until the oldest survivor can
+        // have expired, but no less than ORPHAN_TX_EXPIRE_INTERVAL
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
         }
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
     }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
 
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // A peer flooding us with orphans only pushes out its own
+    size_t nMaxPeerUsage = nMaxUsage / ORPHAN_TX_PEER_SHARE;
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+    while (itPeer != mapOrphanTransactionsByPeer.end())
+    {
+        NodeId peer = itPeer->first;
+        ++itPeer; // the entry goes away with the peer's last orphan
+        map<NodeId, COrphanPeer>::iterator it;
+        while ((it = mapOrphanTransactionsByPeer.find(peer)) != mapOrphanTransactionsByPeer.end() &&
+               it->second.nUsage > nMaxPeerUsage)
+        {
+            EraseOrphanTx(RandomOrphanHash(it->second.setOrphans));
+            ++nEvicted;
+        }
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxUsage > nMaxUsage)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -995,12 +1142,8 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
         return false;
     }
 
-    // Ensure that zk-SNARKs verify
-    BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-        if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
-            return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
-                                REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
-        }
+    if (!CheckTransactionProofs(tx, state, verifier)) {
+        return false;
     }
 
     // Check for vout's without OP_CHECKBLOCKATHEIGHT opcode
@@ -1019,6 +1162,18 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     return true;
 }
 
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier)
+{
+    // Ensure that zk-SNARKs verify
+    BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+        if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+            return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
+                                REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+        }
+    }
+    return true;
+}
+
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
 {
     // Basic checks that don't depend on any context
@@ -1214,7 +1369,7 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fProofsVerified)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1233,7 +1388,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     }
 
 
-    auto verifier = libzcash::ProofVerifier::Strict();
+    auto verifier = fProofsVerified ? libzcash::ProofVerifier::Disabled() : libzcash::ProofVerifier::Strict();
     if (!CheckTransaction(tx, state, verifier))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
@@ -1704,6 +1859,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2206,6 +2362,60 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+namespace {
+
+/** Closure representing the Equihash solution and proof of work check of a block header */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+
+public:
+    CHeaderCheck() : pheader(NULL) {}
+    CHeaderCheck(const CBlockHeader& header) : pheader(&header) {}
+
+    bool operator()() {
+        return CheckEquihashSolution(pheader, Params()) &&
+               CheckProofOfWork(pheader->GetHash(), pheader->nBits, Params().GetConsensus());
+    }
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+    }
+};
+
+} // anon namespace
+
+static CCheckQueue<CHeaderCheck> headercheckqueue(8);
+//! Held while feeding headercheckqueue, which serves one master thread at a time
+static boost::mutex csHeaderCheckQueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("horizen-hdrcheck");
+    headercheckqueue.Thread();
+}
+
+bool CheckBlockHeadersPoW(const std::vector<CBlockHeader>& headers)
+{
+    std::vector<CHeaderCheck> vChecks;
+    vChecks.reserve(headers.size());
+    BOOST_FOREACH(const CBlockHeader& header, headers)
+        vChecks.push_back(CHeaderCheck(header));
+
+    if (nScriptCheckThreads == 0) {
+        BOOST_FOREACH(CHeaderCheck& check, vChecks) {
+            if (!check())
+                return false;
+        }
+        return true;
+    }
+
+    boost::unique_lock<boost::mutex> lock(csHeaderCheckQueue);
+    CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2313,6 +2523,139 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
+/** Whether ConnectBlock runs script and proof checks on this block, that is, whether it is not an ancestor of the last checkpoint. */
+static bool ExpensiveChecksEnabled(const CBlockIndex* pindex)
+{
+    if (fCheckpointsEnabled) {
+        CBlockIndex *pindexLastCheckpoint = Checkpoints::GetLastCheckpoint(Params().Checkpoints());
+        if (pindexLastCheckpoint && pindexLastCheckpoint->GetAncestor(pindex->nHeight) == pindex)
+            return false;
+    }
+    return true;
+}
+
+//
+// During initial block download, the JoinSplit proofs of blocks that are stored
+// ahead of the tip are verified on a pool of threads, so proof verification
+// overlaps with the download instead of running serially in ConnectBlock.
+// ConnectBlock skips the proofs of a block that passed, and leaves a block
+// that failed to its own checks so that it is rejected the usual way.
+//
+namespace {
+
+struct CBlockPreValidation
+{
+    uint256 hash;
+    int nHeight;
+    std::shared_ptr<const CBlock> pblock;
+};
+
+boost::mutex csBlockPreValidation;
+boost::condition_variable condBlockPreValidation;
+//! Blocks waiting for a pre-validation thread
+std::deque<CBlockPreValidation> dequeBlockPreValidation;
+//! Blocks queued or being checked
+std::set<uint256> setBlocksPreValidating;
+//! Heights of the blocks whose proofs all verified, until ConnectBlock takes the result
+std::map<uint256, int> mapBlocksProofsVerified;
+
+/** Record a verified block, unless results of blocks never connected fill the window; csBlockPreValidation is held */
+void AddBlockProofsVerified(const uint256& hash, int nHeight)
+{
+    if (mapBlocksProofsVerified.size() >= BLOCK_DOWNLOAD_WINDOW) {
+        LogPrintf("%s: too many blocks verified ahead of the tip, discarding the result of block %s\n", __func__, hash.ToString());
+        return;
+    }
+    mapBlocksProofsVerified.insert(std::make_pair(hash, nHeight));
+}
+
+} // anon namespace
+
+bool QueueBlockPreValidation(const CBlock& block, int nHeight)
+{
+    uint256 hash = block.GetHash();
+    boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+    if (dequeBlockPreValidation.size() >= MAX_BLOCK_PREVALIDATION_QUEUE ||
+        setBlocksPreValidating.count(hash) || mapBlocksProofsVerified.count(hash))
+        return false;
+    dequeBlockPreValidation.push_back(CBlockPreValidation{hash, nHeight, std::make_shared<const CBlock>(block)});
+    setBlocksPreValidating.insert(hash);
+    condBlockPreValidation.notify_one();
+    return true;
+}
+
+bool TakeBlockPreValidation(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+    for (auto it = dequeBlockPreValidation.begin(); it != dequeBlockPreValidation.end(); ++it) {
+        if (it->hash == hash) {
+            dequeBlockPreValidation.erase(it);
+            setBlocksPreValidating.erase(hash);
+            return false;
+        }
+    }
+    while (setBlocksPreValidating.count(hash))
+        condBlockPreValidation.wait(lock);
+    return mapBlocksProofsVerified.erase(hash) > 0;
+}
+
+void MarkBlockProofsVerified(const uint256& hash, int nHeight)
+{
+    boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+    AddBlockProofsVerified(hash, nHeight);
+}
+
+int PruneBlockPreValidation(int nHeight)
+{
+    boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+    int nPruned = 0;
+    for (auto it = mapBlocksProofsVerified.begin(); it != mapBlocksProofsVerified.end(); ) {
+        if (it->second <= nHeight) {
+            LogPrint("bench", "%s: discarding the result of block %s at height %d, not connected\n", __func__, it->first.ToString(), it->second);
+            mapBlocksProofsVerified.erase(it++);
+            nPruned++;
+        } else {
+            ++it;
+        }
+    }
+    return nPruned;
+}
+
+void ThreadBlockPreValidation()
+{
+    RenameThread("horizen-blkcheck");
+
+    while (true) {
+        CBlockPreValidation item;
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+            while (dequeBlockPreValidation.empty())
+                condBlockPreValidation.wait(lock);
+            item = dequeBlockPreValidation.front();
+            dequeBlockPreValidation.pop_front();
+        }
+
+        CValidationState state;
+        auto verifier = libzcash::ProofVerifier::Strict();
+        bool fVerified = true;
+        BOOST_FOREACH(const CTransaction& tx, item.pblock->vtx) {
+            if (!CheckTransactionProofs(tx, state, verifier)) {
+                LogPrintf("%s: proofs of block %s do not verify, leaving them to ConnectBlock\n", __func__, item.hash.ToString());
+                fVerified = false;
+                break;
+            }
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPreValidation);
+            setBlocksPreValidating.erase(item.hash);
+            if (fVerified)
+                AddBlockProofsVerified(item.hash, item.nHeight);
+        }
+        condBlockPreValidation.notify_all();
+    }
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2324,20 +2667,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
 
-    bool fExpensiveChecks = true;
-    if (fCheckpointsEnabled) {
-        CBlockIndex *pindexLastCheckpoint = Checkpoints::GetLastCheckpoint(chainparams.Checkpoints());
-        if (pindexLastCheckpoint && pindexLastCheckpoint->GetAncestor(pindex->nHeight) == pindex) {
-            // This block is an ancestor of a checkpoint: disable script checks
-            fExpensiveChecks = false;
-        }
-    }
+    // If this block is an ancestor of a checkpoint, disable script checks
+    bool fExpensiveChecks = ExpensiveChecksEnabled(pindex);
+
+    // Proofs a pre-validation thread verified need not be verified again
+    bool fVerifyProofs = fExpensiveChecks && (fJustCheck || !TakeBlockPreValidation(block.GetHash()));
 
     auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
     // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, fVerifyProofs ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2620,8 +2960,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With a background writer this only freezes the dirty entries and
+        // hands them over; validation continues against the frozen layer.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Shutdown and pruning need the chainstate to actually be on disk.
+        if (pcoinsAsyncFlush && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsAsyncFlush->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2818,6 +3163,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Blocks verified ahead of the tip that were not connected by now are on a fork
+    PruneBlockPreValidation(pindexNew->nHeight);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -3662,7 +4009,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool lookForwardTips)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool lookForwardTips, bool fCheckPOW)
 {
     dump_global_tips(10);
 
@@ -3686,7 +4033,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -3804,7 +4151,8 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1,
+                                              ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3819,6 +4167,17 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
         CheckBlockIndex();
         if (!ret)
             return error("%s: AcceptBlock FAILED", __func__);
+
+        // A block that does not extend the tip waits for at least one other block to be
+        // connected first: use that time to verify its proofs
+        if (nBlockPreValidationThreads > 0 && pindex && pindex->pprev != chainActive.Tip() &&
+            !chainActive.Contains(pindex) && IsInitialBlockDownload() && ExpensiveChecksEnabled(pindex)) {
+            bool fHasJoinSplits = false;
+            BOOST_FOREACH(const CTransaction& tx, pblock->vtx)
+                fHasJoinSplits |= !tx.vjoinsplit.empty();
+            if (fHasJoinSplits)
+                QueueBlockPreValidation(*pblock, pindex->nHeight);
+        }
     }
 
     if (!ActivateBestChain(state, pblock))
@@ -4268,6 +4627,8 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanTransactionsByPeer.clear();
+    nOrphanTxUsage = 0;
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4450,6 +4811,313 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+//
+// A reindex first indexes the positions of the blocks in all block files in
+// parallel, reading only their headers.  It then rebuilds the block tree from
+// the headers and processes the blocks in height order from the genesis block,
+// so no block waits on disk for its parent.  Reader threads read the blocks
+// ahead of the one being connected and verify their JoinSplit proofs.
+//
+namespace {
+
+/** A block found in a block file */
+struct CBlockFileEntry
+{
+    uint256 hash;
+    uint256 hashPrev;
+    CDiskBlockPos pos;
+};
+
+/** A block to reindex, in height order */
+struct CReindexBlock
+{
+    uint256 hash;
+    CDiskBlockPos pos;
+    int nHeight;
+    int nParent;            //! position of the parent in the order, -1 for the genesis block
+    bool fKnown;            //! already indexed with its data by an interrupted reindex
+    bool fProofsTrusted;    //! ancestor of the last checkpoint, so ConnectBlock would not verify its proofs
+};
+
+/** A block read ahead of the one being connected */
+struct CReindexRead
+{
+    CBlock block;
+    bool fRead;
+    bool fProofsVerified;
+};
+
+/** Interrupt and join a group of threads on leaving scope */
+class CThreadGroupJoiner
+{
+public:
+    CThreadGroupJoiner(boost::thread_group& groupIn) : group(groupIn) {}
+    ~CThreadGroupJoiner()
+    {
+        boost::this_thread::disable_interruption di;
+        group.interrupt_all();
+        group.join_all();
+    }
+private:
+    boost::thread_group& group;
+};
+
+/** Index the blocks of the block files claimed from nNextFile, skipping over their transactions */
+void ThreadScanBlockFiles(std::atomic<int>* pnNextFile, std::vector<std::vector<CBlockFileEntry> >* pvEntries)
+{
+    int nFile;
+    while ((nFile = (*pnNextFile)++) < (int)pvEntries->size()) {
+        CDiskBlockPos pos(nFile, 0);
+        FILE *file = OpenBlockFile(pos, true);
+        if (!file)
+            continue; // This error is logged in OpenBlockFile
+        LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+        std::vector<CBlockFileEntry>& vEntries = (*pvEntries)[nFile];
+        try {
+            // This takes over file and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(file, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                boost::this_thread::interruption_point();
+
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read the block header only
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    CBlockHeader header;
+                    blkdat >> header;
+                    vEntries.push_back(CBlockFileEntry{header.GetHash(), header.hashPrevBlock, CDiskBlockPos(nFile, nBlockPos)});
+
+                    // and skip over the transactions
+                    blkdat.SetLimit();
+                    if (!blkdat.Seek(nBlockPos + nSize))
+                        break;
+                    nRewind = nBlockPos + nSize;
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                }
+            }
+        } catch (const std::runtime_error& e) {
+            AbortNode(std::string("System error: ") + e.what());
+        }
+    }
+}
+
+/**
+ * Reads the blocks to reindex, up to MAX_BLOCK_PREVALIDATION_QUEUE ahead of the one
+ * being connected, and verifies their proofs.
+ */
+class CReindexReader
+{
+public:
+    CReindexReader(const std::vector<CReindexBlock>& vOrderIn, int nThreads) :
+        vOrder(vOrderIn), nNextRead(0), nNextTake(0), joiner(threads)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CReindexReader::ThreadRead, this));
+    }
+
+    /** Wait for the block at position i of the order to be read, and take it */
+    void Take(size_t i, CReindexRead& read)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<size_t, CReindexRead>::iterator it;
+        while ((it = mapRead.find(i)) == mapRead.end())
+            cond.wait(lock);
+        read = std::move(it->second);
+        mapRead.erase(it);
+        nNextTake = i + 1;
+        cond.notify_all();
+    }
+
+private:
+    void ThreadRead()
+    {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (nNextRead < vOrder.size() && nNextRead >= nNextTake + MAX_BLOCK_PREVALIDATION_QUEUE)
+                    cond.wait(lock);
+                if (nNextRead >= vOrder.size())
+                    return;
+                i = nNextRead++;
+            }
+
+            const CReindexBlock& entry = vOrder[i];
+            CReindexRead read;
+            read.fRead = false;
+            read.fProofsVerified = false;
+            if (!entry.fKnown) {
+                read.fRead = ReadBlockFromDisk(read.block, entry.pos) && read.block.GetHash() == entry.hash;
+                if (read.fRead && entry.fProofsTrusted) {
+                    read.fProofsVerified = true;
+                } else if (read.fRead) {
+                    bool fHasJoinSplits = false;
+                    BOOST_FOREACH(const CTransaction& tx, read.block.vtx)
+                        fHasJoinSplits |= !tx.vjoinsplit.empty();
+                    if (fHasJoinSplits) {
+                        CValidationState state;
+                        auto verifier = libzcash::ProofVerifier::Strict();
+                        read.fProofsVerified = true;
+                        BOOST_FOREACH(const CTransaction& tx, read.block.vtx) {
+                            if (!CheckTransactionProofs(tx, state, verifier)) {
+                                read.fProofsVerified = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                mapRead[i] = std::move(read);
+            }
+            cond.notify_all();
+        }
+    }
+
+    const std::vector<CReindexBlock>& vOrder;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::map<size_t, CReindexRead> mapRead;
+    size_t nNextRead;
+    size_t nNextTake;
+    boost::thread_group threads;
+    CThreadGroupJoiner joiner;
+};
+
+} // anon namespace
+
+bool ReindexBlockFiles()
+{
+    const CChainParams& chainparams = Params();
+    int64_t nStart = GetTimeMillis();
+    int nThreads = std::max(nBlockPreValidationThreads, 1);
+
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    // Index the positions of the blocks in all files
+    std::vector<std::vector<CBlockFileEntry> > vEntries(nFiles);
+    {
+        std::atomic<int> nNextFile(0);
+        boost::thread_group scanners;
+        CThreadGroupJoiner joiner(scanners);
+        for (int i = 0; i < std::min(nThreads, nFiles); i++)
+            scanners.create_thread(boost::bind(&ThreadScanBlockFiles, &nNextFile, &vEntries));
+        scanners.join_all();
+    }
+    boost::this_thread::interruption_point();
+
+    // Rebuild the block tree from the headers, and order it by height from the genesis block.
+    // Blocks that do not descend from it are left out, as their parents are missing.
+    std::multimap<uint256, const CBlockFileEntry*> mapChildren;
+    std::vector<CReindexBlock> vOrder;
+    BOOST_FOREACH(const std::vector<CBlockFileEntry>& vFileEntries, vEntries) {
+        BOOST_FOREACH(const CBlockFileEntry& entry, vFileEntries) {
+            if (entry.hash == chainparams.GetConsensus().hashGenesisBlock) {
+                if (vOrder.empty())
+                    vOrder.push_back(CReindexBlock{entry.hash, entry.pos, 0, -1, false, false});
+            } else {
+                mapChildren.insert(std::make_pair(entry.hashPrev, &entry));
+            }
+        }
+    }
+    for (size_t i = 0; i < vOrder.size(); i++) {
+        std::set<uint256> setChildren;
+        auto range = mapChildren.equal_range(vOrder[i].hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            // A block stored twice is a child of the same parent twice
+            if (setChildren.insert(it->second->hash).second)
+                vOrder.push_back(CReindexBlock{it->second->hash, it->second->pos, vOrder[i].nHeight + 1, (int)i, false, false});
+        }
+    }
+    mapChildren.clear();
+
+    // Ancestors of the last checkpoint skip proof verification in ConnectBlock once the
+    // checkpoint is indexed; as the tree is known in advance, skip it for them right away
+    if (fCheckpointsEnabled) {
+        const Checkpoints::MapCheckpoints& checkpoints = chainparams.Checkpoints().mapCheckpoints;
+        bool fFound = false;
+        for (auto it = checkpoints.rbegin(); it != checkpoints.rend() && !fFound; ++it) {
+            for (size_t i = 0; i < vOrder.size() && !fFound; i++) {
+                if (vOrder[i].nHeight == it->first && vOrder[i].hash == it->second) {
+                    for (int j = (int)i; j >= 0; j = vOrder[j].nParent)
+                        vOrder[j].fProofsTrusted = true;
+                    fFound = true;
+                }
+            }
+        }
+    }
+
+    {
+        // Blocks already indexed by an interrupted reindex need not be read again
+        LOCK(cs_main);
+        BOOST_FOREACH(CReindexBlock& entry, vOrder) {
+            BlockMap::iterator mi = mapBlockIndex.find(entry.hash);
+            entry.fKnown = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+        }
+    }
+    LogPrintf("Indexed %u blocks in %d block files in %dms\n", vOrder.size(), nFiles, GetTimeMillis() - nStart);
+
+    int nLoaded = 0;
+    {
+        CReindexReader reader(vOrder, nThreads);
+        for (size_t i = 0; i < vOrder.size(); i++) {
+            boost::this_thread::interruption_point();
+
+            const CReindexBlock& entry = vOrder[i];
+            CReindexRead read;
+            reader.Take(i, read);
+            if (entry.fKnown) {
+                if (entry.nHeight % 1000 == 0)
+                    LogPrintf("Block Import: already had block %s at height %d\n", entry.hash.ToString(), entry.nHeight);
+                continue;
+            }
+            if (!read.fRead) {
+                LogPrintf("%s: could not read block %s at %s\n", __func__, entry.hash.ToString(), entry.pos.ToString());
+                continue;
+            }
+
+            if (read.fProofsVerified)
+                MarkBlockProofsVerified(entry.hash, entry.nHeight);
+            CValidationState state;
+            CDiskBlockPos pos = entry.pos;
+            if (ProcessNewBlock(state, NULL, &read.block, true, &pos))
+                nLoaded++;
+            if (state.IsError())
+                break;
+        }
+    }
+    LogPrintf("Reindexed %i blocks in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
 void static CheckBlockIndex()
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -4715,6 +5383,31 @@ std::string GetWarnings(const std::string& strFor)
 
 
 
+namespace {
+
+struct CTxAdmission
+{
+    CTransaction tx;
+    CNode* pfrom;           //! referenced until the transaction is processed
+    uint64_t nSequence;
+};
+
+boost::mutex csTxAdmission;
+boost::condition_variable condTxAdmission;
+std::deque<CTxAdmission> dequeTxAdmission;
+uint64_t nTxAdmissionQueued = 0;    //! sequence number of the next transaction queued
+uint64_t nTxAdmissionTurn = 0;      //! sequence number of the next transaction to accept
+/** Transactions queued or being checked, so they are neither fetched nor checked again */
+std::set<uint256> setTxAdmissionPending;
+
+} // anon namespace
+
+static bool IsTxAdmissionPending(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csTxAdmission);
+    return setTxAdmissionPending.count(hash) > 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Messages
@@ -4738,7 +5431,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            return recentRejects->contains(inv.hash) ||
+            return IsTxAdmissionPending(inv.hash) ||
+                   recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
                    pcoinsTip->HaveCoins(inv.hash);
@@ -4750,14 +5444,19 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+namespace {
+/** The last block message sent, shared by the peers asking for the same block */
+CCriticalSection cs_lastBlockMessage;
+uint256 hashLastBlockMessage GUARDED_BY(cs_lastBlockMessage);
+CSerializedMessage msgLastBlock GUARDED_BY(cs_lastBlockMessage);
+} // anon namespace
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4770,56 +5469,99 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Only the decision whether to serve the block needs cs_main; the block
+                // itself is read from disk and pushed without holding it.
+                CBlockIndex* pindex = NULL;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-
-                        // this is set by ConnectBlock method, when a new tip is added to the main chain
-                        bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
-                        bool b2 = (pindexBestHeader != NULL) &&
-                                  (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                                  (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-
-                        send = b1 && b2;
-                        if (!send)
-                        {
-                            if (b2)
-                            {
-                                // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
-                                // propagate also when relevant blocks are on a fork. Consider that a further check
-                                // on BLOCK_HAVE_DATA is performed below
-                                LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
-                                send = true;
-                            }
-                            else
+                    LOCK(cs_main);
+
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+
+                            // this is set by ConnectBlock method, when a new tip is added to the main chain
+                            bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
+                            bool b2 = (pindexBestHeader != NULL) &&
+                                      (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                      (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+
+                            send = b1 && b2;
+                            if (!send)
                             {
-                                LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                if (b2)
+                                {
+                                    // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
+                                    // propagate also when relevant blocks are on a fork. Consider that a further check
+                                    // on BLOCK_HAVE_DATA is performed below
+                                    LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
+                                    send = true;
+                                }
+                                else
+                                {
+                                    LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                }
                             }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        pindex = mi->second;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashTip = chainActive.Tip()->GetBlockHash();
+                    }
+                    else if (send)
+                    {
+                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                    }
+                }
+
+                // A new block is asked for by most peers in a short time, they are all
+                // sent the same message
+                CSerializedMessage msgBlock;
+                if (pindex && inv.type == MSG_BLOCK)
+                {
+                    LOCK(cs_lastBlockMessage);
+                    if (hashLastBlockMessage == inv.hash)
+                        msgBlock = msgLastBlock;
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+
+                // Send block from disk
+                CBlock block;
+                if (pindex && !msgBlock && !ReadBlockFromDisk(block, pindex))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    // The block may have been pruned since cs_main was released
+                    LOCK(cs_main);
+                    if (pindex->nStatus & BLOCK_HAVE_DATA)
                         assert(!"cannot load block from disk");
+                    LogPrint("forks", "%s():%d - NOT Pushing pruned block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                    pindex = NULL;
+                }
+                if (pindex)
+                {
                     if (inv.type == MSG_BLOCK)
                     {
-                        LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, block.GetHash().ToString() );
-                        pfrom->PushMessage("block", block);
+                        if (!msgBlock)
+                        {
+                            msgBlock = MakeSerializedMessage("block", block);
+                            LOCK(cs_lastBlockMessage);
+                            hashLastBlockMessage = inv.hash;
+                            msgLastBlock = msgBlock;
+                        }
+                        LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                        pfrom->PushSerializedMessage(msgBlock);
                     }
                     else // MSG_FILTERED_BLOCK)
                     {
@@ -4836,33 +5578,33 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second));
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (!hashTip.IsNull())
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
                 }
-                else
-                {
-                    if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA) )
-                    {
-                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
-                    }
-                }
             }
             else if (inv.IsKnownType())
             {
@@ -4870,9 +5612,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4913,6 +5655,229 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Try to accept a transaction relayed by pfrom to the mempool, along with any
+ * orphans waiting on it, then relay it or tell pfrom why it was rejected.  If
+ * fChecked, state holds the result of checking the transaction without
+ * context, its JoinSplit proofs included.
+ */
+static void ProcessRelayedTransaction(CNode* pfrom, const CTransaction& tx, CValidationState& state, bool fChecked)
+{
+    AssertLockHeld(cs_main);
+
+    vector<COutPoint> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+    bool fMissingInputs = false;
+
+    // Another copy is pending admission and is accepted or rejected on its own
+    if (IsTxAdmissionPending(inv.hash))
+        return;
+
+    if (!AlreadyHave(inv) && (!fChecked || state.IsValid()) &&
+        AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, fChecked))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            vWorkQueue.push_back(COutPoint(inv.hash, i));
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that spend outputs of
+        // this one
+        set<NodeId> setMisbehaving;
+        set<uint256> setOrphansTried;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                // An orphan spending several outputs of its parent is tried once
+                if (!setOrphansTried.insert(orphanHash).second)
+                    continue;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    for (unsigned int j = 0; j < orphanTx.vout.size(); j++)
+                        vWorkQueue.push_back(COutPoint(orphanHash, j));
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits from entering mapOrphans
+    else if (fMissingInputs && tx.vjoinsplit.size() == 0)
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        size_t nMaxOrphanTxUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000;
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxUsage);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+//
+// Transactions relayed to us are checked on a pool of threads before they
+// enter the mempool.  The checks that need no context, JoinSplit proofs
+// included, run without cs_main, so a burst of shielded transactions no longer
+// holds up block processing.  Each transaction is then accepted under cs_main
+// in the order it was received.
+//
+bool QueueTxAdmission(CNode* pfrom, const CTransaction& tx)
+{
+    boost::unique_lock<boost::mutex> lock(csTxAdmission);
+    // The same transaction relayed by another peer is dropped while the first is pending
+    if (!setTxAdmissionPending.insert(tx.GetHash()).second)
+        return false;
+    while (dequeTxAdmission.size() >= MAX_TX_ADMISSION_QUEUE)
+        condTxAdmission.wait(lock);
+    pfrom->AddRef();
+    dequeTxAdmission.push_back(CTxAdmission{tx, pfrom, nTxAdmissionQueued++});
+    condTxAdmission.notify_all();
+    return true;
+}
+
+void ThreadTxAdmission()
+{
+    RenameThread("horizen-txadmit");
+
+    while (true) {
+        CTxAdmission item;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxAdmission);
+            while (dequeTxAdmission.empty())
+                condTxAdmission.wait(lock);
+            item = dequeTxAdmission.front();
+            dequeTxAdmission.pop_front();
+            condTxAdmission.notify_all();
+        }
+
+        // Whatever happens to this transaction, the peer is released and
+        // the turn passed on, or the transactions after it wait forever
+        CValidationState state;
+        bool fChecked = false;
+        try {
+            auto verifier = libzcash::ProofVerifier::Strict();
+            if (CheckTransactionWithoutProofVerification(item.tx, state) &&
+                !CheckTransactionProofs(item.tx, state, verifier)) {
+                error("%s: CheckTransactionProofs failed for %s", __func__, item.tx.GetHash().ToString());
+            }
+            fChecked = true;
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxAdmission()");
+        }
+
+        try {
+            // Wait for the transactions received before this one
+            {
+                boost::unique_lock<boost::mutex> lock(csTxAdmission);
+                while (nTxAdmissionTurn != item.nSequence)
+                    condTxAdmission.wait(lock);
+            }
+
+            LOCK(cs_main);
+            // No longer pending, under cs_main so AlreadyHave() finds it
+            // either here or in the mempool or the recent rejects
+            {
+                boost::unique_lock<boost::mutex> lock(csTxAdmission);
+                setTxAdmissionPending.erase(item.tx.GetHash());
+            }
+            if (fChecked)
+                ProcessRelayedTransaction(item.pfrom, item.tx, state, true);
+        } catch (const boost::thread_interrupted&) {
+            item.pfrom->Release();
+            throw;
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxAdmission()");
+        }
+        item.pfrom->Release();
+
+        {
+            boost::unique_lock<boost::mutex> lock(csTxAdmission);
+            nTxAdmissionTurn++;
+        }
+        condTxAdmission.notify_all();
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4987,7 +5952,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
+
+        // Offer to reconcile transactions rather than announce each of them
+        if (fTxReconciliation)
+            pfrom->PushMessage("sendrecon", TXRECON_VERSION, pfrom->nReconSalt);
 
         // Change version
         pfrom->PushMessage("verack");
@@ -5192,7 +6164,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", bl, inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        nodestate->nBlocksInFlight < GetMaxBlocksInFlight(nodestate)) {
                         vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
@@ -5489,131 +6461,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        bool fQueue = false;
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
+            LOCK(cs_main);
 
+            pfrom->setAskFor.erase(inv.hash);
+            mapAlreadyAskedFor.erase(inv);
 
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
+            // Transactions we already have need no checking
+            fQueue = nTxAdmissionThreads > 0 && !AlreadyHave(inv);
+            if (!fQueue) {
+                CValidationState state;
+                ProcessRelayedTransaction(pfrom, tx, state, false);
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits from entering mapOrphans
-        else if (fMissingInputs && tx.vjoinsplit.size() == 0)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
         }
+        if (fQueue)
+            QueueTxAdmission(pfrom, tx);
     }
 
 
@@ -5633,6 +6502,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Check the Equihash solutions and proofs of work of the whole batch in parallel before
+        // taking cs_main. If any fails, AcceptBlockHeader checks them again one by one, so that
+        // the bad header is found and scored as before. Headers we already have are accepted
+        // without checking them again, so they are left out.
+        std::vector<CBlockHeader> vNewHeaders;
+        {
+            LOCK(cs_main);
+            BOOST_FOREACH(const CBlockHeader& header, headers) {
+                if (!mapBlockIndex.count(header.GetHash()))
+                    vNewHeaders.push_back(header);
+            }
+        }
+        bool fPoWChecked = nCount > 0 && (vNewHeaders.empty() || CheckBlockHeadersPoW(vNewHeaders));
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5652,7 +6535,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             
             bool lookForwardTips = (++cnt == MAX_HEADERS_RESULTS);
              
-            if (!AcceptBlockHeader(header, state, &pindexLast, lookForwardTips)) {
+            if (!AcceptBlockHeader(header, state, &pindexLast, lookForwardTips, !fPoWChecked)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5731,7 +6614,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5904,10 +6790,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             Misbehaving(pfrom->GetId(), 100);
         } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else
+            bool fHaveFilter;
+            {
+                LOCK(pfrom->cs_filter);
+                fHaveFilter = pfrom->pfilter != NULL;
+                if (fHaveFilter)
+                    pfrom->pfilter->insert(vData);
+            }
+            // Misbehaving takes cs_main, which must not be acquired under cs_filter
+            if (!fHaveFilter)
                 Misbehaving(pfrom->GetId(), 100);
         }
     }
@@ -5946,6 +6837,156 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
+    else if (strCommand == "sendrecon")
+    {
+        uint32_t nReconVersion;
+        uint64_t nPeerSalt;
+        vRecv >> nReconVersion >> nPeerSalt;
+
+        // Both sides offer, so the connection reconciles only if we did too
+        if (fTxReconciliation && nReconVersion >= TXRECON_VERSION && !pfrom->fReconcileTxs)
+        {
+            LOCK(pfrom->cs_inventory);
+            uint64_t nSalts[2] = {std::min(pfrom->nReconSalt, nPeerSalt), std::max(pfrom->nReconSalt, nPeerSalt)};
+            pfrom->hashReconSalt = Hash(BEGIN(nSalts), END(nSalts));
+            pfrom->nNextReconRequest = GetTime() + TXRECON_INTERVAL;
+            pfrom->fReconcileTxs = true;
+            LogPrint("net", "reconciling transactions with peer=%d\n", pfrom->id);
+        }
+    }
+
+
+    else if (strCommand == "reqrecon")
+    {
+        uint32_t nPeerSetSize;
+        vRecv >> nPeerSetSize;
+
+        // Only the side that opened the connection asks for sketches
+        if (!pfrom->fReconcileTxs || !pfrom->fInbound)
+        {
+            Misbehaving(pfrom->GetId(), 10);
+            return false;
+        }
+
+        CTxReconSketch sketch;
+        {
+            LOCK(pfrom->cs_inventory);
+            // The peer gave up on the previous round, announce what it held
+            for (map<uint32_t, uint256>::iterator it = pfrom->mapReconSent.begin(); it != pfrom->mapReconSent.end(); ++it)
+                pfrom->PushInventory(CInv(MSG_TX, it->second));
+            pfrom->mapReconSent.clear();
+
+            // The sets differ by at least their difference in size; assume a
+            // quarter of the smaller set is missing from the other on top of that.
+            uint32_t nSetSize = pfrom->setReconTxs.size();
+            uint32_t nDiff = std::max(nSetSize, nPeerSetSize) - std::min(nSetSize, nPeerSetSize) +
+                             std::min(nSetSize, nPeerSetSize) / 4 + 1;
+            sketch = CTxReconSketch(CTxReconSketch::CellsForDifference(nDiff));
+            BOOST_FOREACH(const uint256& txid, pfrom->setReconTxs)
+            {
+                uint32_t nShortId = GetTxReconShortId(pfrom->hashReconSalt, txid);
+                if (pfrom->mapReconSent.insert(make_pair(nShortId, txid)).second)
+                    sketch.Add(nShortId);
+                else
+                    pfrom->PushInventory(CInv(MSG_TX, txid)); // short id collision
+            }
+            pfrom->setReconTxs.clear();
+        }
+        pfrom->PushMessage("sketch", sketch);
+    }
+
+
+    else if (strCommand == "sketch")
+    {
+        CTxReconSketch sketch;
+        vRecv >> sketch;
+
+        if (!pfrom->fReconcileTxs || pfrom->fInbound || !sketch.IsWithinSizeConstraints())
+        {
+            Misbehaving(pfrom->GetId(), 10);
+            return false;
+        }
+
+        bool fSuccess = false;
+        vector<uint32_t> vMissing;
+        vector<uint32_t> vTheirsMissing;
+        {
+            LOCK(pfrom->cs_inventory);
+            // A late answer to a request we already gave up on
+            if (!pfrom->fReconRequested)
+                return true;
+            pfrom->fReconRequested = false;
+
+            map<uint32_t, uint256> mapOurs;
+            CTxReconSketch sketchOurs(sketch.GetCells());
+            BOOST_FOREACH(const uint256& txid, pfrom->setReconTxs)
+            {
+                uint32_t nShortId = GetTxReconShortId(pfrom->hashReconSalt, txid);
+                if (mapOurs.insert(make_pair(nShortId, txid)).second)
+                    sketchOurs.Add(nShortId);
+                else
+                    pfrom->PushInventory(CInv(MSG_TX, txid)); // short id collision
+            }
+            pfrom->setReconTxs.clear();
+
+            // What is left are the transactions only one side has: announce
+            // ours, and ask the peer to announce its own
+            sketch.Subtract(sketchOurs);
+            fSuccess = sketch.Decode(vMissing, vTheirsMissing);
+            if (fSuccess)
+            {
+                BOOST_FOREACH(uint32_t nShortId, vTheirsMissing)
+                {
+                    map<uint32_t, uint256>::iterator it = mapOurs.find(nShortId);
+                    if (it != mapOurs.end())
+                        pfrom->PushInventory(CInv(MSG_TX, it->second));
+                }
+            }
+            else
+            {
+                // Too many differences for the sketch, both sides announce all
+                vMissing.clear();
+                for (map<uint32_t, uint256>::iterator it = mapOurs.begin(); it != mapOurs.end(); ++it)
+                    pfrom->PushInventory(CInv(MSG_TX, it->second));
+            }
+        }
+        LogPrint("net", "reconciled transactions with peer=%d: %s, %u missing here, %u missing there\n", pfrom->id,
+                 fSuccess ? "decoded" : "failed", vMissing.size(), vTheirsMissing.size());
+        pfrom->PushMessage("reconcildiff", fSuccess, vMissing);
+    }
+
+
+    else if (strCommand == "reconcildiff")
+    {
+        bool fSuccess;
+        vector<uint32_t> vMissing;
+        vRecv >> fSuccess >> vMissing;
+
+        if (!pfrom->fReconcileTxs || !pfrom->fInbound)
+        {
+            Misbehaving(pfrom->GetId(), 10);
+            return false;
+        }
+
+        LOCK(pfrom->cs_inventory);
+        if (fSuccess)
+        {
+            BOOST_FOREACH(uint32_t nShortId, vMissing)
+            {
+                map<uint32_t, uint256>::iterator it = pfrom->mapReconSent.find(nShortId);
+                if (it != pfrom->mapReconSent.end())
+                    pfrom->PushInventory(CInv(MSG_TX, it->second));
+            }
+        }
+        else
+        {
+            for (map<uint32_t, uint256>::iterator it = pfrom->mapReconSent.begin(); it != pfrom->mapReconSent.end(); ++it)
+                pfrom->PushInventory(CInv(MSG_TX, it->second));
+        }
+        pfrom->mapReconSent.clear();
+    }
+
+
     else if (strCommand == "notfound") {
         // We do not care about the NOTFOUND message, but logging an Unknown Command
         // message would be undesirable as we transmit it ourselves.
@@ -6131,8 +7172,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrKnown);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6147,24 +7190,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                // Other message handler threads may be pushing addresses to this peer
+                LOCK(pto->cs_addrKnown);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+            {
+                vector<CAddress> vChunk(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), i + 1000));
+                pto->PushMessage("addr", vChunk);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -6278,9 +7323,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("inv", vInv);
         }
 
+        //
+        // Message: reqrecon
+        //
+        if (pto->fReconcileTxs && !pto->fInbound)
+        {
+            LOCK(pto->cs_inventory);
+            int64_t nNowSeconds = GetTime();
+            if (pto->nNextReconRequest <= nNowSeconds)
+            {
+                // An unanswered request is superseded by the new one
+                pto->PushMessage("reqrecon", (uint32_t)pto->setReconTxs.size());
+                pto->fReconRequested = true;
+                pto->nNextReconRequest = nNowSeconds + TXRECON_INTERVAL;
+            }
+        }
+
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
-        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+        if (!pto->fDisconnect && state.nStallingSince &&
+            state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT - state.nBlockDeliveryTime) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
             // should only happen during initial block download.
@@ -6314,10 +7376,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nMaxBlocksInFlight = GetMaxBlocksInFlight(&state);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxBlocksInFlight) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nMaxBlocksInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
+            // The window is held back by a block another peer has not sent yet. If this peer delivers
+            // blocks at least twice as fast, ask it for that block as well: whichever copy arrives first
+            // is used, and the request moves over to this peer.
+            if (staller != -1 && pindexStalled != NULL && state.nBlockDeliveryTime > 0) {
+                CNodeState *stallerState = State(staller);
+                if (stallerState->nBlockDeliveryTime == 0 || 2 * state.nBlockDeliveryTime < stallerState->nBlockDeliveryTime) {
+                    LogPrint("net", "%s():%d Re-requesting straggling block %s (%d) from peer=%d, stalled at peer=%d\n",
+                        __func__, __LINE__, pindexStalled->GetBlockHash().ToString(), pindexStalled->nHeight, pto->id, staller);
+                    vToDownload.push_back(pindexStalled);
+                    staller = -1;
+                }
+            }
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
@@ -6381,6 +7457,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
@@ -39,6 +39,7 @@ class CCoinsView;
 class CBlock;
 class CBlockLocator;
 class CBlockTreeDB;
+class CCoinsViewAsyncFlush;
 class CScriptCheck;
 class CValidationState;
 
@@ -62,7 +63,15 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -minrelaytxfee, minimum relay fee for transactions */
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 1000;
+/** Default for -maxorphantxsize, maximum memory in kilobytes used by orphan transactions */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer's orphans may use at most 1/ORPHAN_TX_PEER_SHARE of -maxorphantxsize */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between sweeps for expired orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -73,9 +82,28 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Maximum number of threads checking relayed transactions before they enter the mempool */
+static const int MAX_TX_ADMISSION_THREADS = 16;
+/** -txadmissionthreads default (0 = one per core) */
+static const int DEFAULT_TX_ADMISSION_THREADS = 0;
+/** Relayed transactions waiting to be checked before the message handler waits for room */
+static const unsigned int MAX_TX_ADMISSION_QUEUE = 1000;
+/** Maximum number of block pre-validation threads */
+static const int MAX_BLOCK_PREVALIDATION_THREADS = 16;
+/** -prevalidationthreads default (0 = one per core) */
+static const int DEFAULT_BLOCK_PREVALIDATION_THREADS = 0;
+/** Blocks waiting to have their proofs verified ahead of ConnectBlock; more are left to ConnectBlock */
+static const unsigned int MAX_BLOCK_PREVALIDATION_QUEUE = 64;
+/** Number of blocks that can be requested at any given time from a single peer whose delivery time is not measured yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
-/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+/** Fewest blocks kept requested from a measured peer, however slow. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+/** Most blocks kept requested from a measured peer, however fast. */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** How many seconds of a peer's measured block delivery time worth of blocks to keep requested from it. */
+static const unsigned int BLOCK_DOWNLOAD_QUEUE_TIME = 10;
+/** Timeout in seconds during which a peer must stall block download progress before being disconnected.
+ *  The peer's own measured block delivery time is allowed on top of it. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
@@ -121,6 +149,8 @@ extern bool fExperimentalMode;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nTxAdmissionThreads;
+extern int nBlockPreValidationThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
@@ -208,6 +238,8 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the block files, for -reindex */
+bool ReindexBlockFiles();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -225,6 +257,29 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header Equihash and proof of work checking thread */
+void ThreadHeaderCheck();
+/**
+ * Queue a transaction relayed by pfrom for the admission threads, waiting for
+ * room if the queue is full.  Returns false if it is already pending.
+ */
+bool QueueTxAdmission(CNode* pfrom, const CTransaction& tx);
+/** Run an instance of the thread checking relayed transactions for the mempool */
+void ThreadTxAdmission();
+/** Run an instance of the thread verifying the proofs of blocks stored ahead of the tip */
+void ThreadBlockPreValidation();
+/** Queue a block stored ahead of the tip to have its proofs verified; false if full or already known */
+bool QueueBlockPreValidation(const CBlock& block, int nHeight);
+/**
+ * Take the pre-validation result of a block: whether its proofs are known to verify.
+ * Waits for a thread that is checking the block; a block still queued is taken off
+ * the queue, as verifying it in place is quicker.
+ */
+bool TakeBlockPreValidation(const uint256& hash);
+/** Record that the proofs of a block are known to verify, for ConnectBlock to take */
+void MarkBlockProofsVerified(const uint256& hash, int nHeight);
+/** Discard the results of blocks at or below nHeight, which were never connected; returns how many */
+int PruneBlockPreValidation(int nHeight);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -275,6 +330,13 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Fold a new sample into a moving average that starts at the first sample. */
+int64_t UpdateMovingAverage(int64_t nAverage, int64_t nSample);
+/**
+ * Number of blocks to keep requested from a peer: BLOCK_DOWNLOAD_QUEUE_TIME worth of its
+ * measured block delivery time in microseconds, or a default while it is not measured (0).
+ */
+int GetMaxBlocksInFlight(int64_t nBlockDeliveryTime);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
@@ -282,9 +344,10 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; fProofsVerified skips the
+ *  JoinSplit proofs, for callers that checked them with CheckTransactionProofs() **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fProofsVerified=false);
 
 /** Get the BIP9 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::DeploymentPos pos);
@@ -297,6 +360,9 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nMaxBlocksInFlight;
+    int64_t nBlockDownloadRate;
+    int64_t nBlockLatency;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -382,6 +448,8 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 /** Context-independent validity checks */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/** Verify the JoinSplit proofs of a transaction; needs no lock */
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
 
 /** Check for standard transaction types
  * @return True if all outputs (scriptPubKeys) use only standard transaction forms
@@ -459,6 +527,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+/** Check the Equihash solutions and proofs of work of a batch of headers, in parallel on the -par threads */
+bool CheckBlockHeadersPoW(const std::vector<CBlockHeader>& headers);
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
                 bool fCheckPOW = true, bool fCheckMerkleRoot = true);
@@ -478,7 +548,7 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
  * If dbp is non-NULL, the file is known to already reside on disk
  */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp, BlockSet* sForkTips = NULL);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool lookForwardTips = false);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool lookForwardTips = false, bool fCheckPOW = true);
 
 
 
@@ -562,6 +632,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Background writer below pcoinsTip, NULL unless -asynccoinsflush is set (protected by cs_main) */
+extern CCoinsViewAsyncFlush *pcoinsAsyncFlush;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
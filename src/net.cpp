@@ -26,6 +26,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #include <boost/filesystem.hpp>
@@ -68,6 +69,10 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
+    // Most queued messages handed to the kernel in one sendmsg() call
+    const int MAX_SEND_IOVECS = 64;
+    // Largest TLS record payload; shorter messages are gathered up to this size
+    const size_t TLS_RECORD_SIZE = 16384;
 
     struct ListenSocket {
         SOCKET socket;
@@ -91,11 +96,13 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+int nMessageHandlerThreads = 1;
+bool fTxReconciliation = DEFAULT_TXRECONCILIATION;
 bool fAddressesInitialized = false;
 TLSManager tlsmanager = TLSManager();
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -695,6 +702,7 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    X(fReconcileTxs);
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -755,7 +763,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerCondition.notify_all();
         }
     }
 
@@ -817,18 +825,54 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// requires LOCK(cs_vSend)
+static void ConsumeSentBytes(CNode *pnode, std::deque<CSerializedMessage>::iterator& it, size_t nBytes)
+{
+    pnode->nLastSend = GetTime();
+    pnode->nSendBytes += nBytes;
+    pnode->RecordBytesSent(nBytes);
+
+    while (nBytes > 0)
+    {
+        size_t nLeft = (*it)->size() - pnode->nSendOffset;
+        if (nBytes < nLeft)
+        {
+            pnode->nSendOffset += nBytes;
+            break;
+        }
+        nBytes -= nLeft;
+        pnode->nSendOffset = 0;
+        pnode->nSendSize -= (*it)->size();
+        it++;
+    }
+}
+
+// requires LOCK(cs_vSend)
+static void FillSendRecord(CNode *pnode, std::deque<CSerializedMessage>::const_iterator it)
+{
+    CSerializeData& vRecord = pnode->vSendRecord;
+    vRecord.reserve(TLS_RECORD_SIZE);
+    size_t nOffset = pnode->nSendOffset;
+    for (; it != pnode->vSendMsg.end() && vRecord.size() < TLS_RECORD_SIZE; it++, nOffset = 0)
+    {
+        size_t nCopy = std::min((*it)->size() - nOffset, TLS_RECORD_SIZE - vRecord.size());
+        vRecord.insert(vRecord.end(), (*it)->begin() + nOffset, (*it)->begin() + nOffset + nCopy);
+    }
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end())
     {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
 
         bool bIsSSL = false;
         int nBytes = 0, nRet = 0;
+        size_t nAttempted = 0;
         {
             LOCK(pnode->cs_hSocket);
             
@@ -842,32 +886,61 @@ void SocketSendData(CNode *pnode)
             
             if (bIsSSL)
             {
+                // Messages that fill a TLS record are written in place. Shorter
+                // ones always go through vSendRecord, gathered with those queued
+                // after them, rather than each going out in a record of its own.
+                // OpenSSL needs a write that has to be retried to be retried with
+                // the same buffer and length: vSendRecord is kept until written,
+                // and a message written in place stays at the same offset.
+                if (pnode->vSendRecord.empty() && data.size() - pnode->nSendOffset < TLS_RECORD_SIZE)
+                    FillSendRecord(pnode, it);
+
+                const char* pch = &data[pnode->nSendOffset];
+                nAttempted = data.size() - pnode->nSendOffset;
+                if (!pnode->vSendRecord.empty())
+                {
+                    pch = &pnode->vSendRecord[0];
+                    nAttempted = pnode->vSendRecord.size();
+                }
+
                 ERR_clear_error(); // clear the error queue, otherwise we may be reading an old error that occurred previously in the current thread
-                nBytes = SSL_write(pnode->ssl, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset);
+                nBytes = SSL_write(pnode->ssl, pch, nAttempted);
                 nRet = SSL_get_error(pnode->ssl, nBytes);
             }
             else
             {
-                nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+                nAttempted = data.size() - pnode->nSendOffset;
+                nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nAttempted, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+                // Hand as many queued messages as possible to the kernel at once
+                struct iovec vIov[MAX_SEND_IOVECS];
+                int nIov = 0;
+                for (std::deque<CSerializedMessage>::iterator itIov = it;
+                     itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; itIov++, nIov++)
+                {
+                    size_t nOffset = (nIov == 0) ? pnode->nSendOffset : 0;
+                    vIov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+                    vIov[nIov].iov_len = (*itIov)->size() - nOffset;
+                    nAttempted += vIov[nIov].iov_len;
+                }
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = vIov;
+                msg.msg_iovlen = nIov;
+                nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
                 nRet = WSAGetLastError();
             }
         }
         if (nBytes > 0)
         {
-            pnode->nLastSend = GetTime();
-            pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            pnode->RecordBytesSent(nBytes);
+            pnode->vSendRecord.clear();
+            ConsumeSentBytes(pnode, it, nBytes);
 
-            if (pnode->nSendOffset == data.size())
-            {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            }
-            else
+            if ((size_t)nBytes < nAttempted)
             {
-                // could not send full message; stop sending more
+                // could not send everything; stop sending more
                 break;
             }
         }
@@ -1767,7 +1840,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(bool fTrickler)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1784,18 +1857,32 @@ void ThreadMessageHandler()
             }
         }
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages; a single thread picks the trickle
+        // node so that address and inventory trickling keeps its pace
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fTrickler && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
+        // Start at a random node, so that the threads spread over the peers
+        // instead of all contending for the first ones
+        size_t nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is handling this node
+            if (pnode->fInMessageHandler.exchange(true))
+            {
+                if (pnode == pnodeTrickle)
+                    pnodeTrickle = NULL;
+                continue;
+            }
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1821,6 +1908,7 @@ void ThreadMessageHandler()
                 if (lockSend)
                     g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
             }
+            pnode->fInMessageHandler = false;
             boost::this_thread::interruption_point();
         }
 
@@ -2057,7 +2145,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i == 0))));
 
 #if defined(USE_TLS)
     if (CNode::GetTlsFallbackNonTls())
@@ -2118,13 +2208,10 @@ void CNode::NetCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(tx, MakeSerializedMessage("tx", tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CSerializedMessage& msg)
 {
     CInv inv(MSG_TX, tx.GetHash());
     {
@@ -2136,22 +2223,37 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved; every
+        // peer asking for the transaction is sent this same copy
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
+    // Of the peers we reconcile with, the transaction is only flooded to
+    // TXRECON_FLOOD_PEERS outbound ones, taken from a random starting point;
+    // the others learn of it at their next reconciliation.
+    int nReconFlooded = 0;
+    size_t nStart = vNodes.empty() ? 0 : insecure_rand() % vNodes.size();
+    for (size_t i = 0; i < vNodes.size(); i++)
     {
+        CNode* pnode = vNodes[(nStart + i) % vNodes.size()];
         if(!pnode->fRelayTxes)
             continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+            LOCK(pnode->cs_filter);
+            if (pnode->pfilter && !pnode->pfilter->IsRelevantAndUpdate(tx))
+                continue;
+        }
+        if (pnode->fReconcileTxs)
+        {
+            if (pnode->fInbound || nReconFlooded >= TXRECON_FLOOD_PEERS) {
+                if (pnode->AddReconTx(inv.hash))
+                    continue;
+            } else {
+                nReconFlooded++;
+            }
+        }
+        pnode->PushInventory(inv);
     }
 }
 
@@ -2345,6 +2447,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    fInMessageHandler = false;
     nSendSize = 0;
     nSendOffset = 0;
     hashContinue = uint256();
@@ -2358,6 +2461,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecTime = 0;
     fPingQueued = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    fReconcileTxs = false;
+    nReconSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    fReconRequested = false;
+    nNextReconRequest = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2477,6 +2584,22 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+/** Fill in the size and checksum of the message in ss, returning the size of its payload */
+static unsigned int SetMessageSizeAndChecksum(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    return nSize;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2513,26 +2636,51 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    unsigned int nSize = SetMessageSizeAndChecksum(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::shared_ptr<CSerializeData> pmsg = std::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*pmsg);
+    QueueMessage(pmsg);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+// requires LOCK(cs_vSend)
+void CNode::QueueMessage(const CSerializedMessage& msg)
+{
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+void CNode::PushSerializedMessage(const CSerializedMessage& msg)
+{
+    LOCK(cs_vSend);
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0)
+    {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        return;
+    }
+
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n",
+        SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)),
+        msg->size() - CMessageHeader::HEADER_SIZE, id);
+    QueueMessage(msg);
+}
+
+CSerializedMessage MakeSerializedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0) << ssPayload;
+    SetMessageSizeAndChecksum(ss);
+
+    std::shared_ptr<CSerializeData> pmsg = std::make_shared<CSerializeData>();
+    ss.GetAndClear(*pmsg);
+    return pmsg;
 }
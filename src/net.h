@@ -19,7 +19,9 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -62,6 +64,18 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** -msghandlerthreads default (0 = one per core) */
+static const int DEFAULT_MSGHANDLER_THREADS = 0;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** -txreconciliation default */
+static const bool DEFAULT_TXRECONCILIATION = false;
+/** Time between reconciliations with an outbound peer (in seconds) */
+static const int TXRECON_INTERVAL = 8;
+/** Number of outbound peers we reconcile with that each transaction is still flooded to */
+static const int TXRECON_FLOOD_PEERS = 2;
+/** The maximum number of transactions waiting to be reconciled with a peer, past which they are flooded */
+static const size_t MAX_TXRECON_SET_SIZE = 3000;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -93,6 +107,24 @@ static std::string validationdescription;
 
 typedef int NodeId;
 
+/**
+ * A complete network message, header and checksum included. It is immutable
+ * once made, so one copy can be queued to any number of peers.
+ */
+typedef std::shared_ptr<const CSerializeData> CSerializedMessage;
+
+/** Build a message from an already serialized payload */
+CSerializedMessage MakeSerializedMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+/** Serialize a message once, to be pushed to many peers with CNode::PushSerializedMessage */
+template<typename T>
+CSerializedMessage MakeSerializedMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << payload;
+    return MakeSerializedMessage(pszCommand, ss);
+}
+
 struct CombinerAll
 {
     typedef bool result_type;
@@ -156,10 +188,14 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Number of threads processing peer messages */
+extern int nMessageHandlerThreads;
+/** Whether we offer peers to reconcile transactions instead of announcing each of them */
+extern bool fTxReconciliation;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -201,6 +237,7 @@ public:
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
     bool fWhitelisted;
+    bool fReconcileTxs;
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
@@ -266,7 +303,8 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedMessage> vSendMsg;
+    CSerializeData vSendRecord; // start of vSendMsg gathered into one TLS record, kept until written
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -306,6 +344,9 @@ public:
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
     int nRefCount;
+    // Set while a message handler thread is processing this node, so that its
+    // messages are handled in order by at most one thread at a time
+    std::atomic<bool> fInMessageHandler;
     NodeId id;
 protected:
 
@@ -337,6 +378,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addrKnown; // guards vAddrToSend and addrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -347,6 +389,15 @@ public:
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
 
+    // set reconciliation based relay (see txrecon.h), the rest guarded by cs_inventory
+    std::atomic<bool> fReconcileTxs; // the peer agreed to reconcile transactions with us
+    uint64_t nReconSalt; // our half of the salt of short ids
+    uint256 hashReconSalt; // salt of short ids, from both halves
+    std::set<uint256> setReconTxs; // transactions to reconcile with the peer
+    std::map<uint32_t, uint256> mapReconSent; // setReconTxs as of the last sketch we sent, by short id
+    bool fReconRequested; // we asked the peer for a sketch
+    int64_t nNextReconRequest;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -372,6 +423,9 @@ private:
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSerializedMessage& msg);
+
 public:
 
     NodeId GetId() const {
@@ -419,6 +473,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -427,6 +482,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -454,6 +510,19 @@ public:
         }
     }
 
+    // Queue a transaction for the next reconciliation with this peer. Returns
+    // false if too many are waiting, in which case it must be announced.
+    bool AddReconTx(const uint256& txid)
+    {
+        LOCK(cs_inventory);
+        if (setInventoryKnown.count(CInv(MSG_TX, txid)))
+            return true;
+        if (setReconTxs.size() >= MAX_TXRECON_SET_SIZE)
+            return false;
+        setReconTxs.insert(txid);
+        return true;
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -467,6 +536,9 @@ public:
 
     void PushVersion();
 
+    // Queue a message made with MakeSerializedMessage, without copying it
+    void PushSerializedMessage(const CSerializedMessage& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -675,7 +747,7 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CSerializedMessage& msg);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -8,6 +8,7 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
+#include "leveldbwrapper.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
@@ -543,6 +544,60 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns I/O statistics and amplification estimates of the open LevelDB databases.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"name\",             (string) the database, e.g. chainstate or blockindex\n"
+            "    \"reads\": n,                 (numeric) point lookups since startup\n"
+            "    \"read_bytes\": n,            (numeric) value bytes returned by lookups\n"
+            "    \"writes\": n,                (numeric) write batches since startup\n"
+            "    \"write_bytes\": n,           (numeric) key and value bytes written by the node\n"
+            "    \"compaction_read_bytes\": n, (numeric) bytes read by LevelDB compactions\n"
+            "    \"compaction_write_bytes\": n,(numeric) bytes written by LevelDB compactions\n"
+            "    \"manual_compactions\": n,    (numeric) full compactions triggered by -dbcompactafter\n"
+            "    \"size_bytes\": n,            (numeric) approximate size of the table files\n"
+            "    \"files_per_level\": [n,...], (array) number of table files on each level\n"
+            "    \"write_amplification\": x.xx,(numeric) bytes written to disk per byte written by the node\n"
+            "    \"read_amplification\": n     (numeric) worst-case table files probed by a lookup\n"
+            "  },...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    std::vector<CLevelDBStats> vStats;
+    GetAllLevelDBStats(vStats);
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CLevelDBStats& stats, vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("name", stats.strName);
+        obj.pushKV("reads", (uint64_t)stats.nReads);
+        obj.pushKV("read_bytes", (uint64_t)stats.nReadBytes);
+        obj.pushKV("writes", (uint64_t)stats.nWrites);
+        obj.pushKV("write_bytes", (uint64_t)stats.nWriteBytes);
+        obj.pushKV("compaction_read_bytes", (uint64_t)stats.nCompactionReadBytes);
+        obj.pushKV("compaction_write_bytes", (uint64_t)stats.nCompactionWriteBytes);
+        obj.pushKV("manual_compactions", (uint64_t)stats.nCompactions);
+        obj.pushKV("size_bytes", (uint64_t)stats.nSizeBytes);
+        UniValue levels(UniValue::VARR);
+        BOOST_FOREACH(int nFiles, stats.vFilesPerLevel)
+            levels.push_back(nFiles);
+        obj.pushKV("files_per_level", levels);
+        obj.pushKV("write_amplification", stats.WriteAmplification());
+        obj.pushKV("read_amplification", stats.ReadAmplification());
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -113,6 +113,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
 	{ "z_sendmany", 4},
     { "z_shieldcoinbase", 2},
     { "z_shieldcoinbase", 3},
+    { "z_shieldcoinbase", 4},
     { "z_getoperationstatus", 0},
     { "z_getoperationresult", 0},
     { "z_importkey", 2 },
@@ -108,7 +108,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"maxinflight\": n,          (numeric) The number of blocks we keep requested from this peer, sized from its measured delivery time\n"
+            "    \"blockdownloadrate\": n,    (numeric) The average rate in bytes per second at which this peer sends us the blocks we request, or 0 if not measured yet\n"
+            "    \"blocklatency\": n,         (numeric) The average time in seconds from requesting a block from this peer to receiving it, or 0 if not measured yet\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"txreconciliation\": true|false, (boolean) Whether transactions are reconciled with this peer rather than all announced\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -160,8 +165,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            obj.pushKV("maxinflight", statestats.nMaxBlocksInFlight);
+            obj.pushKV("blockdownloadrate", statestats.nBlockDownloadRate);
+            obj.pushKV("blocklatency", ((double)statestats.nBlockLatency) / 1e6);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
+        obj.pushKV("txreconciliation", stats.fReconcileTxs);
 
         ret.push_back(obj);
     }
@@ -293,6 +293,7 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
     { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
 
     /* Mining */
@@ -271,6 +271,7 @@ extern UniValue getblock(const UniValue& params, bool fHelp);
 extern UniValue getblockfinalityindex(const UniValue& params, bool fHelp);
 extern UniValue getglobaltips(const UniValue& params, bool fHelp);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
+extern UniValue getdbstats(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
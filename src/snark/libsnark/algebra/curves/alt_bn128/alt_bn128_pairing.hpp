@@ -57,6 +57,10 @@ alt_bn128_Fq12 alt_bn128_ate_double_miller_loop(const alt_bn128_ate_G1_precomp &
                                      const alt_bn128_ate_G1_precomp &prec_P2,
                                      const alt_bn128_ate_G2_precomp &prec_Q2);
 
+/* product of the Miller loops of all pairs (prec_P[i], *prec_Q[i]), sharing the squarings */
+alt_bn128_Fq12 alt_bn128_ate_multi_miller_loop(const std::vector<alt_bn128_ate_G1_precomp> &prec_P,
+                                               const std::vector<const alt_bn128_ate_G2_precomp*> &prec_Q);
+
 alt_bn128_Fq12 alt_bn128_ate_pairing(const alt_bn128_G1& P,
                           const alt_bn128_G2 &Q);
 alt_bn128_GT alt_bn128_ate_reduced_pairing(const alt_bn128_G1 &P,
@@ -79,6 +83,9 @@ alt_bn128_Fq12 alt_bn128_double_miller_loop(const alt_bn128_G1_precomp &prec_P1,
                                  const alt_bn128_G1_precomp &prec_P2,
                                  const alt_bn128_G2_precomp &prec_Q2);
 
+alt_bn128_Fq12 alt_bn128_multi_miller_loop(const std::vector<alt_bn128_G1_precomp> &prec_P,
+                                           const std::vector<const alt_bn128_G2_precomp*> &prec_Q);
+
 alt_bn128_Fq12 alt_bn128_pairing(const alt_bn128_G1& P,
                       const alt_bn128_G2 &Q);
 
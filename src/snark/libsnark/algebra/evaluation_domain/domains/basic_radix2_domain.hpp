@@ -15,6 +15,7 @@
 #define BASIC_RADIX2_DOMAIN_HPP_
 
 #include "algebra/evaluation_domain/evaluation_domain.hpp"
+#include "algebra/evaluation_domain/domains/basic_radix2_domain_aux.hpp"
 
 namespace libsnark {
 
@@ -24,6 +25,10 @@ public:
 
     FieldT omega;
 
+    /* twiddle tables for the FFT and the inverse FFT over this domain */
+    radix2_fft_plan<FieldT> fft_plan;
+    radix2_fft_plan<FieldT> ifft_plan;
+
     basic_radix2_domain(const size_t m);
 
     void FFT(std::vector<FieldT> &a);
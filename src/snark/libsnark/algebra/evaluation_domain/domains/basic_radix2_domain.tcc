@@ -26,6 +26,8 @@ basic_radix2_domain<FieldT>::basic_radix2_domain(const size_t m) : evaluation_do
     assert(logm <= (FieldT::s));
 
     omega = get_root_of_unity<FieldT>(m);
+    fft_plan = _basic_radix2_FFT_plan(m, omega);
+    ifft_plan = _basic_radix2_FFT_plan(m, omega.inverse());
 }
 
 template<typename FieldT>
@@ -33,7 +35,7 @@ void basic_radix2_domain<FieldT>::FFT(std::vector<FieldT> &a)
 {
     enter_block("Execute FFT");
     assert(a.size() == this->m);
-    _basic_radix2_FFT(a, omega);
+    _basic_radix2_FFT_dispatch(a, omega, fft_plan);
     leave_block("Execute FFT");
 }
 
@@ -42,7 +44,7 @@ void basic_radix2_domain<FieldT>::iFFT(std::vector<FieldT> &a)
 {
     enter_block("Execute inverse FFT");
     assert(a.size() == this->m);
-    _basic_radix2_FFT(a, omega.inverse());
+    _basic_radix2_FFT_dispatch(a, ifft_plan.omega, ifft_plan);
 
     const FieldT sconst = FieldT(a.size()).inverse();
     for (size_t i = 0; i < a.size(); ++i)
@@ -0,0 +1,20 @@
+/** @file
+ *****************************************************************************
+
+ Global settings for the auxiliary functions of the "basic radix-2" evaluation domain.
+
+ See basic_radix2_domain_aux.hpp .
+
+ *****************************************************************************
+ * @author     This file is part of libsnark, developed by SCIPR Lab
+ *             and contributors (see AUTHORS).
+ * @copyright  MIT license (see LICENSE file)
+ *****************************************************************************/
+
+#include "algebra/evaluation_domain/domains/basic_radix2_domain_aux.hpp"
+
+namespace libsnark {
+
+radix2_fft_algorithm default_radix2_fft_algorithm = radix2_fft_blocked;
+
+} // libsnark
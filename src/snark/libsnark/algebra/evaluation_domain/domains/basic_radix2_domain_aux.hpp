@@ -15,8 +15,44 @@
 #ifndef BASIC_RADIX2_DOMAIN_AUX_HPP_
 #define BASIC_RADIX2_DOMAIN_AUX_HPP_
 
+#include <cstddef>
+#include <vector>
+
 namespace libsnark {
 
+/**
+ * Algorithms available to basic_radix2_domain for evaluating its FFTs.
+ */
+enum radix2_fft_algorithm {
+    radix2_fft_serial = 0,   /* iterative in-place FFT on a single thread */
+    radix2_fft_parallel = 1, /* split once at the top level into one serial FFT per thread */
+    radix2_fft_blocked = 2,  /* cache-blocked six-step FFT with precomputed twiddles, multi-threaded over rows */
+};
+
+/**
+ * Algorithm used by basic_radix2_domain; may be changed at runtime.
+ */
+extern radix2_fft_algorithm default_radix2_fft_algorithm;
+
+/**
+ * Precomputed data for the six-step FFT of size n = n1 * n2 with root of unity omega.
+ * The row FFTs (of size n1 and n2) share one twiddle table, and row_roots holds
+ * omega^i for the twiddle multiplication between the two passes.
+ */
+template<typename FieldT>
+struct radix2_fft_plan {
+    size_t n, n1, n2;
+    FieldT omega;
+    std::vector<FieldT> twiddles; /* (omega^n2)^i for i < n1/2 */
+    std::vector<FieldT> row_roots; /* omega^i for i < n1 */
+};
+
+/**
+ * Prepare a six-step FFT plan for vectors of size n (a power of 2) and the n-th root of unity omega.
+ */
+template<typename FieldT>
+radix2_fft_plan<FieldT> _basic_radix2_FFT_plan(const size_t n, const FieldT &omega);
+
 /**
  * Compute the radix-2 FFT of the vector a over the set S={omega^{0},...,omega^{m-1}}.
  */
@@ -29,6 +65,18 @@ void _basic_radix2_FFT(std::vector<FieldT> &a, const FieldT &omega);
 template<typename FieldT>
 void _parallel_basic_radix2_FFT(std::vector<FieldT> &a, const FieldT &omega);
 
+/**
+ * Cache-blocked six-step (Bailey) version of _basic_radix2_FFT, using a plan for a.size() and omega.
+ */
+template<typename FieldT>
+void _basic_blocked_radix2_FFT(std::vector<FieldT> &a, const radix2_fft_plan<FieldT> &plan);
+
+/**
+ * Compute the FFT of a with the algorithm selected by default_radix2_fft_algorithm.
+ */
+template<typename FieldT>
+void _basic_radix2_FFT_dispatch(std::vector<FieldT> &a, const FieldT &omega, const radix2_fft_plan<FieldT> &plan);
+
 /**
  * Translate the vector a to a coset defined by g.
  */
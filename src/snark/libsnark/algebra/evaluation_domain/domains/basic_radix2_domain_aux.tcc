@@ -14,6 +14,7 @@
 #ifndef BASIC_RADIX2_DOMAIN_AUX_TCC_
 #define BASIC_RADIX2_DOMAIN_AUX_TCC_
 
+#include <algorithm>
 #include <cassert>
 #ifdef MULTICORE
 #include <omp.h>
@@ -168,6 +169,177 @@ void _basic_parallel_radix2_FFT(std::vector<FieldT> &a, const FieldT &omega)
     }
 }
 
+template<typename FieldT>
+radix2_fft_plan<FieldT> _basic_radix2_FFT_plan(const size_t n, const FieldT &omega)
+{
+    const size_t logn = log2(n);
+    assert(n == (1u << logn));
+
+    radix2_fft_plan<FieldT> plan;
+    plan.n = n;
+    plan.n1 = UINT64_C(1) << ((logn + 1) / 2);
+    plan.n2 = n / plan.n1;
+    plan.omega = omega;
+
+    const FieldT omega_n1 = omega^plan.n2; /* primitive n1-th root of unity */
+    plan.twiddles.resize(plan.n1 / 2);
+    FieldT w = FieldT::one();
+    for (size_t i = 0; i < plan.twiddles.size(); ++i)
+    {
+        plan.twiddles[i] = w;
+        w *= omega_n1;
+    }
+
+    plan.row_roots.resize(plan.n1);
+    w = FieldT::one();
+    for (size_t i = 0; i < plan.n1; ++i)
+    {
+        plan.row_roots[i] = w;
+        w *= omega;
+    }
+
+    return plan;
+}
+
+/*
+ Serial FFT of the n elements at a, where n divides table_n and twiddles[i] = omega_T^i
+ for a primitive table_n-th root of unity omega_T. The root used is omega_T^{table_n/n}.
+ */
+template<typename FieldT>
+void _basic_serial_radix2_FFT_with_twiddles(FieldT *a, const size_t n, const std::vector<FieldT> &twiddles, const size_t table_n)
+{
+    const size_t logn = log2(n);
+    assert(n == (1u << logn) && n <= table_n);
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        const size_t rk = bitreverse(k, logn);
+        if (k < rk)
+            std::swap(a[k], a[rk]);
+    }
+
+    for (size_t m = 1; m < n; m *= 2)
+    {
+        /* the twiddle for butterfly j of this stage is omega_T^{j * table_n / (2m)} */
+        const size_t stride = table_n / (2*m);
+        for (size_t k = 0; k < n; k += 2*m)
+        {
+            const FieldT t0 = a[k+m];
+            a[k+m] = a[k] - t0;
+            a[k] += t0;
+            for (size_t j = 1; j < m; ++j)
+            {
+                const FieldT t = twiddles[j*stride] * a[k+j+m];
+                a[k+j+m] = a[k+j] - t;
+                a[k+j] += t;
+            }
+        }
+    }
+}
+
+/*
+ dst[c*rows + r] = src[r*cols + c], processed in tiles so that both sides stay in cache.
+ */
+template<typename FieldT>
+void _radix2_transpose(const FieldT *src, FieldT *dst, const size_t rows, const size_t cols)
+{
+    const size_t tile = 16;
+#ifdef MULTICORE
+    #pragma omp parallel for
+#endif
+    for (size_t r0 = 0; r0 < rows; r0 += tile)
+    {
+        const size_t r1 = std::min(r0 + tile, rows);
+        for (size_t c0 = 0; c0 < cols; c0 += tile)
+        {
+            const size_t c1 = std::min(c0 + tile, cols);
+            for (size_t r = r0; r < r1; ++r)
+            {
+                for (size_t c = c0; c < c1; ++c)
+                {
+                    dst[c*rows + r] = src[r*cols + c];
+                }
+            }
+        }
+    }
+}
+
+/*
+ Six-step FFT after [Bailey 1990]. Write n = n1 * n2, j = j1 + n1*j2 and k = k2 + n2*k1, so that
+ omega^{jk} = omega^{j1 k2} * (omega^{n2})^{j1 k1} * (omega^{n1})^{j2 k2}. The n1 FFTs of size n2
+ and the n2 FFTs of size n1 each work on a contiguous row that fits in cache, and rows are
+ distributed over threads.
+ */
+template<typename FieldT>
+void _basic_blocked_radix2_FFT(std::vector<FieldT> &a, const radix2_fft_plan<FieldT> &plan)
+{
+    const size_t n = plan.n, n1 = plan.n1, n2 = plan.n2;
+    assert(a.size() == n);
+
+    std::vector<FieldT> tmp(n);
+
+    /* columns j1 of a (viewed as n2 x n1) become rows of tmp */
+    _radix2_transpose(&a[0], &tmp[0], n2, n1);
+
+#ifdef MULTICORE
+    #pragma omp parallel for
+#endif
+    for (size_t j1 = 0; j1 < n1; ++j1)
+    {
+        FieldT *row = &tmp[j1*n2];
+        _basic_serial_radix2_FFT_with_twiddles(row, n2, plan.twiddles, n1);
+
+        /* multiply by omega^{j1 k2} */
+        const FieldT &step = plan.row_roots[j1];
+        FieldT w = step;
+        for (size_t k2 = 1; k2 < n2; ++k2)
+        {
+            row[k2] *= w;
+            w *= step;
+        }
+    }
+
+    _radix2_transpose(&tmp[0], &a[0], n1, n2);
+
+#ifdef MULTICORE
+    #pragma omp parallel for
+#endif
+    for (size_t k2 = 0; k2 < n2; ++k2)
+    {
+        _basic_serial_radix2_FFT_with_twiddles(&a[k2*n1], n1, plan.twiddles, n1);
+    }
+
+    /* a[k2*n1 + k1] holds the result for k = k2 + n2*k1 */
+    _radix2_transpose(&a[0], &tmp[0], n2, n1);
+    a.swap(tmp);
+}
+
+template<typename FieldT>
+void _basic_radix2_FFT_dispatch(std::vector<FieldT> &a, const FieldT &omega, const radix2_fft_plan<FieldT> &plan)
+{
+    switch (default_radix2_fft_algorithm)
+    {
+    case radix2_fft_serial:
+        _basic_serial_radix2_FFT(a, omega);
+        break;
+    case radix2_fft_parallel:
+        _basic_parallel_radix2_FFT(a, omega);
+        break;
+    case radix2_fft_blocked:
+        if (plan.n == a.size() && plan.omega == omega)
+        {
+            _basic_blocked_radix2_FFT(a, plan);
+        }
+        else
+        {
+            _basic_radix2_FFT(a, omega);
+        }
+        break;
+    default:
+        assert(0);
+    }
+}
+
 template<typename FieldT>
 void _multiply_by_coset(std::vector<FieldT> &a, const FieldT &g)
 {
@@ -0,0 +1,70 @@
+/** @file
+ *****************************************************************************
+ Profiling program that compares the radix-2 FFT algorithms on the scalar field
+ of alt_bn128.
+
+ The command
+
+     $ libsnark/algebra/evaluation_domain/profiling/profile_radix2_fft 21 3
+
+ runs an FFT and an inverse FFT of size 2^21 three times with each algorithm and
+ prints the best time of each.
+
+ *****************************************************************************
+ * @author     This file is part of libsnark, developed by SCIPR Lab
+ *             and contributors (see AUTHORS).
+ * @copyright  MIT license (see LICENSE file)
+ *****************************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "algebra/curves/alt_bn128/alt_bn128_pp.hpp"
+#include "common/profiling.hpp"
+#include "algebra/evaluation_domain/evaluation_domain.hpp"
+
+using namespace libsnark;
+
+int main(int argc, const char * argv[])
+{
+    alt_bn128_pp::init_public_params();
+    typedef Fr<alt_bn128_pp> FieldT;
+
+    const size_t logn = (argc > 1 ? atoi(argv[1]) : 20);
+    const size_t reps = (argc > 2 ? atoi(argv[2]) : 3);
+    const size_t n = UINT64_C(1) << logn;
+
+    basic_radix2_domain<FieldT> domain(n);
+    std::vector<FieldT> coeffs(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        coeffs[i] = FieldT::random_element();
+    }
+
+    const char *names[] = { "serial", "parallel", "blocked" };
+    for (int alg = radix2_fft_serial; alg <= radix2_fft_blocked; ++alg)
+    {
+        default_radix2_fft_algorithm = (radix2_fft_algorithm)alg;
+        long long best = -1;
+        for (size_t r = 0; r < reps; ++r)
+        {
+            std::vector<FieldT> a = coeffs;
+            const long long start = get_nsec_time();
+            domain.FFT(a);
+            domain.iFFT(a);
+            const long long elapsed = get_nsec_time() - start;
+            if (best < 0 || elapsed < best)
+            {
+                best = elapsed;
+            }
+            if (a != coeffs)
+            {
+                printf("%s: FFT round trip mismatch\n", names[alg]);
+                return 1;
+            }
+        }
+        printf("* %-8s FFT+iFFT of size 2^%zu: %.3f s\n", names[alg], logn, best * 1e-9);
+    }
+
+    return 0;
+}
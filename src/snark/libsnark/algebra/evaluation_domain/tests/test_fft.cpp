@@ -0,0 +1,91 @@
+/**
+ *****************************************************************************
+ * @author     This file is part of libsnark, developed by SCIPR Lab
+ *             and contributors (see AUTHORS).
+ * @copyright  MIT license (see LICENSE file)
+ *****************************************************************************/
+#include <vector>
+
+#include "algebra/curves/alt_bn128/alt_bn128_pp.hpp"
+#include "algebra/evaluation_domain/evaluation_domain.hpp"
+#include "algebra/fields/field_utils.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace libsnark;
+
+template<typename FieldT>
+std::vector<FieldT> random_vector(const size_t n)
+{
+    std::vector<FieldT> v(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        v[i] = FieldT::random_element();
+    }
+    return v;
+}
+
+template<typename FieldT>
+void test_fft_algorithm(const size_t n, const radix2_fft_algorithm algorithm)
+{
+    const radix2_fft_algorithm saved = default_radix2_fft_algorithm;
+    basic_radix2_domain<FieldT> domain(n);
+    const std::vector<FieldT> coeffs = random_vector<FieldT>(n);
+
+    std::vector<FieldT> expected = coeffs;
+    _basic_serial_radix2_FFT(expected, domain.omega);
+
+    default_radix2_fft_algorithm = algorithm;
+
+    std::vector<FieldT> a = coeffs;
+    domain.FFT(a);
+    EXPECT_EQ(a, expected);
+
+    domain.iFFT(a);
+    EXPECT_EQ(a, coeffs);
+
+    const FieldT g = FieldT::multiplicative_generator;
+    domain.cosetFFT(a, g);
+    domain.icosetFFT(a, g);
+    EXPECT_EQ(a, coeffs);
+
+    default_radix2_fft_algorithm = saved;
+}
+
+TEST(evaluation_domain, Radix2FFTAlgorithms)
+{
+    alt_bn128_pp::init_public_params();
+    typedef Fr<alt_bn128_pp> FieldT;
+
+    /* odd and even log sizes exercise both n1 == n2 and n1 == 2*n2 */
+    for (size_t logn = 1; logn <= 11; ++logn)
+    {
+        test_fft_algorithm<FieldT>(UINT64_C(1) << logn, radix2_fft_serial);
+        test_fft_algorithm<FieldT>(UINT64_C(1) << logn, radix2_fft_parallel);
+        test_fft_algorithm<FieldT>(UINT64_C(1) << logn, radix2_fft_blocked);
+    }
+}
+
+TEST(evaluation_domain, Radix2FFTEvaluatesPolynomial)
+{
+    alt_bn128_pp::init_public_params();
+    typedef Fr<alt_bn128_pp> FieldT;
+
+    const size_t n = 256;
+    basic_radix2_domain<FieldT> domain(n);
+    const std::vector<FieldT> coeffs = random_vector<FieldT>(n);
+
+    std::vector<FieldT> a = coeffs;
+    domain.FFT(a);
+
+    for (size_t i = 0; i < n; i += 37)
+    {
+        const FieldT x = domain.get_element(i);
+        FieldT y = FieldT::zero();
+        for (size_t j = n; j-- > 0; )
+        {
+            y = y * x + coeffs[j];
+        }
+        EXPECT_EQ(a[i], y);
+    }
+}
@@ -463,6 +463,26 @@ bool r1cs_ppzksnark_online_verifier_strong_IC(const r1cs_ppzksnark_processed_ver
                                               const r1cs_ppzksnark_primary_input<ppT> &primary_input,
                                               const r1cs_ppzksnark_proof<ppT> &proof);
 
+/**
+ * A verifier algorithm for the R1CS ppzkSNARK that:
+ * (1) accepts a processed verification key (and the key it was processed from),
+ * (2) has strong input consistency, and
+ * (3) checks all pairing-product equations at once.
+ *
+ * The five equations checked by r1cs_ppzksnark_online_verifier_strong_IC are
+ * combined with random 128-bit exponents (applied to the G1 arguments) into a
+ * single product, evaluated with one multi-Miller loop and one final
+ * exponentiation. A valid proof is always accepted; an invalid one is accepted
+ * with probability at most 2^-128. Proofs whose g_B is outside the order-r
+ * subgroup, where the combination is not sound, are passed to
+ * r1cs_ppzksnark_online_verifier_strong_IC instead.
+ */
+template<typename ppT>
+bool r1cs_ppzksnark_online_verifier_batched_strong_IC(const r1cs_ppzksnark_verification_key<ppT> &vk,
+                                                      const r1cs_ppzksnark_processed_verification_key<ppT> &pvk,
+                                                      const r1cs_ppzksnark_primary_input<ppT> &primary_input,
+                                                      const r1cs_ppzksnark_proof<ppT> &proof);
+
 /****************************** Miscellaneous ********************************/
 
 /**
@@ -780,6 +780,97 @@ bool r1cs_ppzksnark_online_verifier_strong_IC(const r1cs_ppzksnark_processed_ver
     return result;
 }
 
+template<typename ppT>
+bool r1cs_ppzksnark_online_verifier_batched_strong_IC(const r1cs_ppzksnark_verification_key<ppT> &vk,
+                                                      const r1cs_ppzksnark_processed_verification_key<ppT> &pvk,
+                                                      const r1cs_ppzksnark_primary_input<ppT> &primary_input,
+                                                      const r1cs_ppzksnark_proof<ppT> &proof)
+{
+    enter_block("Call to r1cs_ppzksnark_online_verifier_batched_strong_IC");
+
+    if (pvk.encoded_IC_query.domain_size() != primary_input.size())
+    {
+        print_indent(); printf("Input length differs from expected (got %zu, expected %zu).\n", primary_input.size(), pvk.encoded_IC_query.domain_size());
+        leave_block("Call to r1cs_ppzksnark_online_verifier_batched_strong_IC");
+        return false;
+    }
+
+    if (!proof.is_well_formed())
+    {
+        leave_block("Call to r1cs_ppzksnark_online_verifier_batched_strong_IC");
+        return false;
+    }
+
+    const accumulation_vector<G1<ppT> > accumulated_IC = pvk.encoded_IC_query.template accumulate_chunk<Fr<ppT> >(primary_input.begin(), primary_input.end(), 0);
+    const G1<ppT> A_acc = proof.g_A.g + accumulated_IC.first;
+    const G1<ppT> A_acc_C = A_acc + proof.g_C.g;
+
+    /* the random combination below relies on the pairing being linear in
+       its G1 argument, which only holds for g_B in the order-r subgroup;
+       is_well_formed() only checks that g_B is on the curve */
+    if (proof.g_B.g.is_zero() || !(G2<ppT>::order() * proof.g_B.g).is_zero())
+    {
+        const bool result = r1cs_ppzksnark_online_verifier_strong_IC<ppT>(pvk, primary_input, proof);
+        leave_block("Call to r1cs_ppzksnark_online_verifier_batched_strong_IC");
+        return result;
+    }
+
+    bigint<128 / GMP_NUMB_BITS> r[5];
+    for (size_t i = 0; i < 5; ++i)
+    {
+        do
+        {
+            r[i].randomize();
+        } while (r[i].is_zero());
+    }
+
+    /* Raise the five equations to r[0..4] and multiply them together,
+       merging the pairings that share a G2 argument:
+         kc_A: e(A, alphaA_g2)  = e(A', 1)
+         kc_B: e(alphaB_g1, B)  = e(B', 1)
+         kc_C: e(C, alphaC_g2)  = e(C', 1)
+         QAP:  e(A + acc, B)    = e(H, rC_Z_g2) * e(C, 1)
+         K:    e(K, gamma_g2)   = e(A + acc + C, gamma_beta_g2) * e(gamma_beta_g1, B)
+    */
+    std::vector<G1<ppT> > P;
+    std::vector<const G2_precomp<ppT>*> Q;
+
+    const G2_precomp<ppT> proof_g_B_g_precomp = ppT::precompute_G2(proof.g_B.g);
+
+    P.emplace_back(r[0] * proof.g_A.g);
+    Q.emplace_back(&pvk.vk_alphaA_g2_precomp);
+    P.emplace_back(r[2] * proof.g_C.g);
+    Q.emplace_back(&pvk.vk_alphaC_g2_precomp);
+    P.emplace_back(r[1] * vk.alphaB_g1 + r[3] * A_acc - r[4] * vk.gamma_beta_g1);
+    Q.emplace_back(&proof_g_B_g_precomp);
+    P.emplace_back(-(r[3] * proof.g_H));
+    Q.emplace_back(&pvk.vk_rC_Z_g2_precomp);
+    P.emplace_back(r[4] * proof.g_K);
+    Q.emplace_back(&pvk.vk_gamma_g2_precomp);
+    P.emplace_back(-(r[4] * A_acc_C));
+    Q.emplace_back(&pvk.vk_gamma_beta_g2_precomp);
+    P.emplace_back(-(r[0] * proof.g_A.h + r[1] * proof.g_B.h + r[2] * proof.g_C.h + r[3] * proof.g_C.g));
+    Q.emplace_back(&pvk.pp_G2_one_precomp);
+
+    std::vector<G1_precomp<ppT> > P_precomp;
+    std::vector<const G2_precomp<ppT>*> Q_precomp;
+    for (size_t i = 0; i < P.size(); ++i)
+    {
+        /* e(O, Q) = 1 */
+        if (!P[i].is_zero())
+        {
+            P_precomp.emplace_back(ppT::precompute_G1(P[i]));
+            Q_precomp.emplace_back(Q[i]);
+        }
+    }
+
+    const Fqk<ppT> f = ppT::multi_miller_loop(P_precomp, Q_precomp);
+    const bool result = (ppT::final_exponentiation(f) == GT<ppT>::one());
+
+    leave_block("Call to r1cs_ppzksnark_online_verifier_batched_strong_IC");
+    return result;
+}
+
 template<typename ppT>
 bool r1cs_ppzksnark_verifier_strong_IC(const r1cs_ppzksnark_verification_key<ppT> &vk,
                                        const r1cs_ppzksnark_primary_input<ppT> &primary_input,
@@ -28,13 +28,21 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
+};
+struct COrphanPeer {
+    size_t nUsage;
+    std::set<uint256> setOrphans;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer;
+extern size_t nOrphanTxUsage;
 
 CService ip(uint32_t i)
 {
@@ -188,13 +196,86 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    const size_t nNoLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+    BOOST_CHECK_EQUAL(nOrphanTxUsage, 0);
+}
+
+static CMutableTransaction OrphanSpending(const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    const size_t nNoLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(0, nNoLimit);
+
+    // Orphans are indexed by the outpoints they spend
+    uint256 hashParent = GetRandHash();
+    CTransaction txChild0 = OrphanSpending(COutPoint(hashParent, 0));
+    CTransaction txChild1 = OrphanSpending(COutPoint(hashParent, 1));
+    BOOST_CHECK(AddOrphanTx(txChild0, 0));
+    BOOST_CHECK(AddOrphanTx(txChild1, 0));
+    BOOST_CHECK(!AddOrphanTx(txChild1, 1));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2);
+    BOOST_CHECK(mapOrphanTransactionsByPrev[COutPoint(hashParent, 1)].count(txChild1.GetHash()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[0].setOrphans.size(), 2);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[0].nUsage, nOrphanTxUsage);
+    size_t nUsageEach = nOrphanTxUsage / 2;
+    BOOST_CHECK(nUsageEach > 0);
+    EraseOrphansFor(0);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTxUsage, 0);
+
+    // Memory budget: 20 orphans of the same size from 10 peers, room for 10
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(AddOrphanTx(OrphanSpending(COutPoint(GetRandHash(), 0)), i % 10));
+    BOOST_CHECK_EQUAL(nOrphanTxUsage, 20 * nUsageEach);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(nNoLimit, 10 * nUsageEach), 10);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 10);
+    BOOST_CHECK(nOrphanTxUsage <= 10 * nUsageEach);
+
+    // Per-peer quota: a flooding peer only pushes out its own orphans
+    LimitOrphanTxSize(0, nNoLimit);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(AddOrphanTx(OrphanSpending(COutPoint(GetRandHash(), 0)), i));
+    for (int i = 0; i < 30; i++)
+        BOOST_CHECK(AddOrphanTx(OrphanSpending(COutPoint(GetRandHash(), 0)), 4));
+    size_t nMaxUsage = 40 * nUsageEach;
+    LimitOrphanTxSize(nNoLimit, nMaxUsage);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[4].nUsage <= nMaxUsage / ORPHAN_TX_PEER_SHARE);
+    for (NodeId i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[i].setOrphans.size(), 1);
+    LimitOrphanTxSize(0, nNoLimit);
+
+    // Expiry
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    BOOST_CHECK(AddOrphanTx(txChild0, 0));
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME / 2);
+    BOOST_CHECK(AddOrphanTx(txChild1, 0));
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(nNoLimit, nNoLimit), 0);
+    BOOST_CHECK(!mapOrphanTransactions.count(txChild0.GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(txChild1.GetHash()));
+    SetMockTime(0);
+    LimitOrphanTxSize(0, nNoLimit);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
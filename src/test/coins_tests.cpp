@@ -10,6 +10,7 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "txdb.h"
 #include "undo.h"
 #include "pubkey.h"
 
@@ -726,6 +727,52 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coins_async_flush_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewAsyncFlush flusher(&base);
+
+    std::map<uint256, CCoins> result;
+    uint256 nf = GetRandHash();
+    uint256 hashBlock;
+
+    for (unsigned int round = 0; round < 4; round++) {
+        CCoinsViewCacheTest cache(&flusher);
+        for (unsigned int i = 0; i < 100; i++) {
+            uint256 txid = GetRandHash();
+            CCoinsModifier entry = cache.ModifyCoins(txid);
+            entry->nVersion = insecure_rand();
+            entry->vout.resize(1);
+            entry->vout[0].nValue = insecure_rand();
+            result[txid] = *entry;
+        }
+        cache.SetNullifier(nf, round % 2 == 0);
+        hashBlock = GetRandHash();
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+
+        // The flushed entries are served from the frozen layer while the
+        // background write is in progress.
+        CCoinsViewCacheTest cache2(&flusher);
+        BOOST_CHECK(cache2.GetBestBlock() == hashBlock);
+        BOOST_CHECK(cache2.GetNullifier(nf) == (round % 2 == 0));
+        BOOST_CHECK(flusher.DynamicMemoryUsage() > 0);
+
+        BOOST_CHECK(flusher.Sync());
+        BOOST_CHECK(base.GetBestBlock() == hashBlock);
+        BOOST_CHECK(base.GetNullifier(nf) == (round % 2 == 0));
+    }
+
+    // Everything ends up in the backing view, and reads agree at every level.
+    for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(base.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+        BOOST_CHECK(flusher.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 {
     CCoinsViewTest base;
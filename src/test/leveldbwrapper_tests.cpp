@@ -0,0 +1,167 @@
+// Copyright (c) 2012-2013 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+#include "test/test_bitcoin.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_FIXTURE_TEST_SUITE(leveldbwrapper_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_profiles)
+{
+    mapArgs.erase("-dbmaxopenfiles");
+    mapArgs.erase("-dbcompression");
+    mapArgs.erase("-dbcompactafter");
+    CLevelDBProfile profile = CoinsDBProfile("chainstate");
+    BOOST_CHECK_EQUAL(profile.strName, "chainstate");
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, DEFAULT_DB_MAX_OPEN_FILES);
+    BOOST_CHECK_EQUAL(profile.fCompression, DEFAULT_DB_COMPRESSION);
+    BOOST_CHECK_EQUAL(profile.nCompactAfterBytes, (uint64_t)DEFAULT_DB_COMPACT_AFTER << 20);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 10);
+
+    mapArgs["-dbmaxopenfiles"] = "200";
+    mapArgs["-dbcompression"] = "1";
+    mapArgs["-dbcompactafter"] = "3";
+    profile = CoinsDBProfile("chainstate");
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 200);
+    BOOST_CHECK(profile.fCompression);
+    BOOST_CHECK_EQUAL(profile.nCompactAfterBytes, (uint64_t)3 << 20);
+
+    // Out of range values are clamped
+    mapArgs["-dbmaxopenfiles"] = "2";
+    mapArgs["-dbcompactafter"] = "-5";
+    profile = CoinsDBProfile("chainstate");
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 16);
+    BOOST_CHECK_EQUAL(profile.nCompactAfterBytes, 0);
+
+    // The block index only shares -dbcompression with the coins database
+    profile = BlockTreeDBProfile();
+    BOOST_CHECK_EQUAL(profile.strName, "blockindex");
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 32);
+    BOOST_CHECK_EQUAL(profile.nBlockCachePercent, 75);
+    BOOST_CHECK_EQUAL(profile.nCompactAfterBytes, 0);
+    BOOST_CHECK(profile.fCompression);
+
+    mapArgs.erase("-dbmaxopenfiles");
+    mapArgs.erase("-dbcompression");
+    mapArgs.erase("-dbcompactafter");
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_parse_stats)
+{
+    const std::string strStats =
+        "                               Compactions\n"
+        "Level  Files Size(MB) Time(sec) Read(MB) Write(MB)\n"
+        "--------------------------------------------------\n"
+        "  0        2        1         0        0         1\n"
+        "  1        5       10         1     12.5        10\n";
+    CLevelDBStats stats;
+    ParseLevelDBStats(strStats, stats);
+    BOOST_CHECK_EQUAL(stats.nSizeBytes, (uint64_t)11 << 20);
+    BOOST_CHECK_EQUAL(stats.nCompactionReadBytes, (uint64_t)25 << 19);
+    BOOST_CHECK_EQUAL(stats.nCompactionWriteBytes, (uint64_t)11 << 20);
+
+    CLevelDBStats empty;
+    ParseLevelDBStats("", empty);
+    BOOST_CHECK_EQUAL(empty.nSizeBytes, 0);
+    BOOST_CHECK_EQUAL(empty.nCompactionWriteBytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_amplification)
+{
+    CLevelDBStats stats;
+    BOOST_CHECK_EQUAL(stats.WriteAmplification(), 0);
+    BOOST_CHECK_EQUAL(stats.ReadAmplification(), 0);
+
+    stats.nWriteBytes = 100;
+    stats.nCompactionWriteBytes = 300;
+    BOOST_CHECK_EQUAL(stats.WriteAmplification(), 4);
+
+    // All level 0 files, then one per non-empty level
+    stats.vFilesPerLevel.push_back(3);
+    stats.vFilesPerLevel.push_back(5);
+    stats.vFilesPerLevel.push_back(0);
+    stats.vFilesPerLevel.push_back(40);
+    BOOST_CHECK_EQUAL(stats.ReadAmplification(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_counters)
+{
+    CLevelDBWrapper db("leveldbwrapper_counters", 1 << 20, CLevelDBProfile("counters"), true);
+
+    // A one byte key and an eight byte value
+    BOOST_CHECK(db.Write('a', (uint64_t)1));
+    BOOST_CHECK(db.Write('b', (uint64_t)2));
+    CLevelDBBatch batch;
+    batch.Write('c', (uint64_t)3);
+    batch.Erase('b');
+    BOOST_CHECK(db.WriteBatch(batch));
+
+    uint64_t nValue;
+    BOOST_CHECK(db.Read('a', nValue));
+    BOOST_CHECK_EQUAL(nValue, 1);
+    BOOST_CHECK(!db.Read('b', nValue));
+    BOOST_CHECK(db.Exists('c'));
+
+    CLevelDBStats stats;
+    db.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.strName, "counters");
+    BOOST_CHECK_EQUAL(stats.nWrites, 3);
+    BOOST_CHECK_EQUAL(stats.nWriteBytes, 9 + 9 + 9 + 1);
+    BOOST_CHECK_EQUAL(stats.nReads, 3);
+    BOOST_CHECK_EQUAL(stats.nReadBytes, 8 + 8);
+    BOOST_CHECK_EQUAL(stats.nCompactions, 0);
+    BOOST_CHECK(!stats.vFilesPerLevel.empty());
+
+    // Open databases are reported by getdbstats
+    std::vector<CLevelDBStats> vStats;
+    GetAllLevelDBStats(vStats);
+    bool fFound = false;
+    for (size_t i = 0; i < vStats.size(); i++) {
+        if (vStats[i].strName == "counters") {
+            fFound = true;
+            BOOST_CHECK_EQUAL(vStats[i].nWrites, 3);
+        }
+    }
+    BOOST_CHECK(fFound);
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_background_compaction)
+{
+    CLevelDBProfile profile("compact");
+    profile.nCompactAfterBytes = 1000;
+    CLevelDBWrapper db("leveldbwrapper_compaction", 1 << 20, profile, true);
+
+    // 13 bytes per write, the 77th crosses the threshold once
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(db.Write(std::make_pair('k', i), (uint64_t)i));
+
+    // The compaction runs in the background, writes returned without waiting for it
+    uint64_t nCompactions = 0;
+    for (int i = 0; i < 1000 && nCompactions == 0; i++) {
+        CLevelDBStats stats;
+        db.GetStats(stats);
+        nCompactions = stats.nCompactions;
+        if (nCompactions == 0)
+            MilliSleep(10);
+    }
+    BOOST_CHECK_EQUAL(nCompactions, 1);
+
+    uint64_t nValue;
+    BOOST_CHECK(db.Read(std::make_pair('k', 42), nValue));
+    BOOST_CHECK_EQUAL(nValue, 42);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
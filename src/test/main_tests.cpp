@@ -2,12 +2,21 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chainparams.h"
 #include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "utiltime.h"
 
 #include "test/test_bitcoin.h"
 
+#include <string>
+#include <vector>
+
 #include <boost/signals2/signal.hpp>
+#include <boost/thread.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
@@ -101,4 +110,152 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(tx_admission_in_order)
+{
+    // The node has no socket, so the reject messages stay queued
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 9033)), "", true);
+
+    // Transactions without inputs fail the checks that need no context
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 20; i++) {
+        CMutableTransaction mtx;
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = i;
+        vtx.push_back(CTransaction(mtx));
+    }
+    for (size_t i = 0; i < vtx.size(); i++)
+        BOOST_CHECK(QueueTxAdmission(&node, vtx[i]));
+
+    // The same transactions relayed again are dropped while pending
+    BOOST_CHECK(!QueueTxAdmission(&node, vtx[0]));
+    BOOST_CHECK(!QueueTxAdmission(&node, vtx[vtx.size() - 1]));
+
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(&ThreadTxAdmission);
+
+    size_t nRejects = 0;
+    for (int i = 0; i < 1000 && nRejects < vtx.size(); i++) {
+        {
+            LOCK(node.cs_vSend);
+            nRejects = node.vSendMsg.size();
+        }
+        if (nRejects < vtx.size())
+            MilliSleep(10);
+    }
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    // One reject per transaction, in the order they were queued
+    LOCK(node.cs_vSend);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        CDataStream ssMsg(node.vSendMsg[i]->begin(), node.vSendMsg[i]->end(), SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr(Params().MessageStart());
+        std::string strMsg, strReason;
+        unsigned char nCode;
+        uint256 hash;
+        ssMsg >> hdr >> strMsg >> nCode >> strReason >> hash;
+        BOOST_CHECK_EQUAL(hdr.GetCommand(), "reject");
+        BOOST_CHECK_EQUAL(strMsg, "tx");
+        BOOST_CHECK(hash == vtx[i].GetHash());
+    }
+}
+
+static CBlock PreValidationBlock(int nTime)
+{
+    // No JoinSplits, so the proofs verify at once
+    CMutableTransaction mtx;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = nTime;
+    CBlock block;
+    block.nTime = nTime;
+    block.vtx.push_back(CTransaction(mtx));
+    return block;
+}
+
+static void RunBlockPreValidation()
+{
+    // The thread checks the queued blocks before it waits, where the interruption stops it
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadBlockPreValidation);
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(block_prevalidation_queue_take)
+{
+    // A block still queued is taken off the queue and verified by ConnectBlock
+    CBlock blockQueued = PreValidationBlock(1);
+    BOOST_CHECK(QueueBlockPreValidation(blockQueued, 10));
+    BOOST_CHECK(!QueueBlockPreValidation(blockQueued, 10));
+    BOOST_CHECK(!TakeBlockPreValidation(blockQueued.GetHash()));
+
+    // A verified block is taken once
+    CBlock blockVerified = PreValidationBlock(2);
+    BOOST_CHECK(QueueBlockPreValidation(blockVerified, 11));
+    RunBlockPreValidation();
+    BOOST_CHECK(!QueueBlockPreValidation(blockVerified, 11));
+    BOOST_CHECK(TakeBlockPreValidation(blockVerified.GetHash()));
+    BOOST_CHECK(!TakeBlockPreValidation(blockVerified.GetHash()));
+
+    // A verified block that is never connected is discarded once the tip passes its height
+    CBlock blockFork = PreValidationBlock(3);
+    CBlock blockAhead = PreValidationBlock(4);
+    BOOST_CHECK(QueueBlockPreValidation(blockFork, 12));
+    RunBlockPreValidation();
+    MarkBlockProofsVerified(blockAhead.GetHash(), 14);
+    BOOST_CHECK_EQUAL(PruneBlockPreValidation(11), 0);
+    BOOST_CHECK_EQUAL(PruneBlockPreValidation(12), 1);
+    BOOST_CHECK(!TakeBlockPreValidation(blockFork.GetHash()));
+    BOOST_CHECK(QueueBlockPreValidation(blockFork, 12));
+    BOOST_CHECK(!TakeBlockPreValidation(blockFork.GetHash()));
+    BOOST_CHECK(TakeBlockPreValidation(blockAhead.GetHash()));
+
+    // Results do not pile up past the download window
+    for (unsigned int i = 0; i < BLOCK_DOWNLOAD_WINDOW + 10; i++)
+        MarkBlockProofsVerified(ArithToUint256(arith_uint256(i + 1)), 20);
+    BOOST_CHECK_EQUAL(PruneBlockPreValidation(20), (int)BLOCK_DOWNLOAD_WINDOW);
+    MarkBlockProofsVerified(blockAhead.GetHash(), 21);
+    BOOST_CHECK(TakeBlockPreValidation(blockAhead.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(blocks_in_flight_per_peer)
+{
+    // A peer whose delivery time is not measured yet gets the default
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // BLOCK_DOWNLOAD_QUEUE_TIME worth of blocks at the measured delivery time
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(1000000), (int)BLOCK_DOWNLOAD_QUEUE_TIME);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(BLOCK_DOWNLOAD_QUEUE_TIME * 1000000LL / 32), 32);
+
+    // ... within [MIN_BLOCKS_IN_TRANSIT_PER_PEER, MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER]
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(1), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(BLOCK_DOWNLOAD_QUEUE_TIME * 1000000LL / 100), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(BLOCK_DOWNLOAD_QUEUE_TIME * 1000000LL / 3), 3);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(BLOCK_DOWNLOAD_QUEUE_TIME * 1000000LL), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(3600 * 1000000LL), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(block_delivery_moving_average)
+{
+    // The first sample is taken as it is, later ones move the average a quarter of the way
+    BOOST_CHECK_EQUAL(UpdateMovingAverage(0, 1000), 1000);
+    BOOST_CHECK_EQUAL(UpdateMovingAverage(1000, 2000), 1250);
+    BOOST_CHECK_EQUAL(UpdateMovingAverage(1000, 0), 750);
+    BOOST_CHECK_EQUAL(UpdateMovingAverage(1000, 1000), 1000);
+
+    // A fast peer that slows down converges on its new delivery time
+    int64_t nAverage = UpdateMovingAverage(0, 100000);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(nAverage), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    int64_t nPrevious = nAverage;
+    for (int i = 0; i < 50; i++) {
+        nAverage = UpdateMovingAverage(nAverage, 500000);
+        BOOST_CHECK(nAverage >= nPrevious && nAverage <= 500000);
+        nPrevious = nAverage;
+    }
+    BOOST_CHECK(nAverage > 500000 - 4);
+    BOOST_CHECK_EQUAL(GetMaxBlocksInFlight(nAverage), 20);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,79 @@
+// Copyright (c) 2012-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "streams.h"
+#include "version.h"
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <string.h>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(serialized_message_matches_pushed)
+{
+    // The node has no socket, so nothing is sent and pushed messages stay queued
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 9033)), "", true);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(uint256S("0x01"), 2);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 42;
+    CTransaction tx(mtx);
+    string strReason = "reason";
+
+    node.PushMessage("tx", tx);
+    node.PushMessage("verack");
+    node.PushMessage("reject", string("tx"), (unsigned char)REJECT_INVALID, strReason, tx.GetHash());
+
+    CSerializedMessage msgTx = MakeSerializedMessage("tx", tx);
+    CSerializedMessage msgVerack = MakeSerializedMessage("verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    CDataStream ssReject(SER_NETWORK, PROTOCOL_VERSION);
+    ssReject << string("tx") << (unsigned char)REJECT_INVALID << strReason << tx.GetHash();
+    CSerializedMessage msgReject = MakeSerializedMessage("reject", ssReject);
+
+    {
+        LOCK(node.cs_vSend);
+        BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 3);
+        BOOST_CHECK(*node.vSendMsg[0] == *msgTx);
+        BOOST_CHECK(*node.vSendMsg[1] == *msgVerack);
+        BOOST_CHECK(*node.vSendMsg[2] == *msgReject);
+    }
+
+    // Header fields of the shared message
+    CDataStream ssMsg(msgTx->begin(), msgTx->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ssMsg >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssMsg.size());
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+    uint256 hash = Hash(ssMsg.begin(), ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    // A shared message is queued as it is, without a copy
+    node.PushSerializedMessage(msgTx);
+    {
+        LOCK(node.cs_vSend);
+        BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 4);
+        BOOST_CHECK(node.vSendMsg[3] == msgTx);
+        BOOST_CHECK_EQUAL(node.nSendSize, 2 * msgTx->size() + msgVerack->size() + msgReject->size());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -93,4 +93,18 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(CheckBlockHeadersPoW_test)
+{
+    SelectParams(CBaseChainParams::MAIN);
+
+    std::vector<CBlockHeader> headers(3, Params().GenesisBlock().GetBlockHeader());
+    BOOST_CHECK(CheckBlockHeadersPoW(headers));
+
+    // A header with a wrong nonce no longer matches its Equihash solution
+    headers[1].nNonce = ArithToUint256(UintToArith256(headers[1].nNonce) + 1);
+    BOOST_CHECK(!CheckBlockHeadersPoW(headers));
+
+    BOOST_CHECK(CheckBlockHeadersPoW(std::vector<CBlockHeader>()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
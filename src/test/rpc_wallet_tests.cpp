@@ -1347,6 +1347,13 @@ BOOST_AUTO_TEST_CASE(rpc_z_shieldcoinbase_parameters)
     "100 -1"
     ), runtime_error);
 
+    // invalid maxtxs, must be at least 1
+    BOOST_CHECK_THROW(CallRPC("z_shieldcoinbase "
+    "tmRr6yJonqGK23UVhrKuyvTpF8qxQQjKigJ "
+    "tnpoQJVnYBZZqkFadj2bJJLThNCxbADGB5gSGeYTAGGrT5tejsxY9Zc1BtY8nnHmZkB "
+    "100 50 0"
+    ), runtime_error);
+
     // Mutable tx containing contextual information we need to build tx
     UniValue retValue = CallRPC("getblockcount");
     int nHeight = retValue.get_int();
@@ -1377,6 +1384,21 @@ BOOST_AUTO_TEST_CASE(rpc_z_shieldcoinbase_parameters)
         BOOST_CHECK( find_error(objError, "Invalid to address"));
     }
 
+    // Batch sizes must add up to the number of inputs, and none may be empty.
+    try {
+        std::vector<ShieldCoinbaseUTXO> inputs = { ShieldCoinbaseUTXO{uint256(),0,0}, ShieldCoinbaseUTXO{uint256(),1,0} };
+        std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_shieldcoinbase(mtx, inputs, testnetzaddr, 1, NullUniValue, {1, 0, 1}) );
+    } catch (const UniValue& objError) {
+        BOOST_CHECK( find_error(objError, "Batch sizes do not partition the inputs"));
+    }
+
+    try {
+        std::vector<ShieldCoinbaseUTXO> inputs = { ShieldCoinbaseUTXO{uint256(),0,0}, ShieldCoinbaseUTXO{uint256(),1,0} };
+        std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_shieldcoinbase(mtx, inputs, testnetzaddr, 1, NullUniValue, {1}) );
+    } catch (const UniValue& objError) {
+        BOOST_CHECK( find_error(objError, "Batch sizes do not partition the inputs"));
+    }
+
 }
 
 
@@ -1410,6 +1432,20 @@ BOOST_AUTO_TEST_CASE(rpc_z_shieldcoinbase_internals)
         BOOST_CHECK( msg.find("Number of inputs 2 is greater than mempooltxinputlimit of 1") != string::npos);
     }
 
+    // The mempool limit applies to each transaction of a batched operation
+    {
+        std::vector<ShieldCoinbaseUTXO> inputs = { ShieldCoinbaseUTXO{uint256(),0,0}, ShieldCoinbaseUTXO{uint256(),1,0} };
+        std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_shieldcoinbase(mtx, inputs, zaddr, SHIELD_COINBASE_DEFAULT_MINERS_FEE, NullUniValue, {1, 1}) );
+        operation->main();
+        BOOST_CHECK(operation->isFailed());
+        std::string msg = operation->getErrorMessage();
+        BOOST_CHECK( msg.find("Insufficient coinbase funds") != string::npos);
+
+        UniValue progress = find_value(operation->getStatus(), "progress");
+        BOOST_CHECK_EQUAL(find_value(progress, "transactions").get_int(), 2);
+        BOOST_CHECK_EQUAL(find_value(progress, "sent").get_int(), 0);
+    }
+
     // Insufficient funds
     {
         std::vector<ShieldCoinbaseUTXO> inputs = { ShieldCoinbaseUTXO{uint256(),0,0} };
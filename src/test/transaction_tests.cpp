@@ -440,6 +440,10 @@ BOOST_AUTO_TEST_CASE(test_simple_joinsplit_invalidity)
                                     ) == 0);
 
         BOOST_CHECK(CheckTransactionWithoutProofVerification(newTx, state));
+
+        // The proofs are checked separately, and an empty proof does not verify.
+        BOOST_CHECK(!CheckTransactionProofs(newTx, state, verifier));
+        BOOST_CHECK(state.GetRejectReason() == "bad-txns-joinsplit-verification-failed");
     }
     {
         // Ensure that values within the joinsplit are well-formed.
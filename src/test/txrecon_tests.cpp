@@ -0,0 +1,140 @@
+// Copyright (c) 2012-2013 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrecon.h"
+
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_FIXTURE_TEST_SUITE(txrecon_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(txrecon_shortid)
+{
+    uint256 txid = GetRandHash();
+    uint256 hashSalt = GetRandHash();
+    BOOST_CHECK_EQUAL(GetTxReconShortId(hashSalt, txid), GetTxReconShortId(hashSalt, txid));
+    BOOST_CHECK(GetTxReconShortId(hashSalt, txid) != GetTxReconShortId(GetRandHash(), txid));
+}
+
+BOOST_AUTO_TEST_CASE(txrecon_sketch_size)
+{
+    BOOST_CHECK(!CTxReconSketch().IsWithinSizeConstraints());
+    BOOST_CHECK_EQUAL(CTxReconSketch(7).GetCells(), 9);
+    BOOST_CHECK(CTxReconSketch(7).IsWithinSizeConstraints());
+    BOOST_CHECK(!CTxReconSketch(MAX_TXRECON_SKETCH_CELLS + 1).IsWithinSizeConstraints());
+    BOOST_CHECK_EQUAL(CTxReconSketch::CellsForDifference(1000000), MAX_TXRECON_SKETCH_CELLS);
+    BOOST_CHECK(CTxReconSketch::CellsForDifference(0) > 0);
+    BOOST_CHECK(CTxReconSketch::CellsForDifference(10) < CTxReconSketch::CellsForDifference(100));
+}
+
+BOOST_AUTO_TEST_CASE(txrecon_sketch_decode)
+{
+    seed_insecure_rand(true);
+
+    // Equal sets cancel out
+    CTxReconSketch sketchA(CTxReconSketch::CellsForDifference(0));
+    CTxReconSketch sketchB(sketchA.GetCells());
+    for (int i = 0; i < 100; i++) {
+        uint32_t nId = insecure_rand();
+        sketchA.Add(nId);
+        sketchB.Add(nId);
+    }
+    sketchA.Subtract(sketchB);
+    vector<uint32_t> vAdded, vRemoved;
+    BOOST_CHECK(sketchA.Decode(vAdded, vRemoved));
+    BOOST_CHECK(vAdded.empty() && vRemoved.empty());
+
+    // Decoding may fail now and then, but never gives a wrong difference
+    int nDecoded = 0;
+    for (int nTry = 0; nTry < 100; nTry++) {
+        unsigned int nDiff = 1 + insecure_rand() % 100;
+        CTxReconSketch sketchOurs(CTxReconSketch::CellsForDifference(nDiff));
+        CTxReconSketch sketchTheirs(sketchOurs.GetCells());
+        set<uint32_t> setOnlyOurs, setOnlyTheirs;
+        for (int i = 0; i < 200; i++) {
+            uint32_t nId = insecure_rand();
+            sketchOurs.Add(nId);
+            sketchTheirs.Add(nId);
+        }
+        for (unsigned int i = 0; i < nDiff; i++) {
+            uint32_t nId = insecure_rand();
+            if (insecure_rand() & 1) {
+                sketchOurs.Add(nId);
+                setOnlyOurs.insert(nId);
+            } else {
+                sketchTheirs.Add(nId);
+                setOnlyTheirs.insert(nId);
+            }
+        }
+
+        // The sketch goes over the wire
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << sketchTheirs;
+        CTxReconSketch sketchReceived;
+        stream >> sketchReceived;
+        BOOST_CHECK(sketchReceived.IsWithinSizeConstraints());
+
+        sketchReceived.Subtract(sketchOurs);
+        vAdded.clear();
+        vRemoved.clear();
+        if (sketchReceived.Decode(vAdded, vRemoved)) {
+            nDecoded++;
+            BOOST_CHECK(set<uint32_t>(vAdded.begin(), vAdded.end()) == setOnlyTheirs);
+            BOOST_CHECK(set<uint32_t>(vRemoved.begin(), vRemoved.end()) == setOnlyOurs);
+        }
+    }
+    BOOST_CHECK(nDecoded >= 90);
+
+    // Far too many differences for the sketch
+    CTxReconSketch sketchSmall(CTxReconSketch::CellsForDifference(2));
+    for (int i = 0; i < 100; i++)
+        sketchSmall.Add(insecure_rand());
+    vAdded.clear();
+    vRemoved.clear();
+    BOOST_CHECK(!sketchSmall.Decode(vAdded, vRemoved));
+}
+
+BOOST_AUTO_TEST_CASE(txrecon_sketch_forged)
+{
+    // A sketch holding a single id, as it goes over the wire: the cell count
+    // followed by 9 cells of 12 bytes, of which one per sub-table holds the id
+    CTxReconSketch sketch(9);
+    sketch.Add(insecure_rand());
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << sketch;
+    vector<unsigned char> vData(stream.begin(), stream.end());
+    BOOST_CHECK_EQUAL(vData.size(), 1 + 9 * 12);
+
+    // Move the cell of the first sub-table to a slot the id does not go to
+    vector<unsigned char> vForged(vData.size(), 0);
+    vForged[0] = vData[0];
+    for (unsigned int i = 0; i < 3; i++) {
+        vector<unsigned char>::const_iterator itCell = vData.begin() + 1 + i * 12;
+        if (std::count(itCell, itCell + 12, 0) != 12) {
+            std::copy(itCell, itCell + 12, vForged.begin() + 1 + ((i + 1) % 3) * 12);
+            break;
+        }
+    }
+
+    CDataStream streamForged(vForged, SER_NETWORK, PROTOCOL_VERSION);
+    CTxReconSketch sketchForged;
+    streamForged >> sketchForged;
+    BOOST_CHECK(sketchForged.IsWithinSizeConstraints());
+    vector<uint32_t> vAdded, vRemoved;
+    BOOST_CHECK(!sketchForged.Decode(vAdded, vRemoved));
+    BOOST_CHECK(vAdded.size() + vRemoved.size() <= sketchForged.GetCells());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
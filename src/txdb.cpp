@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -65,10 +66,37 @@ void static BatchWriteHashBestAnchor(CLevelDBBatch &batch, const uint256 &hash)
     batch.Write(DB_BEST_ANCHOR, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+/**
+ * The coins database is dominated by random point lookups of small records,
+ * so it gets the bloom filter, the configurable open file budget and the
+ * optional compression and compaction trigger.
+ */
+CLevelDBProfile CoinsDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile(strName);
+    profile.nMaxOpenFiles = std::max((int)GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), 16);
+    profile.fCompression = GetBoolArg("-dbcompression", DEFAULT_DB_COMPRESSION);
+    profile.nCompactAfterBytes = std::max(GetArg("-dbcompactafter", DEFAULT_DB_COMPACT_AFTER), (int64_t)0) << 20;
+    return profile;
+}
+
+/**
+ * The block index is read in full at startup and then mostly appended to,
+ * so it favours the block cache over write buffers and needs few open files.
+ */
+CLevelDBProfile BlockTreeDBProfile()
+{
+    CLevelDBProfile profile("blockindex");
+    profile.nMaxOpenFiles = 32;
+    profile.fCompression = GetBoolArg("-dbcompression", DEFAULT_DB_COMPRESSION);
+    profile.nBlockCachePercent = 75;
+    return profile;
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, CoinsDBProfile(dbName), fMemory, fWipe) {
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, CoinsDBProfile("chainstate"), fMemory, fWipe) {
 }
 
 
@@ -158,7 +186,173 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CCoinsViewAsyncFlush::CCoinsViewAsyncFlush(CCoinsView *viewIn) : CCoinsViewBacked(viewIn), nFrozenUsage(0), fWriteFailed(false) {
+}
+
+CCoinsViewAsyncFlush::~CCoinsViewAsyncFlush() {
+    Sync();
+}
+
+bool CCoinsViewAsyncFlush::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const {
+    {
+        LOCK(cs);
+        CAnchorsMap::const_iterator it = frozenAnchors.find(rt);
+        if (it != frozenAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+    return base->GetAnchorAt(rt, tree);
+}
+
+bool CCoinsViewAsyncFlush::GetNullifier(const uint256 &nullifier) const {
+    {
+        LOCK(cs);
+        CNullifiersMap::const_iterator it = frozenNullifiers.find(nullifier);
+        if (it != frozenNullifiers.end())
+            return it->second.entered;
+    }
+    return base->GetNullifier(nullifier);
+}
+
+bool CCoinsViewAsyncFlush::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        LOCK(cs);
+        CCoinsMap::const_iterator it = frozenCoins.find(txid);
+        if (it != frozenCoins.end()) {
+            // A pruned entry is handed out as such; the cache above treats it as fresh.
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewAsyncFlush::HaveCoins(const uint256 &txid) const {
+    {
+        LOCK(cs);
+        CCoinsMap::const_iterator it = frozenCoins.find(txid);
+        if (it != frozenCoins.end())
+            return !it->second.coins.IsPruned();
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewAsyncFlush::GetBestBlock() const {
+    {
+        LOCK(cs);
+        if (!hashBlockFrozen.IsNull())
+            return hashBlockFrozen;
+    }
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewAsyncFlush::GetBestAnchor() const {
+    {
+        LOCK(cs);
+        if (!hashAnchorFrozen.IsNull())
+            return hashAnchorFrozen;
+    }
+    return base->GetBestAnchor();
+}
+
+bool CCoinsViewAsyncFlush::BatchWrite(CCoinsMap &mapCoins,
+                                      const uint256 &hashBlock,
+                                      const uint256 &hashAnchor,
+                                      CAnchorsMap &mapAnchors,
+                                      CNullifiersMap &mapNullifiers) {
+    // Only one layer can be in flight. Once the previous write has landed the
+    // backing view is up to date, so the old frozen layer can be dropped.
+    if (!Sync())
+        return false;
+
+    // The writer gets its own copy of the dirty entries, as the backing view
+    // is allowed to consume the maps it is handed.
+    CCoinsMap *pmapCoins = new CCoinsMap();
+    CAnchorsMap *pmapAnchors = new CAnchorsMap();
+    CNullifiersMap *pmapNullifiers = new CNullifiersMap();
+    size_t nUsage = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            pmapCoins->insert(*it);
+        nUsage += it->second.coins.DynamicMemoryUsage();
+    }
+    for (CAnchorsMap::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); it++) {
+        if (it->second.flags & CAnchorsCacheEntry::DIRTY)
+            pmapAnchors->insert(*it);
+        nUsage += it->second.tree.DynamicMemoryUsage();
+    }
+    for (CNullifiersMap::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
+        if (it->second.flags & CNullifiersCacheEntry::DIRTY)
+            pmapNullifiers->insert(*it);
+    }
+
+    {
+        LOCK(cs);
+        frozenCoins.clear();
+        frozenAnchors.clear();
+        frozenNullifiers.clear();
+        frozenCoins.swap(mapCoins);
+        frozenAnchors.swap(mapAnchors);
+        frozenNullifiers.swap(mapNullifiers);
+        if (!hashBlock.IsNull())
+            hashBlockFrozen = hashBlock;
+        if (!hashAnchor.IsNull())
+            hashAnchorFrozen = hashAnchor;
+        nFrozenUsage = nUsage;
+    }
+
+    LogPrint("coindb", "Handing %u changed transactions to the background coins writer\n", (unsigned int)pmapCoins->size());
+    writer = boost::thread(boost::bind(&CCoinsViewAsyncFlush::ThreadWrite, this,
+                                       pmapCoins, pmapAnchors, pmapNullifiers, hashBlock, hashAnchor));
+    return true;
+}
+
+void CCoinsViewAsyncFlush::ThreadWrite(CCoinsMap *pmapCoins, CAnchorsMap *pmapAnchors, CNullifiersMap *pmapNullifiers,
+                                       uint256 hashBlock, uint256 hashAnchor) {
+    RenameThread("horizen-coinsflush");
+    int64_t nStart = GetTimeMicros();
+    bool fOk = false;
+    try {
+        fOk = base->BatchWrite(*pmapCoins, hashBlock, hashAnchor, *pmapAnchors, *pmapNullifiers);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: error while writing coins: %s\n", __func__, e.what());
+    }
+    delete pmapCoins;
+    delete pmapAnchors;
+    delete pmapNullifiers;
+    LogPrint("bench", "    - Background coins write: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
+
+    LOCK(cs);
+    if (!fOk)
+        fWriteFailed = true;
+}
+
+bool CCoinsViewAsyncFlush::Sync() const {
+    // Must not hold cs here, the writer takes it when it finishes.
+    if (writer.joinable())
+        writer.join();
+    LOCK(cs);
+    return !fWriteFailed;
+}
+
+bool CCoinsViewAsyncFlush::GetStats(CCoinsStats &stats) const {
+    if (!Sync())
+        return false;
+    return base->GetStats(stats);
+}
+
+size_t CCoinsViewAsyncFlush::DynamicMemoryUsage() const {
+    LOCK(cs);
+    return memusage::DynamicUsage(frozenCoins) +
+           memusage::DynamicUsage(frozenAnchors) +
+           memusage::DynamicUsage(frozenNullifiers) +
+           nFrozenUsage;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, BlockTreeDBProfile(), fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
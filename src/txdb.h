@@ -8,12 +8,15 @@
 
 #include "coins.h"
 #include "leveldbwrapper.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -25,6 +28,19 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbmaxopenfiles default, number of table files the coins database may keep open
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! -dbcompression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+//! -dbcompactafter default (MiB written to the coins database between full compactions, 0 = never)
+static const int64_t DEFAULT_DB_COMPACT_AFTER = 0;
+//! -asynccoinsflush default
+static const bool DEFAULT_ASYNC_COINS_FLUSH = false;
+
+//! LevelDB profile of a coins database, from -dbmaxopenfiles, -dbcompression and -dbcompactafter
+CLevelDBProfile CoinsDBProfile(const std::string& strName);
+//! LevelDB profile of the block index database
+CLevelDBProfile BlockTreeDBProfile();
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -49,6 +65,54 @@ public:
     bool GetStats(CCoinsStats &stats) const;
 };
 
+/**
+ * CCoinsView that writes flushed cache contents to its backing view on a
+ * background thread. The last flushed layer is frozen and keeps serving
+ * reads from memory, both while it is being written and afterwards as
+ * clean (non-dirty) entries, until the next flush replaces it.
+ */
+class CCoinsViewAsyncFlush : public CCoinsViewBacked
+{
+private:
+    //! Protects the frozen layer and the writer state.
+    mutable CCriticalSection cs;
+    CCoinsMap frozenCoins;
+    CAnchorsMap frozenAnchors;
+    CNullifiersMap frozenNullifiers;
+    uint256 hashBlockFrozen;
+    uint256 hashAnchorFrozen;
+    size_t nFrozenUsage;
+
+    mutable boost::thread writer;
+    mutable bool fWriteFailed;
+
+    void ThreadWrite(CCoinsMap *pmapCoins, CAnchorsMap *pmapAnchors, CNullifiersMap *pmapNullifiers,
+                     uint256 hashBlock, uint256 hashAnchor);
+
+public:
+    CCoinsViewAsyncFlush(CCoinsView *viewIn);
+    ~CCoinsViewAsyncFlush();
+
+    bool GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const;
+    bool GetNullifier(const uint256 &nullifier) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor() const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashAnchor,
+                    CAnchorsMap &mapAnchors,
+                    CNullifiersMap &mapNullifiers);
+    bool GetStats(CCoinsStats &stats) const;
+
+    //! Wait for an outstanding background write. Returns false if it failed.
+    bool Sync() const;
+
+    //! Memory held by the frozen layer (in bytes)
+    size_t DynamicMemoryUsage() const;
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
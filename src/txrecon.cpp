@@ -0,0 +1,130 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrecon.h"
+
+#include "hash.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace {
+
+/** Mix nId with the seed of one of the sketch's hash functions (MurmurHash3's finalizer) */
+inline uint32_t MixId(uint32_t nId, uint32_t nSeed)
+{
+    uint32_t h = nId ^ (nSeed * 0x9e3779b9);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+//! Seed of the check hash; seeds 0 to 2 pick the cells
+const uint32_t CHECK_SEED = 3;
+
+/** Index of the cell nId goes to in sub-table nTable of a sketch with nSubTable cells per sub-table */
+inline unsigned int CellIndex(unsigned int nSubTable, uint32_t nId, uint32_t nTable)
+{
+    return nTable * nSubTable + MixId(nId, nTable) % nSubTable;
+}
+
+} // anon namespace
+
+uint32_t GetTxReconShortId(const uint256& hashSalt, const uint256& txid)
+{
+    return (uint32_t)Hash(hashSalt.begin(), hashSalt.end(), txid.begin(), txid.end()).GetCheapHash();
+}
+
+CTxReconSketch::CTxReconSketch(unsigned int nCells) : vCells((nCells + 2) / 3 * 3)
+{
+}
+
+unsigned int CTxReconSketch::CellsForDifference(unsigned int nDiff)
+{
+    // About two cells per id, and some spare ones for small differences,
+    // which peel less reliably, keep decoding failures to a few percent.
+    nDiff = std::min(nDiff, MAX_TXRECON_SKETCH_CELLS);
+    return std::min(MAX_TXRECON_SKETCH_CELLS, 3 * (2 * nDiff / 3 + 5));
+}
+
+bool CTxReconSketch::IsWithinSizeConstraints() const
+{
+    return !vCells.empty() && vCells.size() % 3 == 0 && vCells.size() <= MAX_TXRECON_SKETCH_CELLS;
+}
+
+void CTxReconSketch::Update(std::vector<Cell>& vCellsIn, uint32_t nId, int nDelta)
+{
+    unsigned int nSubTable = vCellsIn.size() / 3;
+    uint32_t nHash = MixId(nId, CHECK_SEED);
+    for (uint32_t i = 0; i < 3; i++) {
+        Cell& cell = vCellsIn[CellIndex(nSubTable, nId, i)];
+        cell.nCount += nDelta;
+        cell.nIdSum ^= nId;
+        cell.nHashSum ^= nHash;
+    }
+}
+
+void CTxReconSketch::Add(uint32_t nId)
+{
+    assert(!vCells.empty());
+    Update(vCells, nId, 1);
+}
+
+void CTxReconSketch::Subtract(const CTxReconSketch& other)
+{
+    assert(vCells.size() == other.vCells.size());
+    for (unsigned int i = 0; i < vCells.size(); i++) {
+        vCells[i].nCount -= other.vCells[i].nCount;
+        vCells[i].nIdSum ^= other.vCells[i].nIdSum;
+        vCells[i].nHashSum ^= other.vCells[i].nHashSum;
+    }
+}
+
+bool CTxReconSketch::Decode(std::vector<uint32_t>& vAdded, std::vector<uint32_t>& vRemoved) const
+{
+    if (vCells.empty())
+        return true;
+    if (vCells.size() % 3 != 0)
+        return false;
+
+    // Repeatedly take out the ids of pure cells, those holding a single id,
+    // until none is left. A cell only holds an id it is one of the cells of,
+    // and a sketch cannot hold more ids than it has cells: a sketch from a
+    // peer that breaks either rule could otherwise be peeled forever.
+    std::vector<Cell> vPeel(vCells);
+    unsigned int nSubTable = vPeel.size() / 3;
+    size_t nDecoded = 0;
+    bool fProgress = true;
+    while (fProgress) {
+        fProgress = false;
+        for (unsigned int i = 0; i < vPeel.size(); i++) {
+            const Cell& cell = vPeel[i];
+            if ((cell.nCount != 1 && cell.nCount != -1) || cell.nHashSum != MixId(cell.nIdSum, CHECK_SEED))
+                continue;
+            if (CellIndex(nSubTable, cell.nIdSum, i / nSubTable) != i)
+                return false;
+            if (++nDecoded > vPeel.size())
+                return false;
+            uint32_t nId = cell.nIdSum;
+            int nCount = cell.nCount;
+            if (nCount > 0)
+                vAdded.push_back(nId);
+            else
+                vRemoved.push_back(nId);
+            Update(vPeel, nId, -nCount);
+            fProgress = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < vPeel.size(); i++) {
+        if (vPeel[i].nCount != 0 || vPeel[i].nIdSum != 0 || vPeel[i].nHashSum != 0)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRECON_H
+#define BITCOIN_TXRECON_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <vector>
+
+class uint256;
+
+//! Version of the transaction reconciliation protocol we speak
+static const uint32_t TXRECON_VERSION = 1;
+//! Largest sketch we build or accept, in cells
+static const unsigned int MAX_TXRECON_SKETCH_CELLS = 3000;
+
+/**
+ * Short id of a transaction in the reconciliation with one peer: the first
+ * 32 bits of the hash of the transaction id salted with the connection's
+ * salt, so that ids cannot be made to collide ahead of time.
+ */
+uint32_t GetTxReconShortId(const uint256& hashSalt, const uint256& txid);
+
+/**
+ * Sketch of a set of short transaction ids, an invertible Bloom lookup table.
+ * Each id is added to one cell in each of three sub-tables. Subtracting the
+ * sketch of another set leaves only the ids in one set but not the other,
+ * which Decode recovers when there are no more than about half as many of
+ * them as cells. Two sketches can only be combined if they have the same size.
+ */
+class CTxReconSketch
+{
+private:
+    struct Cell
+    {
+        int32_t nCount;
+        uint32_t nIdSum;
+        uint32_t nHashSum;
+
+        Cell() : nCount(0), nIdSum(0), nHashSum(0) {}
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+            READWRITE(nCount);
+            READWRITE(nIdSum);
+            READWRITE(nHashSum);
+        }
+    };
+
+    std::vector<Cell> vCells;
+
+    static void Update(std::vector<Cell>& vCellsIn, uint32_t nId, int nDelta);
+
+public:
+    //! Sketch with nCells cells, rounded up to a multiple of three
+    explicit CTxReconSketch(unsigned int nCells = 0);
+
+    //! Cells needed to decode a difference of about nDiff ids
+    static unsigned int CellsForDifference(unsigned int nDiff);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(vCells);
+    }
+
+    unsigned int GetCells() const { return vCells.size(); }
+
+    //! True if the size is a non-zero multiple of three and at most MAX_TXRECON_SKETCH_CELLS
+    //! (catch a sketch which was just deserialized which was malformed)
+    bool IsWithinSizeConstraints() const;
+
+    void Add(uint32_t nId);
+
+    //! Remove the ids of other, which must have the same number of cells
+    void Subtract(const CTxReconSketch& other);
+
+    /**
+     * Recover the ids left after Subtract: vAdded gets those only in this
+     * sketch's set, vRemoved those only in the subtracted one. Returns false
+     * if the difference is too large for the sketch, leaving both partial.
+     */
+    bool Decode(std::vector<uint32_t>& vAdded, std::vector<uint32_t>& vRemoved) const;
+};
+
+#endif // BITCOIN_TXRECON_H
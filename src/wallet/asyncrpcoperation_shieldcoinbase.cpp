@@ -20,12 +20,16 @@
 #include "sodium.h"
 #include "miner.h"
 
+#include <algorithm>
 #include <array>
 #include <iostream>
+#include <numeric>
 #include <chrono>
 #include <thread>
 #include <string>
 
+#include <boost/algorithm/string/join.hpp>
+
 #include "asyncrpcoperation_shieldcoinbase.h"
 
 using namespace libzcash;
@@ -52,8 +56,9 @@ AsyncRPCOperation_shieldcoinbase::AsyncRPCOperation_shieldcoinbase(
         std::vector<ShieldCoinbaseUTXO> inputs,
         std::string toAddress,
         CAmount fee,
-        UniValue contextInfo) :
-        tx_(contextualTx), inputs_(inputs), fee_(fee), contextinfo_(contextInfo)
+        UniValue contextInfo,
+        std::vector<size_t> batchSizes) :
+        fee_(fee), contextinfo_(contextInfo), nProved_(0), nSent_(0), nextBatch_(0), fAbortProving_(false)
 {
     assert(contextualTx.nVersion >= PHGR_TX_VERSION || contextualTx.nVersion == GROTH_TX_VERSION);  // transaction format version must support vjoinsplit
 
@@ -65,6 +70,24 @@ AsyncRPCOperation_shieldcoinbase::AsyncRPCOperation_shieldcoinbase(
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Empty inputs");
     }
 
+    if (batchSizes.empty()) {
+        batchSizes.push_back(inputs.size());
+    }
+    if (std::accumulate(batchSizes.begin(), batchSizes.end(), (size_t)0) != inputs.size() ||
+        std::count(batchSizes.begin(), batchSizes.end(), (size_t)0) > 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Batch sizes do not partition the inputs");
+    }
+
+    // Each transaction starts from the contextual transaction
+    std::vector<ShieldCoinbaseUTXO>::const_iterator it = inputs.begin();
+    for (size_t nSize : batchSizes) {
+        ShieldCoinbaseBatch batch;
+        batch.inputs.assign(it, it + nSize);
+        batch.tx = contextualTx;
+        batches_.push_back(batch);
+        it += nSize;
+    }
+
     //  Check the destination address is valid for this network i.e. not testnet being used on mainnet
     CZCPaymentAddress address(toAddress);
     try {
@@ -145,7 +168,8 @@ void AsyncRPCOperation_shieldcoinbase::main() {
 
     std::string s = strprintf("%s: z_shieldcoinbase finished (status=%s", getId(), getStateAsString());
     if (success) {
-        s += strprintf(", txid=%s)\n", tx_.GetHash().ToString());
+        std::lock_guard<std::mutex> guard(lock_);
+        s += strprintf(", %s=%s)\n", txids_.size() > 1 ? "txids" : "txid", boost::algorithm::join(txids_, ","));
     } else {
         s += strprintf(", error=%s)\n", getErrorMessage());
     }
@@ -159,64 +183,157 @@ bool AsyncRPCOperation_shieldcoinbase::main_impl() {
 
     CAmount minersFee = fee_;
 
-    size_t numInputs = inputs_.size();
+    for (ShieldCoinbaseBatch & batch : batches_) {
+        size_t numInputs = batch.inputs.size();
 
-    // Check mempooltxinputlimit to avoid creating a transaction which the local mempool rejects
-    size_t limit = (size_t)GetArg("-mempooltxinputlimit", 0);
-    if (limit>0 && numInputs > limit) {
-        throw JSONRPCError(RPC_WALLET_ERROR,
-            strprintf("Number of inputs %d is greater than mempooltxinputlimit of %d",
-            numInputs, limit));
-    }
+        // Check mempooltxinputlimit to avoid creating a transaction which the local mempool rejects
+        size_t limit = (size_t)GetArg("-mempooltxinputlimit", 0);
+        if (limit>0 && numInputs > limit) {
+            throw JSONRPCError(RPC_WALLET_ERROR,
+                strprintf("Number of inputs %d is greater than mempooltxinputlimit of %d",
+                numInputs, limit));
+        }
+
+        CAmount targetAmount = 0;
+        for (ShieldCoinbaseUTXO & utxo : batch.inputs) {
+            targetAmount += utxo.amount;
+        }
+
+        if (targetAmount <= minersFee) {
+            throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS,
+                strprintf("Insufficient coinbase funds, have %s and miners fee is %s",
+                FormatMoney(targetAmount), FormatMoney(minersFee)));
+        }
+
+        batch.sendAmount = targetAmount - minersFee;
+        LogPrint("zrpc", "%s: spending %s to shield %s with fee %s\n",
+                getId(), FormatMoney(targetAmount), FormatMoney(batch.sendAmount), FormatMoney(minersFee));
 
-    CAmount targetAmount = 0;
-    for (ShieldCoinbaseUTXO & utxo : inputs_) {
-        targetAmount += utxo.amount;
+        // update the transaction with these inputs
+        CMutableTransaction rawTx(batch.tx);
+        for (ShieldCoinbaseUTXO & t : batch.inputs) {
+            CTxIn in(COutPoint(t.txid, t.vout));
+            rawTx.vin.push_back(in);
+        }
+
+        // Prepare raw transaction to handle JoinSplits
+        crypto_sign_keypair(batch.joinSplitPubKey.begin(), batch.joinSplitPrivKey);
+        rawTx.joinSplitPubKey = batch.joinSplitPubKey;
+        batch.tx = CTransaction(rawTx);
     }
 
-    if (targetAmount <= minersFee) {
-        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS,
-            strprintf("Insufficient coinbase funds, have %s and miners fee is %s",
-            FormatMoney(targetAmount), FormatMoney(minersFee)));
+    // Prove the transactions on a bounded pool of threads; proving one takes
+    // long enough that there is no point in more threads than transactions
+    int nThreads = GetArg("-shieldthreads", DEFAULT_SHIELD_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    nThreads = std::max(1, std::min(std::min(nThreads, MAX_SHIELD_THREADS), (int)batches_.size()));
+    if (batches_.size() > 1) {
+        LogPrint("zrpc", "%s: proving %d transactions on %d threads\n", getId(), batches_.size(), nThreads);
     }
 
-    CAmount sendAmount = targetAmount - minersFee;
-    LogPrint("zrpc", "%s: spending %s to shield %s with fee %s\n",
-            getId(), FormatMoney(targetAmount), FormatMoney(sendAmount), FormatMoney(minersFee));
+    // All transactions use the same anchor, read once as pcoinsTip needs cs_main
+    uint256 anchor = get_anchor();
 
-    // update the transaction with these inputs
-    CMutableTransaction rawTx(tx_);
-    for (ShieldCoinbaseUTXO & t : inputs_) {
-        CTxIn in(COutPoint(t.txid, t.vout));
-        rawTx.vin.push_back(in);
+    std::vector<std::thread> provers;
+    for (int i = 0; i < nThreads; i++) {
+        provers.emplace_back(&AsyncRPCOperation_shieldcoinbase::prove_batches, this, anchor);
     }
-    tx_ = CTransaction(rawTx);
 
-    // Prepare raw transaction to handle JoinSplits
-    CMutableTransaction mtx(tx_);
-	crypto_sign_keypair(joinSplitPubKey_.begin(), joinSplitPrivKey_);
-    mtx.joinSplitPubKey = joinSplitPubKey_;
-    tx_ = CTransaction(mtx);
+    // Send the transactions in order, each as soon as it has been proved
+    UniValue results(UniValue::VARR);
+    try {
+        for (ShieldCoinbaseBatch & batch : batches_) {
+            {
+                std::unique_lock<std::mutex> lock(batchMutex_);
+                batchCond_.wait(lock, [&batch]{ return !batch.joinsplit.isNull() || batch.error; });
+            }
+            if (batch.error) {
+                std::rethrow_exception(batch.error);
+            }
+
+            results.push_back(sign_send_raw_transaction(batch, batch.joinsplit));
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                txids_.push_back(batch.tx.GetHash().ToString());
+            }
+            nSent_++;
+        }
+    } catch (...) {
+        fAbortProving_ = true;
+        for (std::thread & t : provers) {
+            t.join();
+        }
+        throw;
+    }
+    for (std::thread & t : provers) {
+        t.join();
+    }
 
-    // Create joinsplit
-    UniValue obj(UniValue::VOBJ);
-    ShieldCoinbaseJSInfo info;
-    info.vpub_old = sendAmount;
-    info.vpub_new = 0;
-    JSOutput jso = JSOutput(tozaddr_, sendAmount);
-    info.vjsout.push_back(jso);
-    obj = perform_joinsplit(info);
-
-    sign_send_raw_transaction(obj);
+    if (results.size() == 1) {
+        set_result(results[0]);
+    } else {
+        UniValue txids(UniValue::VARR);
+        for (size_t i = 0; i < results.size(); i++) {
+            txids.push_back(find_value(results[i], "txid"));
+        }
+        UniValue o(UniValue::VOBJ);
+        if (testmode) {
+            o.pushKV("test", 1);
+        }
+        o.pushKV("txids", txids);
+        set_result(o);
+    }
     return true;
 }
 
 
+/**
+ * Build and prove the transaction of each unclaimed batch in turn, until all
+ * are claimed or proving has been abandoned.  Runs on each proving thread.
+ */
+void AsyncRPCOperation_shieldcoinbase::prove_batches(uint256 anchor) {
+    size_t i;
+    while (!fAbortProving_ && (i = nextBatch_++) < batches_.size()) {
+        ShieldCoinbaseBatch & batch = batches_[i];
+        UniValue obj;
+        std::exception_ptr error;
+        try {
+            if (ShutdownRequested()) {
+                throw std::runtime_error("shutdown requested before all transactions were proved");
+            }
+
+            // Create joinsplit
+            ShieldCoinbaseJSInfo info;
+            info.vpub_old = batch.sendAmount;
+            info.vpub_new = 0;
+            JSOutput jso = JSOutput(tozaddr_, batch.sendAmount);
+            info.vjsout.push_back(jso);
+            obj = perform_joinsplit(batch, info, anchor);
+        } catch (...) {
+            error = std::current_exception();
+            // Later transactions are of no use without this one
+            fAbortProving_ = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(batchMutex_);
+            batch.joinsplit = obj;
+            batch.error = error;
+        }
+        if (!error) {
+            nProved_++;
+        }
+        batchCond_.notify_all();
+    }
+}
+
+
 /**
  * Sign and send a raw transaction.
  * Raw transaction as hex string should be in object field "rawtxn"
  */
-void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
+UniValue AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(ShieldCoinbaseBatch & batch, UniValue obj)
 {
     // Sign the raw transaction
     UniValue rawtxnValue = find_value(obj, "rawtxn");
@@ -243,6 +360,7 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
     std::string signedtxn = hexValue.get_str();
 
     // Send the signed transaction
+    UniValue o(UniValue::VOBJ);
     if (!testmode) {
         params.clear();
         params.setArray();
@@ -254,9 +372,7 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
 
         std::string txid = sendResultValue.get_str();
 
-        UniValue o(UniValue::VOBJ);
         o.pushKV("txid", txid);
-        set_result(o);
     } else {
         // Test mode does not send the transaction to the network.
 
@@ -264,23 +380,27 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
         CTransaction tx;
         stream >> tx;
 
-        UniValue o(UniValue::VOBJ);
         o.pushKV("test", 1);
         o.pushKV("txid", tx.GetHash().ToString());
         o.pushKV("hex", signedtxn);
-        set_result(o);
     }
 
     // Keep the signed transaction so we can hash to the same txid
     CDataStream stream(ParseHex(signedtxn), SER_NETWORK, PROTOCOL_VERSION);
     CTransaction tx;
     stream >> tx;
-    tx_ = tx;
+    batch.tx = tx;
+    return o;
+}
+
+
+uint256 AsyncRPCOperation_shieldcoinbase::get_anchor() {
+    LOCK(cs_main);
+    return pcoinsTip->GetBestAnchor();
 }
 
 
-UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInfo & info) {
-    uint256 anchor = pcoinsTip->GetBestAnchor();
+UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseBatch & batch, ShieldCoinbaseJSInfo & info, uint256 anchor) {
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
     }
@@ -298,11 +418,11 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
         throw runtime_error("unsupported joinsplit input/output counts");
     }
 
-    CMutableTransaction mtx(tx_);
+    CMutableTransaction mtx(batch.tx);
 
     LogPrint("zrpcunsafe", "%s: creating joinsplit at index %d (vpub_old=%s, vpub_new=%s, in[0]=%s, in[1]=%s, out[0]=%s, out[1]=%s)\n",
             getId(),
-            tx_.vjoinsplit.size(),
+            batch.tx.vjoinsplit.size(),
             FormatMoney(info.vpub_old), FormatMoney(info.vpub_new),
             FormatMoney(info.vjsin[0].note.value()), FormatMoney(info.vjsin[1].note.value()),
             FormatMoney(info.vjsout[0].value), FormatMoney(info.vjsout[1].value)
@@ -326,7 +446,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
     JSDescription jsdesc = JSDescription::Randomized(
 			mtx.nVersion == GROTH_TX_VERSION,
             *pzcashParams,
-            joinSplitPubKey_,
+            batch.joinSplitPubKey,
             anchor,
             inputs,
             outputs,
@@ -338,7 +458,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
             &esk);  // parameter expects pointer to esk, so pass in address
     {
         auto verifier = libzcash::ProofVerifier::Strict();
-        if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
+        if (!(jsdesc.Verify(*pzcashParams, verifier, batch.joinSplitPubKey))) {
             throw std::runtime_error("error verifying joinsplit");
         }
     }
@@ -353,7 +473,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
     // Add the signature
     if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
             dataToBeSigned.begin(), 32,
-            joinSplitPrivKey_
+            batch.joinSplitPrivKey
             ) == 0))
     {
         throw std::runtime_error("crypto_sign_detached failed");
@@ -369,7 +489,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
     }
 
     CTransaction rawTx(mtx);
-    tx_ = rawTx;
+    batch.tx = rawTx;
 
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << rawTx;
@@ -381,7 +501,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
         ss2 << ((unsigned char) 0x00);
         ss2 << jsdesc.ephemeralKey;
         ss2 << jsdesc.ciphertexts[0];
-        ss2 << jsdesc.h_sig(*pzcashParams, joinSplitPubKey_);
+        ss2 << jsdesc.h_sig(*pzcashParams, batch.joinSplitPubKey);
 
         encryptedNote1 = HexStr(ss2.begin(), ss2.end());
     }
@@ -390,7 +510,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
         ss2 << ((unsigned char) 0x01);
         ss2 << jsdesc.ephemeralKey;
         ss2 << jsdesc.ciphertexts[1];
-        ss2 << jsdesc.h_sig(*pzcashParams, joinSplitPubKey_);
+        ss2 << jsdesc.h_sig(*pzcashParams, batch.joinSplitPubKey);
 
         encryptedNote2 = HexStr(ss2.begin(), ss2.end());
     }
@@ -418,13 +538,32 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
  */
 UniValue AsyncRPCOperation_shieldcoinbase::getStatus() const {
     UniValue v = AsyncRPCOperation::getStatus();
-    if (contextinfo_.isNull()) {
+    if (contextinfo_.isNull() && batches_.size() == 1) {
         return v;
     }
 
     UniValue obj = v.get_obj();
-    obj.pushKV("method", "z_shieldcoinbase");
-    obj.pushKV("params", contextinfo_ );
+    if (!contextinfo_.isNull()) {
+        obj.pushKV("method", "z_shieldcoinbase");
+        obj.pushKV("params", contextinfo_ );
+    }
+
+    // Report how far an operation split over several transactions has got
+    if (batches_.size() > 1) {
+        UniValue txids(UniValue::VARR);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            for (const std::string& txid : txids_) {
+                txids.push_back(txid);
+            }
+        }
+        UniValue progress(UniValue::VOBJ);
+        progress.pushKV("transactions", (uint64_t)batches_.size());
+        progress.pushKV("proved", (uint64_t)nProved_.load());
+        progress.pushKV("sent", (uint64_t)nSent_.load());
+        progress.pushKV("txids", txids);
+        obj.pushKV("progress", progress);
+    }
     return obj;
 }
 
@@ -433,9 +572,11 @@ UniValue AsyncRPCOperation_shieldcoinbase::getStatus() const {
  */
  void AsyncRPCOperation_shieldcoinbase::lock_utxos() {
     LOCK2(cs_main, pwalletMain->cs_wallet);
-    for (auto utxo : inputs_) {
-        COutPoint outpt(utxo.txid, utxo.vout);
-        pwalletMain->LockCoin(outpt);
+    for (const ShieldCoinbaseBatch& batch : batches_) {
+        for (auto utxo : batch.inputs) {
+            COutPoint outpt(utxo.txid, utxo.vout);
+            pwalletMain->LockCoin(outpt);
+        }
     }
 }
 
@@ -444,8 +585,10 @@ UniValue AsyncRPCOperation_shieldcoinbase::getStatus() const {
  */
 void AsyncRPCOperation_shieldcoinbase::unlock_utxos() {
     LOCK2(cs_main, pwalletMain->cs_wallet);
-    for (auto utxo : inputs_) {
-        COutPoint outpt(utxo.txid, utxo.vout);
-        pwalletMain->UnlockCoin(outpt);
+    for (const ShieldCoinbaseBatch& batch : batches_) {
+        for (auto utxo : batch.inputs) {
+            COutPoint outpt(utxo.txid, utxo.vout);
+            pwalletMain->UnlockCoin(outpt);
+        }
     }
 }
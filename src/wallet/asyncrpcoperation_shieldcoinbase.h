@@ -13,8 +13,13 @@
 #include "zcash/Address.hpp"
 #include "wallet.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 #include <unordered_map>
 #include <tuple>
+#include <vector>
 
 #include <univalue.h>
 
@@ -29,6 +34,19 @@ struct ShieldCoinbaseUTXO {
     CAmount amount;
 };
 
+// One transaction of a shielding operation, with the keypair its joinsplit is
+// signed with.
+struct ShieldCoinbaseBatch
+{
+    std::vector<ShieldCoinbaseUTXO> inputs;
+    CTransaction tx;
+    uint256 joinSplitPubKey;
+    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+    CAmount sendAmount = 0;
+    UniValue joinsplit;     // output of perform_joinsplit(), once proved
+    std::exception_ptr error;   // set if proving failed
+};
+
 // Package of info which is passed to perform_joinsplit methods.
 struct ShieldCoinbaseJSInfo
 {
@@ -40,7 +58,10 @@ struct ShieldCoinbaseJSInfo
 
 class AsyncRPCOperation_shieldcoinbase : public AsyncRPCOperation {
 public:
-    AsyncRPCOperation_shieldcoinbase(CMutableTransaction contextualTx, std::vector<ShieldCoinbaseUTXO> inputs, std::string toAddress, CAmount fee = SHIELD_COINBASE_DEFAULT_MINERS_FEE, UniValue contextInfo = NullUniValue);
+    // batchSizes splits inputs, in order, over several transactions which each
+    // pay fee.  These are proved in parallel and sent in order.  By default all
+    // inputs are shielded in one transaction.
+    AsyncRPCOperation_shieldcoinbase(CMutableTransaction contextualTx, std::vector<ShieldCoinbaseUTXO> inputs, std::string toAddress, CAmount fee = SHIELD_COINBASE_DEFAULT_MINERS_FEE, UniValue contextInfo = NullUniValue, std::vector<size_t> batchSizes = std::vector<size_t>());
     virtual ~AsyncRPCOperation_shieldcoinbase();
 
     // We don't want to be copied or moved around
@@ -63,19 +84,31 @@ private:
     CAmount fee_;
     PaymentAddress tozaddr_;
 
-    uint256 joinSplitPubKey_;
-    unsigned char joinSplitPrivKey_[crypto_sign_SECRETKEYBYTES];
-
-    std::vector<ShieldCoinbaseUTXO> inputs_;
+    std::vector<ShieldCoinbaseBatch> batches_;
 
-    CTransaction tx_;
+    // Progress of the operation, reported by getStatus()
+    std::atomic<size_t> nProved_;
+    std::atomic<size_t> nSent_;
+    std::vector<std::string> txids_;    // guarded by lock_
 
     bool main_impl();
 
+    // Proving threads claim batches in order and notify the sending thread
+    // as each one is proved
+    std::mutex batchMutex_;
+    std::condition_variable batchCond_;
+    std::atomic<size_t> nextBatch_;
+    std::atomic<bool> fAbortProving_;
+
+    void prove_batches(uint256 anchor);
+
+    // Anchor of the current commitment tree, read under cs_main
+    uint256 get_anchor();
+
     // JoinSplit without any input notes to spend
-    UniValue perform_joinsplit(ShieldCoinbaseJSInfo &);
+    UniValue perform_joinsplit(ShieldCoinbaseBatch &, ShieldCoinbaseJSInfo &, uint256 anchor);
 
-    void sign_send_raw_transaction(UniValue obj);     // throws exception if there was an error
+    UniValue sign_send_raw_transaction(ShieldCoinbaseBatch &, UniValue obj);     // throws exception if there was an error
 
     void lock_utxos();
 
@@ -91,11 +124,11 @@ public:
     TEST_FRIEND_AsyncRPCOperation_shieldcoinbase(std::shared_ptr<AsyncRPCOperation_shieldcoinbase> ptr) : delegate(ptr) {}
 
     CTransaction getTx() {
-        return delegate->tx_;
+        return delegate->batches_[0].tx;
     }
 
     void setTx(CTransaction tx) {
-        delegate->tx_ = tx;
+        delegate->batches_[0].tx = tx;
     }
 
     // Delegated methods
@@ -105,11 +138,11 @@ public:
     }
 
     UniValue perform_joinsplit(ShieldCoinbaseJSInfo &info) {
-        return delegate->perform_joinsplit(info);
+        return delegate->perform_joinsplit(delegate->batches_[0], info, delegate->get_anchor());
     }
 
     void sign_send_raw_transaction(UniValue obj) {
-        delegate->sign_send_raw_transaction(obj);
+        delegate->set_result(delegate->sign_send_raw_transaction(delegate->batches_[0], obj));
     }
 
     void set_state(OperationStatus state) {
@@ -0,0 +1,107 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/coinselection.h"
+
+#include "random.h"
+#include "utiltime.h"
+
+using namespace std;
+
+bool SelectCoinsBnB(const vector<CInputCoin>& vValue, const CAmount& nTargetValue,
+                    vector<char>& vfBest, int64_t nTimeBudget)
+{
+    // What the coins from each position on add up to
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (size_t i = vValue.size(); i-- > 0; )
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    int64_t nDeadline = GetTimeMicros() + nTimeBudget;
+    vector<char> vfIncluded(vValue.size(), false);
+    // Positions of the included coins, in order
+    vector<size_t> vIncluded;
+    CAmount nTotal = 0;
+    size_t i = 0;
+    for (unsigned int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue) {
+            vfBest = vfIncluded;
+            return true;
+        }
+        if (nTotal > nTargetValue || nTotal + vRemaining[i] < nTargetValue) {
+            // Dead end: leave out the last coin we included instead
+            if (vIncluded.empty())
+                return false;
+            size_t j = vIncluded.back();
+            vIncluded.pop_back();
+            vfIncluded[j] = false;
+            nTotal -= vValue[j].first;
+            // Including a coin of the same value in its place would only
+            // repeat the branch we just left
+            for (i = j + 1; i < vValue.size() && vValue[i].first == vValue[j].first; i++);
+        } else {
+            vfIncluded[i] = true;
+            vIncluded.push_back(i);
+            nTotal += vValue[i].first;
+            i++;
+        }
+        if ((nTries & 0x3ff) == 0x3ff && GetTimeMicros() > nDeadline)
+            return false;
+    }
+    return false;
+}
+
+void ApproximateBestSubset(const vector<CInputCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           vector<char>& vfBest, CAmount& nBest, int iterations, int64_t nTimeBudget)
+{
+    vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    seed_insecure_rand();
+
+    int64_t nDeadline = GetTimeMicros() + nTimeBudget;
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        // Each iteration is a pass or two over all of vValue, so with a
+        // large wallet the clock, not the count, ends the search
+        if (nRep > 0 && GetTimeMicros() > nDeadline)
+            break;
+        vfIncluded.assign(vValue.size(), false);
+        CAmount nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng is fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
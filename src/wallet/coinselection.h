@@ -0,0 +1,45 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_COINSELECTION_H
+#define BITCOIN_WALLET_COINSELECTION_H
+
+#include "amount.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CWalletTx;
+
+/** A candidate input: its value, and the output of a wallet transaction */
+typedef std::pair<CAmount, std::pair<const CWalletTx*, unsigned int> > CInputCoin;
+
+//! Most branches the exact match search visits
+static const unsigned int BNB_MAX_TRIES = 100000;
+//! Time each coin subset search may take, in microseconds
+static const int64_t COIN_SELECTION_TIME_BUDGET = 100000;
+
+/**
+ * Search for a subset of vValue, which must be sorted by decreasing value,
+ * adding up to exactly nTargetValue. Depth-first branch and bound: a branch
+ * is cut once it overshoots the target or the coins left can't reach it,
+ * and only the first of several coins of the same value is tried as the
+ * next one to leave out. Gives up after BNB_MAX_TRIES branches or
+ * nTimeBudget microseconds.
+ */
+bool SelectCoinsBnB(const std::vector<CInputCoin>& vValue, const CAmount& nTargetValue,
+                    std::vector<char>& vfBest, int64_t nTimeBudget = COIN_SELECTION_TIME_BUDGET);
+
+/**
+ * Randomized search for the subset of vValue with the smallest total of at
+ * least nTargetValue. Runs for up to the given number of iterations or
+ * nTimeBudget microseconds, whichever comes first.
+ */
+void ApproximateBestSubset(const std::vector<CInputCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           std::vector<char>& vfBest, CAmount& nBest, int iterations = 1000,
+                           int64_t nTimeBudget = COIN_SELECTION_TIME_BUDGET);
+
+#endif // BITCOIN_WALLET_COINSELECTION_H
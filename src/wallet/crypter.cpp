@@ -257,6 +257,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
         if (!SetCrypted())
             return false;
 
+        keyFilter.Insert(vchPubKey.GetID());
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
     }
     return true;
@@ -321,9 +322,26 @@ bool CCryptoKeyStore::AddSpendingKey(const libzcash::SpendingKey &sk)
     return true;
 }
 
+bool CCryptoKeyStore::AddSpendingKey(const libzcash::SpendingKey &sk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor)
+{
+    {
+        LOCK(cs_SpendingKeyStore);
+        if (!IsCrypted())
+            return CBasicKeyStore::AddSpendingKey(sk, address, decryptor);
+    }
+    return AddSpendingKey(sk);
+}
+
 bool CCryptoKeyStore::AddCryptedSpendingKey(const libzcash::PaymentAddress &address,
                                             const libzcash::ReceivingKey &rk,
                                             const std::vector<unsigned char> &vchCryptedSecret)
+{
+    return AddCryptedSpendingKey(address, ZCNoteDecryption(rk), vchCryptedSecret);
+}
+
+bool CCryptoKeyStore::AddCryptedSpendingKey(const libzcash::PaymentAddress &address,
+                                            const ZCNoteDecryption &decryptor,
+                                            const std::vector<unsigned char> &vchCryptedSecret)
 {
     {
         LOCK(cs_SpendingKeyStore);
@@ -331,7 +349,7 @@ bool CCryptoKeyStore::AddCryptedSpendingKey(const libzcash::PaymentAddress &addr
             return false;
 
         mapCryptedSpendingKeys[address] = vchCryptedSecret;
-        mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(rk)));
+        mapNoteDecryptors.insert(std::make_pair(address, decryptor));
     }
     return true;
 }
@@ -173,6 +173,8 @@ public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
     {
+        if (!keyFilter.MayContain(address))
+            return false;
         {
             LOCK(cs_KeyStore);
             if (!IsCrypted())
@@ -201,7 +203,13 @@ public:
     virtual bool AddCryptedSpendingKey(const libzcash::PaymentAddress &address,
                                        const libzcash::ReceivingKey &rk,
                                        const std::vector<unsigned char> &vchCryptedSecret);
+    //! Add an encrypted spending key whose note decryptor is derived already
+    bool AddCryptedSpendingKey(const libzcash::PaymentAddress &address,
+                               const ZCNoteDecryption &decryptor,
+                               const std::vector<unsigned char> &vchCryptedSecret);
     bool AddSpendingKey(const libzcash::SpendingKey &sk);
+    //! Add a spending key whose address and note decryptor are derived already, unless the store is encrypted
+    bool AddSpendingKey(const libzcash::SpendingKey &sk, const libzcash::PaymentAddress &address, const ZCNoteDecryption &decryptor);
     bool HaveSpendingKey(const libzcash::PaymentAddress &address) const
     {
         {
@@ -32,6 +32,7 @@ public:
     MOCK_METHOD2(WriteTx, bool(uint256 hash, const CWalletTx& wtx));
     MOCK_METHOD1(WriteWitnessCacheSize, bool(int64_t nWitnessCacheSize));
     MOCK_METHOD1(WriteBestBlock, bool(const CBlockLocator& loc));
+    MOCK_METHOD1(WriteRescanHeight, bool(int nHeight));
 };
 
 template void CWallet::SetBestChainINTERNAL<MockWalletDB>(
@@ -57,9 +58,21 @@ public:
     void DecrementNoteWitnesses(const CBlockIndex* pindex) {
         CWallet::DecrementNoteWitnesses(pindex);
     }
+    void SetRescanHeight(boost::optional<int> nHeight) {
+        nRescanHeight = nHeight;
+    }
+    boost::optional<int> GetRescanHeight() {
+        return nRescanHeight;
+    }
     void SetBestChain(MockWalletDB& walletdb, const CBlockLocator& loc) {
         CWallet::SetBestChainINTERNAL(walletdb, loc);
     }
+    void MarkNoteDataDirty(const uint256& hash) {
+        setNoteDataDirty.insert(hash);
+    }
+    bool IsNoteDataDirty(const uint256& hash) {
+        return setNoteDataDirty.count(hash) > 0;
+    }
     bool UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx) {
         return CWallet::UpdatedNoteData(wtxIn, wtx);
     }
@@ -835,6 +848,64 @@ TEST(wallet_tests, CachedWitnessesCleanIndex) {
     }
 }
 
+TEST(wallet_tests, CachedWitnessesRescanBehindTip) {
+    TestWallet wallet;
+    ZCIncrementalMerkleTree tree;
+
+    auto sk = libzcash::SpendingKey::random();
+    wallet.AddSpendingKey(sk);
+
+    // A rescan applies block 1, which has our note
+    wallet.SetRescanHeight(0);
+    CBlock block1;
+    CBlockIndex index1(block1);
+    index1.nHeight = 1;
+    auto jsoutpt = CreateValidBlock(wallet, sk, index1, block1, tree);
+    EXPECT_EQ(1, *wallet.GetRescanHeight());
+    EXPECT_EQ(1, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnessHeight);
+    EXPECT_EQ(1, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnesses.size());
+
+    // Meanwhile the tip moves on to block 3, which must not touch the note
+    auto sk2 = libzcash::SpendingKey::random();
+    CBlock block3;
+    block3.vtx.push_back(GetValidReceive(sk2, 10, true));
+    CBlockIndex index3(block3);
+    index3.nHeight = 3;
+    ZCIncrementalMerkleTree tree3;
+    wallet.IncrementNoteWitnesses(&index3, &block3, tree3);
+    EXPECT_EQ(1, *wallet.GetRescanHeight());
+    EXPECT_EQ(1, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnessHeight);
+    EXPECT_EQ(1, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnesses.size());
+
+    // Its witness is against an old tree, so it can't be spent yet
+    std::vector<JSOutPoint> notes {jsoutpt};
+    std::vector<boost::optional<ZCIncrementalWitness>> witnesses;
+    uint256 anchor;
+    wallet.GetNoteWitnesses(notes, witnesses, anchor);
+    EXPECT_FALSE((bool) witnesses[0]);
+
+    // The rescan applies block 2
+    CBlock block2;
+    block2.hashPrevBlock = block1.GetHash();
+    CBlockIndex index2(block2);
+    index2.nHeight = 2;
+    wallet.IncrementNoteWitnesses(&index2, &block2, tree);
+    EXPECT_EQ(2, *wallet.GetRescanHeight());
+    EXPECT_EQ(2, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnessHeight);
+    EXPECT_EQ(2, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnesses.size());
+
+    // Disconnecting a block the rescan has applied takes it back too
+    wallet.DecrementNoteWitnesses(&index2);
+    EXPECT_EQ(1, *wallet.GetRescanHeight());
+    EXPECT_EQ(1, wallet.mapWallet[jsoutpt.hash].mapNoteData[jsoutpt].witnessHeight);
+
+    // Once the rescan is done the witness can be used again
+    wallet.SetRescanHeight(boost::none);
+    witnesses.clear();
+    wallet.GetNoteWitnesses(notes, witnesses, anchor);
+    EXPECT_TRUE((bool) witnesses[0]);
+}
+
 TEST(wallet_tests, ClearNoteWitnessCache) {
     TestWallet wallet;
 
@@ -871,9 +942,11 @@ TEST(wallet_tests, ClearNoteWitnessCache) {
     EXPECT_FALSE((bool) witnesses[1]);
     EXPECT_EQ(1, wallet.mapWallet[hash].mapNoteData[jsoutpt].witnessHeight);
     EXPECT_EQ(1, wallet.nWitnessCacheSize);
+    EXPECT_FALSE(wallet.IsNoteDataDirty(hash));
 
     // After clearing, we should not have a witness for either note
     wallet.ClearNoteWitnessCache();
+    EXPECT_TRUE(wallet.IsNoteDataDirty(hash));
     witnesses.clear();
     wallet.GetNoteWitnesses(notes, witnesses, anchor2);
     EXPECT_FALSE((bool) witnesses[0]);
@@ -900,6 +973,7 @@ TEST(wallet_tests, WriteWitnessCache) {
     noteData[jsoutpt] = nd;
     wtx.SetNoteData(noteData);
     wallet.AddToWallet(wtx, true, NULL);
+    wallet.MarkNoteDataDirty(wtx.GetHash());
 
     // TxnBegin fails
     EXPECT_CALL(walletdb, TxnBegin())
@@ -965,6 +1039,12 @@ TEST(wallet_tests, WriteWitnessCache) {
 
     // Everything succeeds
     wallet.SetBestChain(walletdb, loc);
+    EXPECT_FALSE(wallet.IsNoteDataDirty(wtx.GetHash()));
+
+    // Nothing has changed since, so the tx isn't written again
+    EXPECT_CALL(walletdb, WriteTx(wtx.GetHash(), wtx))
+        .Times(0);
+    wallet.SetBestChain(walletdb, loc);
 }
 
 TEST(wallet_tests, UpdateNullifierNoteMap) {
@@ -1049,6 +1129,40 @@ TEST(wallet_tests, UpdatedNoteData) {
     // TODO: The new note should get witnessed (but maybe not here) (#1350)
 }
 
+TEST(wallet_tests, UpdatedNoteDataKeepsOtherNotes) {
+    TestWallet wallet;
+
+    auto sk = libzcash::SpendingKey::random();
+    auto sk2 = libzcash::SpendingKey::random();
+    wallet.AddSpendingKey(sk);
+
+    auto wtx = GetValidReceive(sk, 10, true);
+    auto note = GetNote(sk, wtx, 0, 0);
+    auto nullifier = note.nullifier(sk);
+    auto wtx2 = wtx;
+
+    // The wallet has a note found with a viewing key...
+    JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
+    mapNoteData_t noteData;
+    noteData[jsoutpt] = CNoteData {sk2.address()};
+    wtx.SetNoteData(noteData);
+
+    // ... and the tx is matched again against the spending keys only, as
+    // on block connection while the viewing key scanner is running
+    JSOutPoint jsoutpt2 {wtx.GetHash(), 0, 0};
+    mapNoteData_t noteData2;
+    noteData2[jsoutpt2] = CNoteData {sk.address(), nullifier};
+    wtx2.SetNoteData(noteData2);
+
+    EXPECT_TRUE(wallet.UpdatedNoteData(wtx2, wtx));
+    EXPECT_EQ(2, wtx.mapNoteData.size());
+    EXPECT_EQ(sk2.address(), wtx.mapNoteData[jsoutpt].address);
+    EXPECT_EQ(nullifier, *wtx.mapNoteData[jsoutpt2].nullifier);
+
+    // Nothing new the second time round
+    EXPECT_FALSE(wallet.UpdatedNoteData(wtx2, wtx));
+}
+
 TEST(wallet_tests, MarkAffectedTransactionsDirty) {
     TestWallet wallet;
 
@@ -1121,6 +1235,10 @@ TEST(wallet_tests, SetBestChainIgnoresTxsWithoutShieldedData) {
     CWalletTx wtxSproutTransparent {nullptr, mtx};
     wallet.AddToWallet(wtxSproutTransparent, true, nullptr);
 
+    wallet.MarkNoteDataDirty(wtxTransparent.GetHash());
+    wallet.MarkNoteDataDirty(wtxSprout.GetHash());
+    wallet.MarkNoteDataDirty(wtxSproutTransparent.GetHash());
+
     EXPECT_CALL(walletdb, TxnBegin())
         .WillOnce(Return(true));
     EXPECT_CALL(walletdb, WriteTx(wtxTransparent.GetHash(), wtxTransparent))
@@ -2333,6 +2333,8 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,         (numeric) the transaction fee configuration, set in " + CURRENCY_UNIT + "/kB\n"
+            "  \"viewingkeyscanheight\": n,  (numeric) the height up to which new blocks have been scanned for notes to viewing keys, if this is done on a separate thread\n"
+            "  \"viewingkeyscanlag\": n,     (numeric) the number of blocks of the active chain not yet scanned for notes to viewing keys\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2352,6 +2354,11 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     if (pwalletMain->IsCrypted())
         obj.pushKV("unlocked_until", nWalletUnlockTime);
     obj.pushKV("paytxfee",      ValueFromAmount(payTxFee.GetFeePerK()));
+    boost::optional<int> nScanHeight = pwalletMain->GetViewingKeyScanHeight();
+    if (nScanHeight) {
+        obj.pushKV("viewingkeyscanheight", *nScanHeight);
+        obj.pushKV("viewingkeyscanlag", std::max(0, chainActive.Height() - *nScanHeight));
+    }
     return obj;
 }
 
@@ -2628,7 +2635,7 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
 
     JSDescription samplejoinsplit = JSDescription::getNewInstance(shieldedTxVersion == GROTH_TX_VERSION);
 
-    if (benchmarktype == "verifyjoinsplit") {
+    if (benchmarktype == "verifyjoinsplit" || benchmarktype == "verifyjoinsplitunbatched") {
         CDataStream ss(ParseHexV(params[2].get_str(), "js"), SER_NETWORK, PROTOCOL_VERSION);
         auto os = WithTxVersion(&ss, shieldedTxVersion);
         os >> samplejoinsplit;
@@ -2651,6 +2658,8 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             }
         } else if (benchmarktype == "verifyjoinsplit") {
             sample_times.push_back(benchmark_verify_joinsplit(samplejoinsplit));
+        } else if (benchmarktype == "verifyjoinsplitunbatched") {
+            sample_times.push_back(benchmark_verify_joinsplit(samplejoinsplit, false));
 #ifdef ENABLE_MINING
         } else if (benchmarktype == "solveequihash") {
             if (params.size() < 3) {
@@ -2668,6 +2677,9 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         } else if (benchmarktype == "trydecryptnotes") {
             int nAddrs = params[2].get_int();
             sample_times.push_back(benchmark_try_decrypt_notes(nAddrs));
+        } else if (benchmarktype == "trydecryptnotesunbatched") {
+            int nAddrs = params[2].get_int();
+            sample_times.push_back(benchmark_try_decrypt_notes(nAddrs, false));
         } else if (benchmarktype == "incnotewitnesses") {
             int nTxs = params[2].get_int();
             sample_times.push_back(benchmark_increment_note_witnesses(nTxs));
@@ -2682,6 +2694,12 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             }
             auto amount = AmountFromValue(params[2]);
             sample_times.push_back(benchmark_sendtoaddress(amount));
+        } else if (benchmarktype == "selectcoins") {
+            int nCoins = params[2].get_int();
+            sample_times.push_back(benchmark_select_coins(nCoins));
+        } else if (benchmarktype == "selectcoinsnobnb") {
+            int nCoins = params[2].get_int();
+            sample_times.push_back(benchmark_select_coins(nCoins, false));
         } else if (benchmarktype == "loadwallet") {
             if (Params().NetworkIDString() != "regtest") {
                 throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
@@ -3659,9 +3677,9 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
     if (!EnsureWalletIsAvailable(fHelp))
         return NullUniValue;
 
-    if (fHelp || params.size() < 2 || params.size() > 4)
+    if (fHelp || params.size() < 2 || params.size() > 5)
         throw runtime_error(
-            "z_shieldcoinbase \"fromaddress\" \"tozaddress\" ( fee ) ( limit )\n"
+            "z_shieldcoinbase \"fromaddress\" \"tozaddress\" ( fee ) ( limit ) ( maxtxs )\n"
             "\nShield transparent coinbase funds by sending to a shielded zaddr.  This is an asynchronous operation and utxos"
             "\nselected for shielding will be locked.  If there is an error, they are unlocked.  The RPC call `listlockunspent`"
             "\ncan be used to return a list of locked utxos.  The number of coinbase utxos selected for shielding can be limited"
@@ -3673,9 +3691,11 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
             "1. \"fromaddress\"         (string, required) The address is a taddr or \"*\" for all taddrs belonging to the wallet.\n"
             "2. \"toaddress\"           (string, required) The address is a zaddr.\n"
             "3. fee                   (numeric, optional, default="
-            + strprintf("%s", FormatMoney(SHIELD_COINBASE_DEFAULT_MINERS_FEE)) + ") The fee amount to attach to this transaction.\n"
+            + strprintf("%s", FormatMoney(SHIELD_COINBASE_DEFAULT_MINERS_FEE)) + ") The fee amount to attach to each transaction.\n"
             "4. limit                 (numeric, optional, default="
-            + strprintf("%d", SHIELD_COINBASE_DEFAULT_LIMIT) + ") Limit on the maximum number of utxos to shield.  Set to 0 to use node option -mempooltxinputlimit.\n"
+            + strprintf("%d", SHIELD_COINBASE_DEFAULT_LIMIT) + ") Limit on the maximum number of utxos to shield in each transaction.  Set to 0 to use node option -mempooltxinputlimit.\n"
+            "5. maxtxs                (numeric, optional, default=1) Maximum number of transactions to split the utxos over.  The transactions\n"
+            "                         are proved in parallel (see -shieldthreads) and sent in order; z_getoperationstatus reports their progress.\n"
             "\nResult:\n"
             "{\n"
             "  \"operationid\": xxx          (string) An operationid to pass to z_getoperationstatus to get the result of the operation.\n"
@@ -3683,6 +3703,7 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
             "  \"shieldedValue\": xxx        (numeric) Value of coinbase utxos being shielded.\n"
             "  \"remainingUTXOs\": xxx       (numeric) Number of coinbase utxos still available for shielding.\n"
             "  \"remainingValue\": xxx       (numeric) Value of coinbase utxos still available for shielding.\n"
+            "  \"shieldingTxs\": xxx         (numeric) Number of transactions the utxos are shielded in.\n"
             "}\n"
         );
 
@@ -3726,8 +3747,18 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
         }
     }
 
-    // Prepare to get coinbase utxos
+    int nMaxTxs = 1;
+    if (params.size() > 4) {
+        nMaxTxs = params[4].get_int();
+        if (nMaxTxs < 1) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Maximum number of transactions must be at least 1");
+        }
+    }
+
+    // Prepare to get coinbase utxos, filling up to nMaxTxs transactions in turn
     std::vector<ShieldCoinbaseUTXO> inputs;
+    std::vector<size_t> batchSizes(1, 0);
+    std::vector<CAmount> batchValues(1, 0);
     CAmount shieldedValue = 0;
     CAmount remainingValue = 0;
     size_t estimatedTxSize = 2000;  // 1802 joinsplit description + tx overhead + wiggle room
@@ -3771,13 +3802,23 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
             CBitcoinAddress ba(address);
             size_t increase = (ba.IsScript()) ? CTXIN_SPEND_P2SH_SIZE : CTXIN_SPEND_DUST_SIZE;
             if (estimatedTxSize + increase >= MAX_TX_SIZE ||
-                (mempoolLimit > 0 && utxoCounter > mempoolLimit))
+                (mempoolLimit > 0 && batchSizes.back() >= mempoolLimit))
             {
-                maxedOutFlag = true;
-            } else {
+                if (batchSizes.size() < (size_t)nMaxTxs) {
+                    // Start the next transaction
+                    batchSizes.push_back(0);
+                    batchValues.push_back(0);
+                    estimatedTxSize = 2000;
+                } else {
+                    maxedOutFlag = true;
+                }
+            }
+            if (!maxedOutFlag) {
                 estimatedTxSize += increase;
                 ShieldCoinbaseUTXO utxo = {out.tx->GetHash(), out.i, nValue};
                 inputs.push_back(utxo);
+                batchSizes.back()++;
+                batchValues.back() += nValue;
                 shieldedValue += nValue;
             }
         }
@@ -3787,6 +3828,16 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
         }
     }
 
+    // A last transaction too small to pay its fee sanely is left for later
+    if (batchSizes.size() > 1 && batchValues.back() - nFee < nFee) {
+        size_t nDropped = batchSizes.back();
+        inputs.resize(inputs.size() - nDropped);
+        shieldedValue -= batchValues.back();
+        remainingValue += batchValues.back();
+        batchSizes.pop_back();
+        batchValues.pop_back();
+    }
+
     size_t numUtxos = inputs.size();
 
     if (numUtxos == 0) {
@@ -3800,9 +3851,11 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
     }
 
     // Check that the user specified fee is sane (if too high, it can result in error -25 absurd fee)
-    CAmount netAmount = shieldedValue - nFee;
-    if (nFee > netAmount) {
-        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Fee %s is greater than the net amount to be shielded %s", FormatMoney(nFee), FormatMoney(netAmount)));
+    for (CAmount batchValue : batchValues) {
+        CAmount netAmount = batchValue - nFee;
+        if (nFee > netAmount) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Fee %s is greater than the net amount to be shielded %s", FormatMoney(nFee), FormatMoney(netAmount)));
+        }
     }
 
     // Keep record of parameters in context object
@@ -3821,7 +3874,7 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
 
     // Create operation and add to global queue
     std::shared_ptr<AsyncRPCQueue> q = getAsyncRPCQueue();
-    std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_shieldcoinbase(contextualTx, inputs, destaddress, nFee, contextInfo) );
+    std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_shieldcoinbase(contextualTx, inputs, destaddress, nFee, contextInfo, batchSizes) );
     q->addOperation(operation);
     AsyncRPCOperationId operationId = operation->getId();
 
@@ -3831,6 +3884,7 @@ UniValue z_shieldcoinbase(const UniValue& params, bool fHelp)
     o.pushKV("remainingValue", ValueFromAmount(remainingValue));
     o.pushKV("shieldingUTXOs", numUtxos);
     o.pushKV("shieldingValue", ValueFromAmount(shieldedValue));
+    o.pushKV("shieldingTxs", batchSizes.size());
     o.pushKV("opid", operationId);
     return o;
 }
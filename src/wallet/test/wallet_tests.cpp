@@ -3,16 +3,32 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet/wallet.h"
+#include "wallet/coinselection.h"
+#include "wallet/walletdb.h"
 
 #include <set>
 #include <stdint.h>
 #include <utility>
 #include <vector>
 
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "crypto/equihash.h"
+#include "init.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "script/standard.h"
 #include "test/test_bitcoin.h"
+#include "util.h"
+#include "utiltime.h"
+#include "zcash/Note.hpp"
+#include "zcash/NoteEncryption.hpp"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -23,6 +39,7 @@
 
 using namespace std;
 
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_FIXTURE_TEST_SUITE(wallet_tests, TestingSetup)
@@ -307,4 +324,394 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static CAmount selected_value(const vector<CInputCoin>& vValue, const vector<char>& vfSelected)
+{
+    CAmount nTotal = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfSelected[i])
+            nTotal += vValue[i].first;
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(bnb_search_tests)
+{
+    vector<CInputCoin> vValue;
+    vector<char> vfSelected;
+    CWalletTx wtx;
+
+    // 20, 10, 5, 2 and 1 cents, largest first
+    for (int n : {20, 10, 5, 2, 1})
+        vValue.push_back(make_pair(n * CENT, make_pair(&wtx, 0U)));
+
+    BOOST_CHECK(SelectCoinsBnB(vValue, 7 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(selected_value(vValue, vfSelected), 7 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 38 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(selected_value(vValue, vfSelected), 38 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 31 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(selected_value(vValue, vfSelected), 31 * CENT);
+
+    // no subset adds up to these
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 39 * CENT, vfSelected));
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 4.5 * CENT, vfSelected));
+
+    // many coins of the same value don't blow up the search
+    vValue.clear();
+    for (int i = 0; i < 1000; i++)
+        vValue.push_back(make_pair(COIN, make_pair(&wtx, 0U)));
+    vValue.push_back(make_pair(CENT, make_pair(&wtx, 0U)));
+    BOOST_CHECK(SelectCoinsBnB(vValue, 500 * COIN + CENT, vfSelected));
+    BOOST_CHECK_EQUAL(selected_value(vValue, vfSelected), 500 * COIN + CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 500 * COIN + 2 * CENT, vfSelected, 10 * 1000 * 1000));
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    LOCK(pwalletMain->cs_wallet);
+    unsigned int nTarget = pwalletMain->GetKeyPoolSize() + 10;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+
+    // Every pooled key was written to the database and added to the wallet
+    vector<int64_t> vIndexes;
+    set<CKeyID> setKeys;
+    for (unsigned int i = 0; i < nTarget + 1; i++) {
+        int64_t nIndex;
+        CKeyPool keypool;
+        pwalletMain->ReserveKeyFromKeyPool(nIndex, keypool);
+        BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+        setKeys.insert(keypool.vchPubKey.GetID());
+        vIndexes.push_back(nIndex);
+    }
+    BOOST_CHECK_EQUAL(setKeys.size(), nTarget + 1);
+    BOOST_FOREACH(int64_t nIndex, vIndexes)
+        pwalletMain->ReturnKey(nIndex);
+}
+
+BOOST_AUTO_TEST_CASE(keypool_refill)
+{
+    unsigned int nTarget;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        // More than one batch of keys is needed
+        nTarget = pwalletMain->GetKeyPoolSize() + KEYPOOL_REFILL_BATCH + 50;
+    }
+    mapArgs["-keypool"] = strprintf("%u", nTarget);
+    mapArgs["-zkeypool"] = "3";
+
+    pwalletMain->RefillKeyPools();
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+        BOOST_CHECK_EQUAL(pwalletMain->GetZKeyPoolSize(), 3);
+
+        // New spending keys are taken from the pool
+        CZCPaymentAddress addr = pwalletMain->GenerateNewZKey();
+        BOOST_CHECK(pwalletMain->HaveSpendingKey(addr.Get()));
+        BOOST_CHECK_EQUAL(pwalletMain->GetZKeyPoolSize(), 2);
+    }
+
+    // The key pool is full, only the spending key taken is replaced
+    pwalletMain->RefillKeyPools();
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+        BOOST_CHECK_EQUAL(pwalletMain->GetZKeyPoolSize(), 3);
+    }
+
+    mapArgs.erase("-keypool");
+    mapArgs.erase("-zkeypool");
+}
+
+//! Append a block to the active chain whose merkle root is that of a block holding only hashTx
+static CBlockIndex* AddFakeBlock(const uint256& hashTx)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->pprev = chainActive.Tip();
+    pindex->nHeight = pindex->pprev->nHeight + 1;
+    pindex->hashMerkleRoot = hashTx;
+    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->BuildSkip();
+    chainActive.SetTip(pindex);
+    return pindex;
+}
+
+#ifdef ENABLE_MINING
+//! Append a block holding only mtx to the active chain, stored in its own block file with a valid
+//! proof of work for the selected parameters, which should be regtest's for it to be quick to solve
+static CBlockIndex* AddBlockOnDisk(const CMutableTransaction& mtx, CBlock& block)
+{
+    const CChainParams& chainparams = Params();
+    block.SetNull();
+    block.nVersion = 4;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    block.vtx.push_back(CTransaction(mtx));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nTime = chainActive.Tip()->nTime + 1;
+    block.nBits = UintToArith256(chainparams.GetConsensus().powLimit).GetCompact();
+
+    unsigned int n = chainparams.EquihashN();
+    unsigned int k = chainparams.EquihashK();
+    crypto_generichash_blake2b_state eh_state;
+    EhInitialiseState(n, k, eh_state);
+    CEquihashInput I{block};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    crypto_generichash_blake2b_update(&eh_state, (unsigned char*)&ss[0], ss.size());
+    std::function<bool(std::vector<unsigned char>)> validBlock = [&block](std::vector<unsigned char> soln) {
+        block.nSolution = soln;
+        return CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus());
+    };
+    while (true) {
+        block.nNonce = ArithToUint256(UintToArith256(block.nNonce) + 1);
+        crypto_generichash_blake2b_state curr_state = eh_state;
+        crypto_generichash_blake2b_update(&curr_state, block.nNonce.begin(), block.nNonce.size());
+        if (EhBasicSolveUncancellable(n, k, curr_state, validBlock))
+            break;
+    }
+
+    CDiskBlockPos pos(1, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos, chainparams.MessageStart()));
+
+    CBlockIndex* pindex = new CBlockIndex(block);
+    pindex->pprev = chainActive.Tip();
+    pindex->nHeight = pindex->pprev->nHeight + 1;
+    pindex->nFile = pos.nFile;
+    pindex->nDataPos = pos.nPos;
+    pindex->nStatus |= BLOCK_HAVE_DATA;
+    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->BuildSkip();
+    chainActive.SetTip(pindex);
+    return pindex;
+}
+#endif // ENABLE_MINING
+
+//! Add mtx to the wallet, confirmed in a new block
+static uint256 AddConfirmedTx(CWallet& wallet, const CMutableTransaction& mtx)
+{
+    CWalletTx wtx(&wallet, mtx);
+    wtx.SetNoteData(wallet.FindMyNotes(wtx));
+    wtx.hashBlock = AddFakeBlock(wtx.GetHash())->GetBlockHash();
+    wtx.nIndex = 0;
+    CWalletDB walletdb(wallet.strWalletFile);
+    BOOST_CHECK(wallet.AddToWallet(wtx, false, &walletdb));
+    return wtx.GetHash();
+}
+
+//! Transaction with a JoinSplit that spends nullifier and pays nValue to the first output to addr
+static CMutableTransaction NoteTx(const libzcash::PaymentAddress& addr, CAmount nValue, const uint256& nullifier)
+{
+    CMutableTransaction mtx;
+    mtx.nVersion = PHGR_TX_VERSION;
+    mtx.joinSplitPubKey = GetRandHash();
+    JSDescription jsdesc = JSDescription::getNewInstance(false);
+    jsdesc.nullifiers[0] = nullifier;
+    jsdesc.nullifiers[1] = GetRandHash();
+    jsdesc.randomSeed = GetRandHash();
+
+    // The wallet only decrypts notes, so the proof can be left out
+    libzcash::Note note(addr.a_pk, nValue, GetRandHash(), GetRandHash());
+    std::array<unsigned char, ZC_MEMO_SIZE> memo = {{0xF6}};
+    ZCNoteEncryption encryptor(jsdesc.h_sig(*pzcashParams, mtx.joinSplitPubKey));
+    jsdesc.ciphertexts[0] = libzcash::NotePlaintext(note, memo).encrypt(encryptor, addr.pk_enc);
+    jsdesc.ephemeralKey = encryptor.get_epk();
+    jsdesc.commitments[0] = note.cm();
+    jsdesc.commitments[1] = GetRandHash();
+    mtx.vjoinsplit.push_back(jsdesc);
+    return mtx;
+}
+
+//! Unspent outputs of ours, found by walking every wallet transaction
+static set<COutPoint> ScanUnspentOutputs(const CWallet& wallet)
+{
+    set<COutPoint> setRet;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, wallet.mapWallet) {
+        if (item.second.GetDepthInMainChain() < 0)
+            continue;
+        for (unsigned int i = 0; i < item.second.vout.size(); i++) {
+            if (wallet.IsMine(item.second.vout[i]) != ISMINE_NO && !wallet.IsSpent(item.first, i))
+                setRet.insert(COutPoint(item.first, i));
+        }
+    }
+    return setRet;
+}
+
+//! Unspent outputs of ours, as AvailableCoins finds them through the output index
+static set<COutPoint> IndexedUnspentOutputs(const CWallet& wallet)
+{
+    vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins, false);
+    set<COutPoint> setRet;
+    BOOST_FOREACH(const COutput& out, vCoins)
+        setRet.insert(COutPoint(out.tx->GetHash(), out.i));
+    return setRet;
+}
+
+//! Notes of ours, found by walking every wallet transaction
+static set<JSOutPoint> ScanNotes(const CWallet& wallet, bool fIgnoreSpent)
+{
+    set<JSOutPoint> setRet;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, wallet.mapWallet) {
+        if (item.second.GetDepthInMainChain() < 0)
+            continue;
+        BOOST_FOREACH(const mapNoteData_t::value_type& note, item.second.mapNoteData) {
+            if (!fIgnoreSpent || !note.second.nullifier || !wallet.IsSpent(*note.second.nullifier))
+                setRet.insert(note.first);
+        }
+    }
+    return setRet;
+}
+
+//! Notes of ours, as GetFilteredNotes finds them through the address indexes
+static set<JSOutPoint> IndexedNotes(CWallet& wallet, bool fIgnoreSpent)
+{
+    vector<CNotePlaintextEntry> vEntries;
+    wallet.GetFilteredNotes(vEntries, "", 0, fIgnoreSpent, false);
+    set<JSOutPoint> setRet;
+    BOOST_FOREACH(const CNotePlaintextEntry& entry, vEntries)
+        setRet.insert(entry.jsop);
+    return setRet;
+}
+
+static void CheckWalletIndexes(CWallet& wallet, size_t nOutputs, size_t nNotes, size_t nUnspentNotes)
+{
+    BOOST_CHECK(IndexedUnspentOutputs(wallet) == ScanUnspentOutputs(wallet));
+    BOOST_CHECK(IndexedNotes(wallet, false) == ScanNotes(wallet, false));
+    BOOST_CHECK(IndexedNotes(wallet, true) == ScanNotes(wallet, true));
+    BOOST_CHECK_EQUAL(ScanUnspentOutputs(wallet).size(), nOutputs);
+    BOOST_CHECK_EQUAL(ScanNotes(wallet, false).size(), nNotes);
+    BOOST_CHECK_EQUAL(ScanNotes(wallet, true).size(), nUnspentNotes);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_output_and_note_indexes)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWallet& walletMain = *pwalletMain;
+    CScript scriptPubKey = GetScriptForDestination(walletMain.GenerateNewKey().GetID());
+    libzcash::PaymentAddress addr = walletMain.GenerateNewZKey().Get();
+
+    // Two outputs and a note of ours
+    CMutableTransaction mtxFund = NoteTx(addr, 5 * COIN, GetRandHash());
+    mtxFund.vout.resize(2);
+    mtxFund.vout[0] = CTxOut(1 * COIN, scriptPubKey);
+    mtxFund.vout[1] = CTxOut(2 * COIN, scriptPubKey);
+    uint256 hashFund = AddConfirmedTx(walletMain, mtxFund);
+    CheckWalletIndexes(walletMain, 2, 1, 1);
+    BOOST_REQUIRE(walletMain.mapWallet[hashFund].mapNoteData.size() == 1);
+    boost::optional<uint256> nullifier = walletMain.mapWallet[hashFund].mapNoteData.begin()->second.nullifier;
+    BOOST_REQUIRE(nullifier);
+
+    // Adding it again changes nothing
+    CWalletTx wtxFund = walletMain.mapWallet[hashFund];
+    CWalletDB walletdb(walletMain.strWalletFile);
+    BOOST_CHECK(walletMain.AddToWallet(wtxFund, false, &walletdb));
+    CheckWalletIndexes(walletMain, 2, 1, 1);
+
+    // Spend the first output and the note, paying change to a new output and note
+    CBlockIndex* pindexBeforeSpend = chainActive.Tip();
+    CMutableTransaction mtxSpend = NoteTx(addr, 4 * COIN, *nullifier);
+    mtxSpend.vin.push_back(CTxIn(COutPoint(hashFund, 0)));
+    mtxSpend.vout.push_back(CTxOut(COIN / 2, scriptPubKey));
+    uint256 hashSpend = AddConfirmedTx(walletMain, mtxSpend);
+    CBlockIndex* pindexSpend = chainActive.Tip();
+    CheckWalletIndexes(walletMain, 2, 2, 1);
+
+    // Reorg the spend out, then back in
+    chainActive.SetTip(pindexBeforeSpend);
+    BOOST_CHECK_EQUAL(walletMain.mapWallet[hashSpend].GetDepthInMainChain(), -1);
+    CheckWalletIndexes(walletMain, 2, 1, 1);
+    chainActive.SetTip(pindexSpend);
+    CheckWalletIndexes(walletMain, 2, 2, 1);
+
+    // The witness cache has no bearing on the indexes
+    walletMain.ClearNoteWitnessCache();
+    CheckWalletIndexes(walletMain, 2, 2, 1);
+
+    // Once the spend can't be reorged out any more its inputs are dropped from the indexes
+    for (unsigned int i = 0; i < WITNESS_CACHE_SIZE + 1; i++)
+        AddFakeBlock(GetRandHash());
+    CheckWalletIndexes(walletMain, 2, 2, 1);
+
+    // A script added later makes the output index rebuild itself
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptNew = GetScriptForDestination(key.GetPubKey().GetID());
+    CMutableTransaction mtxOther;
+    mtxOther.vout.push_back(CTxOut(3 * COIN, scriptNew));
+    AddConfirmedTx(walletMain, mtxOther);
+    CheckWalletIndexes(walletMain, 2, 2, 1);
+    BOOST_CHECK(walletMain.AddKeyPubKey(key, key.GetPubKey()));
+    CheckWalletIndexes(walletMain, 3, 2, 1);
+}
+
+#ifdef ENABLE_MINING
+//! Wait up to ten seconds for the viewing key scanner to reach nHeight
+static bool WaitForViewingKeyScan(const CWallet& wallet, int nHeight)
+{
+    for (int i = 0; i < 1000; i++) {
+        boost::optional<int> nScanHeight = wallet.GetViewingKeyScanHeight();
+        if (nScanHeight && *nScanHeight >= nHeight)
+            return true;
+        MilliSleep(10);
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(viewing_key_scan_thread)
+{
+    // Regtest blocks have a proof of work that is quick to solve
+    SelectParams(CBaseChainParams::REGTEST);
+
+    libzcash::SpendingKey sk = libzcash::SpendingKey::random();
+    libzcash::PaymentAddress addr = sk.address();
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddViewingKey(sk.viewing_key()));
+    }
+
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(boost::bind(&ThreadScanViewingKeys, pwalletMain));
+    BOOST_REQUIRE(WaitForViewingKeyScan(*pwalletMain, chainActive.Height()));
+
+    // A note to the viewing key in a connected block is left to the scanner
+    CBlock block;
+    CBlockIndex* pindex;
+    uint256 hashTx;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pindex = AddBlockOnDisk(NoteTx(addr, 3 * COIN, GetRandHash()), block);
+        hashTx = block.vtx[0].GetHash();
+        pwalletMain->SyncTransaction(block.vtx[0], &block);
+        BOOST_CHECK(!pwalletMain->mapWallet.count(hashTx));
+        pwalletMain->ChainTip(pindex, &block, ZCIncrementalMerkleTree(), true);
+    }
+
+    // ... which finds it
+    BOOST_CHECK(WaitForViewingKeyScan(*pwalletMain, pindex->nHeight));
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_REQUIRE(pwalletMain->mapWallet.count(hashTx));
+        const CWalletTx& wtx = pwalletMain->mapWallet[hashTx];
+        BOOST_CHECK(wtx.hashBlock == block.GetHash());
+        BOOST_REQUIRE_EQUAL(wtx.mapNoteData.size(), 1);
+        BOOST_CHECK(wtx.mapNoteData.begin()->second.address == addr);
+    }
+
+    // A block that cannot be read is kept for another try, and the scanner keeps running
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        CBlock blockMissing;
+        pwalletMain->ChainTip(AddFakeBlock(GetRandHash()), &blockMissing, ZCIncrementalMerkleTree(), true);
+    }
+    MilliSleep(100);
+    BOOST_CHECK(pwalletMain->GetViewingKeyScanHeight() == boost::optional<int>(pindex->nHeight));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    BOOST_CHECK(!pwalletMain->GetViewingKeyScanHeight());
+    SelectParams(CBaseChainParams::MAIN);
+}
+#endif // ENABLE_MINING
+
 BOOST_AUTO_TEST_SUITE_END()
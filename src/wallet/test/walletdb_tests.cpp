@@ -0,0 +1,108 @@
+// Copyright (c) 2012-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/wallet.h"
+#include "wallet/walletdb.h"
+
+#include <set>
+#include <vector>
+
+#include "random.h"
+#include "script/standard.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+extern CWallet* pwalletMain;
+
+BOOST_FIXTURE_TEST_SUITE(walletdb_tests, TestingSetup)
+
+static void CheckSameWallet(CWallet& a, CWallet& b)
+{
+    LOCK2(a.cs_wallet, b.cs_wallet);
+
+    set<CKeyID> setKeysA, setKeysB;
+    a.GetKeys(setKeysA);
+    b.GetKeys(setKeysB);
+    BOOST_CHECK(setKeysA == setKeysB);
+    BOOST_FOREACH(const CKeyID& keyID, setKeysA) {
+        CKey keyA, keyB;
+        BOOST_CHECK(a.GetKey(keyID, keyA));
+        BOOST_CHECK(b.GetKey(keyID, keyB));
+        BOOST_CHECK(keyA == keyB);
+    }
+    BOOST_CHECK_EQUAL(a.mapKeyMetadata.size(), b.mapKeyMetadata.size());
+    BOOST_CHECK_EQUAL(a.GetKeyPoolSize(), b.GetKeyPoolSize());
+
+    set<libzcash::PaymentAddress> setAddrsA, setAddrsB;
+    a.GetPaymentAddresses(setAddrsA);
+    b.GetPaymentAddresses(setAddrsB);
+    BOOST_CHECK(setAddrsA == setAddrsB);
+    BOOST_FOREACH(const libzcash::PaymentAddress& addr, setAddrsA) {
+        BOOST_CHECK_EQUAL(a.HaveSpendingKey(addr), b.HaveSpendingKey(addr));
+        libzcash::SpendingKey skA, skB;
+        if (a.GetSpendingKey(addr, skA)) {
+            BOOST_CHECK(b.GetSpendingKey(addr, skB));
+            BOOST_CHECK(skA == skB);
+        }
+        BOOST_CHECK_EQUAL(a.HaveViewingKey(addr), b.HaveViewingKey(addr));
+        libzcash::ViewingKey vkA, vkB;
+        if (a.GetViewingKey(addr, vkA)) {
+            BOOST_CHECK(b.GetViewingKey(addr, vkB));
+            BOOST_CHECK(vkA == vkB);
+        }
+        ZCNoteDecryption decA, decB;
+        BOOST_CHECK(a.GetNoteDecryptor(addr, decA));
+        BOOST_CHECK(b.GetNoteDecryptor(addr, decB));
+        BOOST_CHECK(decA == decB);
+    }
+    BOOST_CHECK_EQUAL(a.mapZKeyMetadata.size(), b.mapZKeyMetadata.size());
+
+    BOOST_CHECK_EQUAL(a.mapWallet.size(), b.mapWallet.size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, a.mapWallet) {
+        map<uint256, CWalletTx>::const_iterator it = b.mapWallet.find(item.first);
+        BOOST_REQUIRE(it != b.mapWallet.end());
+        CDataStream ssA(SER_DISK, CLIENT_VERSION), ssB(SER_DISK, CLIENT_VERSION);
+        ssA << item.second;
+        ssB << it->second;
+        BOOST_CHECK(ssA.str() == ssB.str());
+        BOOST_CHECK_EQUAL(item.second.nOrderPos, it->second.nOrderPos);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(walletdb_load_parallel_decode)
+{
+    {
+        LOCK(pwalletMain->cs_wallet);
+        // Enough keys and transactions for their decoding to be spread over threads
+        BOOST_CHECK(pwalletMain->TopUpKeyPool(200));
+        for (int i = 0; i < 5; i++)
+            pwalletMain->GenerateNewZKey();
+        for (int i = 0; i < 3; i++)
+            BOOST_CHECK(pwalletMain->AddViewingKey(libzcash::SpendingKey::random().viewing_key()));
+
+        CScript scriptPubKey = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        for (int i = 0; i < 100; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+            mtx.vout.push_back(CTxOut((i + 1) * CENT, scriptPubKey));
+            CWalletTx wtx(pwalletMain, mtx);
+            BOOST_CHECK(pwalletMain->AddToWallet(wtx, false, &walletdb));
+        }
+    }
+
+    CWallet walletParallel(pwalletMain->strWalletFile);
+    BOOST_CHECK_EQUAL(CWalletDB(pwalletMain->strWalletFile).LoadWallet(&walletParallel), DB_LOAD_OK);
+    CWallet walletSerial(pwalletMain->strWalletFile);
+    BOOST_CHECK_EQUAL(CWalletDB(pwalletMain->strWalletFile).LoadWallet(&walletSerial, false), DB_LOAD_OK);
+
+    CheckSameWallet(walletParallel, walletSerial);
+    CheckSameWallet(walletParallel, *pwalletMain);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -16,6 +16,7 @@
 #include "script/sign.h"
 #include "timedata.h"
 #include "utilmoneystr.h"
+#include "wallet/coinselection.h"
 #include "zcash/Note.hpp"
 #include "crypter.h"
 #include "chainparams.h"
@@ -23,8 +24,11 @@
 using namespace zen;
 
 #include <assert.h>
+#include <limits>
+#include <memory>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -54,8 +58,8 @@ CFeeRate CWallet::minTxFee = CFeeRate(1000);
 
 struct CompareValueOnly
 {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
+    bool operator()(const CInputCoin& t1,
+                    const CInputCoin& t2) const
     {
         return t1.first < t2.first;
     }
@@ -84,8 +88,13 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 CZCPaymentAddress CWallet::GenerateNewZKey()
 {
     AssertLockHeld(cs_wallet); // mapZKeyMetadata
-    auto k = SpendingKey::random();
-    auto addr = k.address();
+    bool fFromPool = !dequeZKeyPool.empty();
+    auto k = fFromPool ? dequeZKeyPool.front().first : SpendingKey::random();
+    auto addr = fFromPool ? dequeZKeyPool.front().second : k.address();
+    if (fFromPool) {
+        dequeZKeyPool.pop_front();
+        NotifyKeyPoolRefill();
+    }
 
     // Check for collision, even though it is unlikely to ever occur
     if (CCryptoKeyStore::HaveSpendingKey(addr))
@@ -139,6 +148,13 @@ CPubKey CWallet::GenerateNewKey()
 
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
+    AddGeneratedKey(secret, pubkey);
+    return pubkey;
+}
+
+void CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
 
     // Create new metadata
     int64_t nCreationTime = GetTime();
@@ -146,9 +162,12 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
+    // A key we just made can't have received anything yet, so there's no
+    // need to rebuild the output index for it
+    bool fWasStale = fOutputIndexStale;
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey(): AddKey failed");
-    return pubkey;
+    fOutputIndexStale = fWasStale;
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
@@ -156,6 +175,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    fOutputIndexStale = true;
 
     // check if we need to remove from watch-only
     CScript script;
@@ -166,6 +186,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey,
+                                                 secret.GetPrivKey(),
+                                                 mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -247,11 +271,21 @@ bool CWallet::LoadCryptedZKey(const libzcash::PaymentAddress &addr, const libzca
     return CCryptoKeyStore::AddCryptedSpendingKey(addr, rk, vchCryptedSecret);
 }
 
+bool CWallet::LoadCryptedZKey(const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor, const std::vector<unsigned char> &vchCryptedSecret)
+{
+    return CCryptoKeyStore::AddCryptedSpendingKey(addr, decryptor, vchCryptedSecret);
+}
+
 bool CWallet::LoadZKey(const libzcash::SpendingKey &key)
 {
     return CCryptoKeyStore::AddSpendingKey(key);
 }
 
+bool CWallet::LoadZKey(const libzcash::SpendingKey &key, const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor)
+{
+    return CCryptoKeyStore::AddSpendingKey(key, addr, decryptor);
+}
+
 bool CWallet::AddViewingKey(const libzcash::ViewingKey &vk)
 {
     if (!CCryptoKeyStore::AddViewingKey(vk)) {
@@ -284,10 +318,19 @@ bool CWallet::LoadViewingKey(const libzcash::ViewingKey &vk)
     return CCryptoKeyStore::AddViewingKey(vk);
 }
 
+bool CWallet::LoadViewingKey(const libzcash::ViewingKey &vk, const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor)
+{
+    return CCryptoKeyStore::AddViewingKey(vk, addr, decryptor);
+}
+
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        fOutputIndexStale = true;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -313,6 +356,10 @@ bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_wallet);
+        fOutputIndexStale = true;
+    }
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -411,15 +458,43 @@ void CWallet::ChainTip(const CBlockIndex *pindex, const CBlock *pblock,
     if (added) {
         IncrementNoteWitnesses(pindex, pblock, tree);
     } else {
+        // Witnesses may get ahead of a pending best block (see #1378), but
+        // must not fall behind it
+        FlushBestChain();
         DecrementNoteWitnesses(pindex);
     }
+    QueueViewingKeyScan(pindex, added);
 }
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
     LOCK(cs_wallet);
+    if (fAsyncBestChain) {
+        locBestChainPending = loc;
+        return;
+    }
+    CWalletDB walletdb(strWalletFile);
+    SetBestChainINTERNAL(walletdb, loc);
+}
+
+void CWallet::FlushBestChain()
+{
+    LOCK(cs_wallet);
+    if (!locBestChainPending)
+        return;
+    CBlockLocator loc = *locBestChainPending;
+    locBestChainPending = boost::none;
+    int64_t nStart = GetTimeMillis();
+    size_t nDirty = setNoteDataDirty.size();
     CWalletDB walletdb(strWalletFile);
     SetBestChainINTERNAL(walletdb, loc);
+    LogPrint("db", "Wrote best block and %u wallet transactions %dms\n", nDirty, GetTimeMillis() - nStart);
+}
+
+void CWallet::SetAsyncBestChain(bool fAsync)
+{
+    LOCK(cs_wallet);
+    fAsyncBestChain = fAsync;
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -500,6 +575,8 @@ set<uint256> CWallet::GetConflicts(const uint256& txid) const
 
 void CWallet::Flush(bool shutdown)
 {
+    if (fFileBacked)
+        FlushBestChain();
     bitdb.Flush(shutdown);
 }
 
@@ -624,6 +701,58 @@ bool CWallet::IsSpent(const uint256& nullifier) const
     return false;
 }
 
+/**
+ * True if outpoint is spent by a wallet transaction more than nDepth blocks
+ * deep, i.e. one that we don't expect to see reorged out.
+ */
+template <class T>
+bool CWallet::IsSpentDeeperThan(const TxSpendMap<T>& mapSpends, const T& outpoint, int nDepth) const
+{
+    auto range = mapSpends.equal_range(outpoint);
+    for (auto it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > nDepth) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Add the notes and, if the output index is current, the outputs of wtx to
+ * the wallet's coin and note indexes. Adding an entry twice is harmless.
+ */
+void CWallet::IndexWalletTx(const CWalletTx& wtx)
+{
+    for (const mapNoteData_t::value_type& item : wtx.mapNoteData) {
+        mapNotesByAddress[item.second.address].insert(item.first);
+        mapUnspentNotesByAddress[item.second.address].insert(item.first);
+    }
+    if (fOutputIndexStale)
+        return;
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) != ISMINE_NO)
+            mapUnspentOutputsByScript[wtx.vout[i].scriptPubKey].insert(COutPoint(hash, i));
+    }
+}
+
+void CWallet::RebuildOutputIndex() const
+{
+    AssertLockHeld(cs_wallet);
+    mapUnspentOutputsByScript.clear();
+    for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+        const CWalletTx& wtx = item.second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            COutPoint outpoint(item.first, i);
+            if (IsMine(wtx.vout[i]) != ISMINE_NO &&
+                    !IsSpentDeeperThan(mapTxSpends, outpoint, WITNESS_CACHE_SIZE))
+                mapUnspentOutputsByScript[wtx.vout[i].scriptPubKey].insert(outpoint);
+        }
+    }
+    fOutputIndexStale = false;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -664,8 +793,11 @@ void CWallet::ClearNoteWitnessCache()
     LOCK(cs_wallet);
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
         for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
+            if (item.second.witnesses.empty() && item.second.witnessHeight == -1)
+                continue;
             item.second.witnesses.clear();
             item.second.witnessHeight = -1;
+            setNoteDataDirty.insert(wtxItem.first);
         }
     }
     nWitnessCacheSize = 0;
@@ -681,7 +813,8 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
             for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
                 CNoteData* nd = &(item.second);
                 // Only increment witnesses that are behind the current height
-                if (nd->witnessHeight < pindex->nHeight) {
+                if (nd->witnessHeight < pindex->nHeight &&
+                        !IsNoteAwaitingRescan(*nd, pindex->nHeight - 1)) {
                     // Check the validity of the cache
                     // The only time a note witnessed above the current height
                     // would be invalid here is during a reindex when blocks
@@ -727,7 +860,8 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                         for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
                             CNoteData* nd = &(item.second);
                             if (nd->witnessHeight < pindex->nHeight &&
-                                    nd->witnesses.size() > 0) {
+                                    nd->witnesses.size() > 0 &&
+                                    !IsNoteAwaitingRescan(*nd, pindex->nHeight - 1)) {
                                 // Check the validity of the cache
                                 // See earlier comment about validity.
                                 assert(nWitnessCacheSize >= nd->witnesses.size());
@@ -762,6 +896,7 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                             nd->witnesses.push_front(tree.witness());
                             // Set height to one less than pindex so it gets incremented
                             nd->witnessHeight = pindex->nHeight - 1;
+                            setNoteDataDirty.insert(hash);
                             // Check the validity of the cache
                             assert(nWitnessCacheSize >= nd->witnesses.size());
                         }
@@ -774,14 +909,20 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
             for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
                 CNoteData* nd = &(item.second);
-                if (nd->witnessHeight < pindex->nHeight) {
+                if (nd->witnessHeight < pindex->nHeight &&
+                        !IsNoteAwaitingRescan(*nd, pindex->nHeight - 1)) {
                     nd->witnessHeight = pindex->nHeight;
+                    setNoteDataDirty.insert(wtxItem.first);
                     // Check the validity of the cache
                     // See earlier comment about validity.
                     assert(nWitnessCacheSize >= nd->witnesses.size());
                 }
             }
         }
+        // If a rescan had caught up with the old tip, its notes moved with it
+        if (nRescanHeight && *nRescanHeight == pindex->nHeight - 1) {
+            nRescanHeight = pindex->nHeight;
+        }
 
         // For performance reasons, we write out the witness cache in
         // CWallet::SetBestChain() (which also ensures that overall consistency
@@ -797,7 +938,8 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
             for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
                 CNoteData* nd = &(item.second);
                 // Only increment witnesses that are not above the current height
-                if (nd->witnessHeight <= pindex->nHeight) {
+                if (nd->witnessHeight <= pindex->nHeight &&
+                        !IsNoteAwaitingRescan(*nd, pindex->nHeight)) {
                     // Check the validity of the cache
                     // See comment below (this would be invalid if there was a
                     // prior decrement).
@@ -812,6 +954,7 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
                     // pindex is the block being removed, so the new witness cache
                     // height is one below it.
                     nd->witnessHeight = pindex->nHeight - 1;
+                    setNoteDataDirty.insert(wtxItem.first);
                 }
             }
         }
@@ -829,13 +972,18 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
                 // We don't set nWitnessCacheSize to zero at the start of the
                 // reindex because the on-disk blocks had already resulted in a
                 // chain that didn't trigger the assertion below.
-                if (nd->witnessHeight < pindex->nHeight) {
+                if (nd->witnessHeight < pindex->nHeight &&
+                        !IsNoteAwaitingRescan(*nd, pindex->nHeight)) {
                     assert(nWitnessCacheSize >= nd->witnesses.size());
                 }
             }
         }
         // TODO: If nWitnessCache is zero, we need to regenerate the caches (#1302)
         assert(nWitnessCacheSize > 0);
+        // A rescan that had already applied this block steps back with it
+        if (nRescanHeight && *nRescanHeight == pindex->nHeight) {
+            nRescanHeight = pindex->nHeight - 1;
+        }
 
         // For performance reasons, we write out the witness cache in
         // CWallet::SetBestChain() (which also ensures that overall consistency
@@ -843,6 +991,13 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
     }
 }
 
+bool CWallet::IsNoteAwaitingRescan(const CNoteData& nd, int nTipHeight) const
+{
+    AssertLockHeld(cs_wallet);
+    return nRescanHeight && *nRescanHeight < nTipHeight &&
+           nd.witnessHeight <= *nRescanHeight;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -879,6 +1034,8 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 
     {
         LOCK(cs_wallet);
+        // Don't keep unencrypted spending keys around
+        dequeZKeyPool.clear();
         mapMasterKeys[++nMasterKeyMaxID] = kMasterKey;
         if (fFileBacked)
         {
@@ -981,6 +1138,7 @@ bool CWallet::UpdateNullifierNoteMap()
                             dec,
                             hSig,
                             item.first.n);
+                        setNoteDataDirty.insert(wtxItem.first);
                     }
                 }
             }
@@ -1017,6 +1175,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
+        IndexWalletTx(wtx);
     }
     else
     {
@@ -1105,6 +1264,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
             }
         }
 
+        IndexWalletTx(wtx);
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -1140,12 +1301,21 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
     auto tmp = wtxIn.mapNoteData;
     // Ensure we keep any cached witnesses we may already have
     for (const std::pair<JSOutPoint, CNoteData> nd : wtx.mapNoteData) {
-        if (tmp.count(nd.first) && nd.second.witnesses.size() > 0) {
+        if (!tmp.count(nd.first)) {
+            // Found with keys wtxIn was not matched against, e.g. by the
+            // viewing key scanner
+            tmp.insert(nd);
+            continue;
+        }
+        if (nd.second.witnesses.size() > 0) {
             tmp.at(nd.first).witnesses.assign(
                 nd.second.witnesses.cbegin(), nd.second.witnesses.cend());
         }
         tmp.at(nd.first).witnessHeight = nd.second.witnessHeight;
     }
+    if (tmp == wtx.mapNoteData) {
+        return false;
+    }
     // Now copy over the updated note data
     wtx.mapNoteData = tmp;
     return true;
@@ -1164,13 +1334,24 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
  * the fly in CMerkleTx::GetDepthInMainChain().
  */
 bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+{
+    AssertLockHeld(cs_wallet);
+    if (mapWallet.count(tx.GetHash()) && !fUpdate) return false;
+    return AddToWalletIfInvolvingMe(tx, pblock, fUpdate, FindMyNotes(tx), IsMine(tx));
+}
+
+/**
+ * As above, with the key-only matches (our notes and whether any transparent
+ * output is ours) already computed, e.g. by a rescan worker thread.
+ */
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                       const mapNoteData_t& noteData, bool fIsMine)
 {
     {
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
-        auto noteData = FindMyNotes(tx);
-        if (fExisted || IsMine(tx) || IsFromMe(tx) || noteData.size() > 0)
+        if (fExisted || fIsMine || IsFromMe(tx) || noteData.size() > 0)
         {
             CWalletTx wtx(this,tx);
 
@@ -1195,7 +1376,15 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK(cs_wallet);
-    if (!AddToWalletIfInvolvingMe(tx, pblock, true))
+    mapNoteData_t noteData;
+    {
+        LOCK(cs_SpendingKeyStore);
+        // Notes in blocks to viewing-key-only addresses are left to the
+        // viewing key scanner if it is running
+        noteData = FindMyNotes(tx, mapNoteDecryptors,
+                               (pblock && fViewingKeyScanThread) ? &mapViewingKeyDecryptors : NULL);
+    }
+    if (!AddToWalletIfInvolvingMe(tx, pblock, true, noteData, IsMine(tx)))
         return; // Not one of ours
 
     MarkAffectedTransactionsDirty(tx);
@@ -1243,12 +1432,27 @@ boost::optional<uint256> CWallet::GetNoteNullifier(const JSDescription& jsdesc,
                                                    const ZCNoteDecryption& dec,
                                                    const uint256& hSig,
                                                    uint8_t n) const
+{
+    return GetNoteNullifier(jsdesc, address, dec, dec.dhsecret(jsdesc.ephemeralKey), hSig, n);
+}
+
+/**
+ * As above, given dec.dhsecret(jsdesc.ephemeralKey), so that callers trying
+ * every output of a JoinSplit derive the DH secret only once.
+ */
+boost::optional<uint256> CWallet::GetNoteNullifier(const JSDescription& jsdesc,
+                                                   const libzcash::PaymentAddress& address,
+                                                   const ZCNoteDecryption& dec,
+                                                   const uint256& dhsecret,
+                                                   const uint256& hSig,
+                                                   uint8_t n) const
 {
     boost::optional<uint256> ret;
     auto note_pt = libzcash::NotePlaintext::decrypt(
         dec,
         jsdesc.ciphertexts[n],
         jsdesc.ephemeralKey,
+        dhsecret,
         hSig,
         (unsigned char) n);
     auto note = note_pt.note(address);
@@ -1279,20 +1483,57 @@ boost::optional<uint256> CWallet::GetNoteNullifier(const JSDescription& jsdesc,
 mapNoteData_t CWallet::FindMyNotes(const CTransaction& tx) const
 {
     LOCK(cs_SpendingKeyStore);
+    return FindMyNotes(tx, mapNoteDecryptors);
+}
+
+/**
+ * As above, trying only the given decryptors, less any in pexclude. Rescan
+ * worker threads use this with a snapshot of mapNoteDecryptors so they do not
+ * serialize on cs_SpendingKeyStore.
+ */
+mapNoteData_t CWallet::FindMyNotes(const CTransaction& tx, const NoteDecryptorMap& decryptors,
+                                   const NoteDecryptorMap* pexclude) const
+{
     uint256 hash = tx.GetHash();
 
     mapNoteData_t noteData;
     for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
-        auto hSig = tx.vjoinsplit[i].h_sig(*pzcashParams, tx.joinSplitPubKey);
-        for (uint8_t j = 0; j < tx.vjoinsplit[i].ciphertexts.size(); j++) {
-            for (const NoteDecryptorMap::value_type& item : mapNoteDecryptors) {
+        const JSDescription& jsdesc = tx.vjoinsplit[i];
+        auto hSig = jsdesc.h_sig(*pzcashParams, tx.joinSplitPubKey);
+        // All outputs of a JoinSplit share its ephemeral key, so try each
+        // decryptor against every output with a single DH secret. Outputs
+        // already claimed are skipped, so as before the first decryptor in
+        // map order wins.
+        std::vector<bool> vFound(jsdesc.ciphertexts.size(), false);
+        size_t nFound = 0;
+        for (const NoteDecryptorMap::value_type& item : decryptors) {
+            if (nFound == vFound.size()) {
+                break;
+            }
+            if (pexclude && pexclude->count(item.first)) {
+                continue;
+            }
+            uint256 dhsecret;
+            try {
+                dhsecret = item.second.dhsecret(jsdesc.ephemeralKey);
+            } catch (const std::exception &exc) {
+                // Unexpected failure
+                LogPrintf("FindMyNotes(): Unexpected error while testing decrypt:\n");
+                LogPrintf("%s\n", exc.what());
+                continue;
+            }
+            for (uint8_t j = 0; j < jsdesc.ciphertexts.size(); j++) {
+                if (vFound[j]) {
+                    continue;
+                }
                 try {
                     auto address = item.first;
                     JSOutPoint jsoutpt {hash, i, j};
                     auto nullifier = GetNoteNullifier(
-                        tx.vjoinsplit[i],
+                        jsdesc,
                         address,
                         item.second,
+                        dhsecret,
                         hSig, j);
                     if (nullifier) {
                         CNoteData nd {address, *nullifier};
@@ -1301,7 +1542,8 @@ mapNoteData_t CWallet::FindMyNotes(const CTransaction& tx) const
                         CNoteData nd {address};
                         noteData.insert(std::make_pair(jsoutpt, nd));
                     }
-                    break;
+                    vFound[j] = true;
+                    nFound++;
                 } catch (const note_decryption_failed &err) {
                     // Couldn't decrypt with this decryptor
                 } catch (const std::exception &exc) {
@@ -1337,9 +1579,13 @@ void CWallet::GetNoteWitnesses(std::vector<JSOutPoint> notes,
         boost::optional<uint256> rt;
         int i = 0;
         for (JSOutPoint note : notes) {
+            // Notes a running rescan has not caught up yet are witnessed
+            // against an older tree, so they can't be spent alongside others
             if (mapWallet.count(note.hash) &&
                     mapWallet[note.hash].mapNoteData.count(note) &&
-                    mapWallet[note.hash].mapNoteData[note].witnesses.size() > 0) {
+                    mapWallet[note.hash].mapNoteData[note].witnesses.size() > 0 &&
+                    !IsNoteAwaitingRescan(mapWallet[note.hash].mapNoteData[note],
+                                          std::numeric_limits<int>::max())) {
                 witnesses[i] = mapWallet[note.hash].mapNoteData[note].witnesses.front();
                 if (!rt) {
                     rt = witnesses[i]->root();
@@ -1487,7 +1733,7 @@ CAmount CWallet::GetChange(const CTransaction& tx) const
     return nChange;
 }
 
-void CWalletTx::SetNoteData(mapNoteData_t &noteData)
+void CWalletTx::SetNoteData(const mapNoteData_t &noteData)
 {
     mapNoteData.clear();
     for (const std::pair<JSOutPoint, CNoteData> nd : noteData) {
@@ -1767,10 +2013,153 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     }
 }
 
+namespace {
+
+/** A block read and matched ahead of the sequential stage of a rescan. */
+struct CRescanBlock
+{
+    const CBlockIndex* pindex;
+    CBlock block;
+    //! Notes we can decrypt, per transaction in block.vtx
+    std::vector<mapNoteData_t> vNoteData;
+    //! Whether any transparent output is ours, per transaction in block.vtx
+    std::vector<bool> vIsMine;
+};
+
+/**
+ * Reads, deserializes and trial-decrypts blocks for a rescan on a pool of
+ * worker threads. The sequential stage queues block indexes while it holds
+ * cs_main and takes the results back in the same order. Workers only look at
+ * keys, never at wallet transactions or the chain, so they take neither
+ * cs_wallet nor cs_main.
+ */
+class CRescanPipeline
+{
+public:
+    CRescanPipeline(const CWallet& walletIn, const NoteDecryptorMap& decryptorsIn, int nThreads) :
+        wallet(walletIn), decryptors(decryptorsIn), nQueued(0), nTaken(0), nGeneration(0), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CRescanPipeline::ThreadWork, this));
+    }
+
+    ~CRescanPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        cond.notify_all();
+        threads.join_all();
+    }
+
+    void Push(const std::vector<const CBlockIndex*>& vIndex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
+                queue.push_back(std::make_pair(nQueued++, pindex));
+        }
+        cond.notify_all();
+    }
+
+    /** Wait for the oldest queued block that hasn't been taken yet. */
+    std::shared_ptr<CRescanBlock> Get()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        assert(nTaken < nQueued);
+        while (!mapReady.count(nTaken))
+            cond.wait(lock);
+        std::shared_ptr<CRescanBlock> item = mapReady[nTaken];
+        mapReady.erase(nTaken++);
+        return item;
+    }
+
+    /** Drop everything queued; blocks still being read are discarded. */
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.clear();
+        mapReady.clear();
+        nQueued = nTaken = 0;
+        nGeneration++;
+    }
+
+private:
+    void ThreadWork()
+    {
+        RenameThread("horizen-rescan");
+        while (true) {
+            std::pair<int, const CBlockIndex*> work;
+            int nWorkGeneration;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queue.empty())
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                work = queue.front();
+                queue.pop_front();
+                nWorkGeneration = nGeneration;
+            }
+
+            std::shared_ptr<CRescanBlock> item = std::make_shared<CRescanBlock>();
+            item->pindex = work.second;
+            ReadBlockFromDisk(item->block, item->pindex);
+            item->vNoteData.reserve(item->block.vtx.size());
+            item->vIsMine.reserve(item->block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, item->block.vtx) {
+                item->vNoteData.push_back(wallet.FindMyNotes(tx, decryptors));
+                item->vIsMine.push_back(wallet.IsMine(tx));
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nWorkGeneration != nGeneration)
+                    continue;
+                mapReady[work.first] = item;
+            }
+            cond.notify_all();
+        }
+    }
+
+    const CWallet& wallet;
+    const NoteDecryptorMap& decryptors;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread_group threads;
+    std::deque<std::pair<int, const CBlockIndex*> > queue;
+    std::map<int, std::shared_ptr<CRescanBlock> > mapReady;
+    int nQueued;
+    int nTaken;
+    int nGeneration;
+    bool fStop;
+};
+
+/** Up to RESCAN_CHUNK_SIZE blocks of the active chain, starting at nHeight. */
+std::vector<const CBlockIndex*> GetRescanChunk(int nHeight)
+{
+    AssertLockHeld(cs_main);
+    std::vector<const CBlockIndex*> vIndex;
+    for (const CBlockIndex* pindex = chainActive[nHeight];
+            pindex && (int)vIndex.size() < RESCAN_CHUNK_SIZE; pindex = chainActive.Next(pindex))
+        vIndex.push_back(pindex);
+    return vIndex;
+}
+
+} // anon namespace
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and matched against our keys by a CRescanPipeline one
+ * chunk ahead of the chunk being applied. Each chunk is applied under a
+ * single cs_main hold, so block validation carries on during a long rescan.
+ * Progress is saved with the witness cache; if the rescan is interrupted by
+ * shutdown it resumes from there on the next startup.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -1778,7 +2167,17 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart = 0.0;
+    double dProgressTip = 0.0;
+    NoteDecryptorMap decryptors;
+    std::vector<const CBlockIndex*> vChunk;
+    LOCK(cs_rescan);
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1786,20 +2185,73 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - TIMESTAMP_WINDOW)))
             pindex = chainActive.Next(pindex);
+        // Pick up the notes of an unfinished rescan first
+        if (pindex && nRescanHeight && *nRescanHeight < pindex->nHeight - 1)
+            pindex = chainActive[*nRescanHeight + 1];
+        if (!pindex)
+            return ret;
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+
+        {
+            LOCK(cs_SpendingKeyStore);
+            decryptors = mapNoteDecryptors;
+        }
+
+        // Notes the viewing key scanner found after their block was
+        // witnessed have no witnesses; have the rescan witness them, in
+        // case we now have their spending keys
+        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+            for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
+                if (item.second.witnesses.empty() && item.second.witnessHeight != -1) {
+                    item.second.witnessHeight = -1;
+                    setNoteDataDirty.insert(wtxItem.first);
+                }
+            }
+        }
+
+        // From here on ChainTip leaves the notes we find to us, and the
+        // progress is saved so that a shutdown doesn't lose it
+        nRescanHeight = pindex->nHeight - 1;
+        if (fFileBacked) {
+            CWalletDB walletdb(strWalletFile);
+            SetBestChainINTERNAL(walletdb, chainActive.GetLocator());
+        }
+        vChunk = GetRescanChunk(pindex->nHeight);
+    }
+
+    CRescanPipeline pipeline(*this, decryptors, nThreads);
+    pipeline.Push(vChunk);
+    while (true)
+    {
+        std::vector<std::shared_ptr<CRescanBlock> > vBlocks;
+        for (size_t i = 0; i < vChunk.size(); i++)
+            vBlocks.push_back(pipeline.Get());
+
+        LOCK2(cs_main, cs_wallet);
+        // Have the next chunk read while this one is applied
+        vChunk = GetRescanChunk(*nRescanHeight + 1 + vBlocks.size());
+        pipeline.Push(vChunk);
+
+        bool fStale = false;
+        BOOST_FOREACH(const std::shared_ptr<CRescanBlock>& item, vBlocks)
         {
+            // The chain can have moved since the chunk was queued
+            pindex = chainActive[*nRescanHeight + 1];
+            if (item->pindex != pindex) {
+                fStale = true;
+                break;
+            }
+
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            const CBlock& block = item->block;
+            for (size_t i = 0; i < block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                if (AddToWalletIfInvolvingMe(block.vtx[i], &block, fUpdate, item->vNoteData[i], item->vIsMine[i]))
                     ret++;
             }
 
@@ -1809,15 +2261,41 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             assert(pcoinsTip->GetAnchorAt(pindex->hashAnchor, tree));
             // Increment note witness caches
             IncrementNoteWitnesses(pindex, &block, tree);
+        }
+        if (fStale || (vChunk.empty() && chainActive.Height() > *nRescanHeight)) {
+            pipeline.Clear();
+            vChunk = GetRescanChunk(*nRescanHeight + 1);
+            pipeline.Push(vChunk);
+        }
 
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+        if (vChunk.empty()) {
+            // Caught up with the tip
+            nRescanHeight = boost::none;
+            if (fFileBacked) {
+                CWalletDB walletdb(strWalletFile);
+                SetBestChainINTERNAL(walletdb, chainActive.GetLocator());
+                walletdb.EraseRescanHeight();
+            }
+            break;
+        }
+
+        bool fInterrupted = ShutdownRequested();
+        if (GetTime() >= nNow + 60 || fInterrupted) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", *nRescanHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive[*nRescanHeight]));
+            if (fFileBacked) {
+                CWalletDB walletdb(strWalletFile);
+                SetBestChainINTERNAL(walletdb, chainActive.GetLocator());
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+        if (fInterrupted) {
+            // nRescanHeight stays set so that ChainTip keeps leaving our
+            // notes alone until the rescan is resumed
+            LogPrintf("Rescan interrupted at block %d, will resume on next startup\n", *nRescanHeight);
+            break;
+        }
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -2223,8 +2701,26 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (fOutputIndexStale)
+            RebuildOutputIndex();
+
+        // Only visit the transactions the index says may have unspent outputs
+        std::map<uint256, std::vector<unsigned int> > mapCandidates;
+        for (std::pair<const CScript, std::set<COutPoint> >& item : mapUnspentOutputsByScript) {
+            for (std::set<COutPoint>::iterator oit = item.second.begin(); oit != item.second.end(); ) {
+                if (!mapWallet.count(oit->hash) ||
+                        IsSpentDeeperThan(mapTxSpends, *oit, WITNESS_CACHE_SIZE)) {
+                    item.second.erase(oit++);
+                    continue;
+                }
+                mapCandidates[oit->hash].push_back(oit->n);
+                ++oit;
+            }
+        }
+
+        for (std::map<uint256, std::vector<unsigned int> >::iterator cit = mapCandidates.begin(); cit != mapCandidates.end(); ++cit)
         {
+            std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(cit->first);
             const uint256& wtxid = it->first;
             const CWalletTx* pcoin = &(*it).second;
 
@@ -2244,7 +2740,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if (nDepth < 0)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            std::sort(cit->second.begin(), cit->second.end());
+            for (unsigned int i : cit->second) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
                     !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
@@ -2274,66 +2771,25 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
-                                  vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
-                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseBnB) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
     // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    CInputCoin coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<CAmount>::max();
     coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
+    vector<CInputCoin> vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Where several coins are equally good, pick one at random. This used
+    // to be done by shuffling a copy of vCoins, which with a large wallet
+    // costs more than the rest of this pass.
+    CInputCoin coinExact;
+    coinExact.second.first = NULL;
+    int nExact = 0, nLowestLarger = 0;
 
     BOOST_FOREACH(const COutput &output, vCoins)
     {
@@ -2348,13 +2804,12 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         int i = output.i;
         CAmount n = pcoin->vout[i].nValue;
 
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        CInputCoin coin = make_pair(n,make_pair(pcoin, i));
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExact) == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -2364,9 +2819,22 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         else if (n < coinLowestLarger.first)
         {
             coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first)
+        {
+            if (GetRandInt(++nLowestLarger) == 0)
+                coinLowestLarger = coin;
         }
     }
 
+    if (coinExact.second.first)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -2386,11 +2854,26 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Coins of the same value are tried in random order
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
+    // Look for an exact match first, which needs no change
+    if (fUseBnB && SelectCoinsBnB(vValue, nTargetValue, vfBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() exact match in %u coins\n", setCoinsRet.size());
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation
     ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
         ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
@@ -3073,7 +3556,7 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
+        int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
         for (int i = 0; i < nKeys; i++)
         {
             int64_t nIndex = i+1;
@@ -3093,29 +3576,326 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
             nTargetSize = kpSize;
         else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        std::vector<std::pair<CKey, CPubKey> > vKeys;
+        while (setKeyPool.size() + vKeys.size() < (nTargetSize + 1))
         {
+            CKey secret;
+            secret.MakeNewKey(fCompressed);
+            CPubKey pubkey = secret.GetPubKey();
+            assert(secret.VerifyPubKey(pubkey));
+            vKeys.push_back(std::make_pair(secret, pubkey));
+        }
+        AddKeysToKeyPool(vKeys);
+    }
+    return true;
+}
+
+/**
+ * Add new keys to the wallet and the key pool, writing them all in one
+ * database transaction.
+ */
+void CWallet::AddKeysToKeyPool(const std::vector<std::pair<CKey, CPubKey> >& vKeys)
+{
+    AssertLockHeld(cs_wallet);
+    if (vKeys.empty())
+        return;
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (vKeys[0].first.IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    assert(!pwalletdbEncryption);
+    pwalletdbEncryption = new CWalletDB(strWalletFile);
+    bool fTxn = pwalletdbEncryption->TxnBegin();
+    std::vector<int64_t> vIndexes;
+    try {
+        for (const std::pair<CKey, CPubKey>& item : vKeys) {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            AddGeneratedKey(item.first, item.second);
+            if (!pwalletdbEncryption->WritePool(nEnd, CKeyPool(item.second)))
                 throw runtime_error("TopUpKeyPool(): writing generated key failed");
             setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            vIndexes.push_back(nEnd);
+        }
+        if (fTxn && !pwalletdbEncryption->TxnCommit())
+            throw runtime_error("TopUpKeyPool(): committing generated keys failed");
+    } catch (...) {
+        // The keys stay in memory, but mustn't be handed out from the pool
+        if (fTxn)
+            pwalletdbEncryption->TxnAbort();
+        BOOST_FOREACH(int64_t nIndex, vIndexes)
+            setKeyPool.erase(nIndex);
+        delete pwalletdbEncryption;
+        pwalletdbEncryption = NULL;
+        throw;
+    }
+    delete pwalletdbEncryption;
+    pwalletdbEncryption = NULL;
+    LogPrintf("keypool added keys %d-%d, size=%u\n", vIndexes.front(), vIndexes.back(), setKeyPool.size());
+}
+
+void CWallet::RefillKeyPools()
+{
+    unsigned int nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+    unsigned int nZTargetSize = max(GetArg("-zkeypool", DEFAULT_ZKEYPOOL_SIZE), (int64_t) 0);
+    while (true)
+    {
+        size_t nKeys = 0, nZKeys = 0;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (!IsLocked() && setKeyPool.size() < nTargetSize + 1)
+                nKeys = std::min<size_t>(nTargetSize + 1 - setKeyPool.size(), KEYPOOL_REFILL_BATCH);
+            // Unused spending keys are only kept in memory, so don't keep
+            // any for an encrypted wallet
+            if (!IsCrypted() && dequeZKeyPool.size() < nZTargetSize)
+                nZKeys = std::min<size_t>(nZTargetSize - dequeZKeyPool.size(), KEYPOOL_REFILL_BATCH);
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        }
+        if (nKeys == 0 && nZKeys == 0)
+            return;
+
+        // The elliptic curve work happens here, without cs_wallet
+        std::vector<std::pair<CKey, CPubKey> > vKeys;
+        for (size_t i = 0; i < nKeys; i++) {
+            CKey secret;
+            secret.MakeNewKey(fCompressed);
+            CPubKey pubkey = secret.GetPubKey();
+            assert(secret.VerifyPubKey(pubkey));
+            vKeys.push_back(std::make_pair(secret, pubkey));
+        }
+        std::vector<std::pair<SpendingKey, PaymentAddress> > vZKeys;
+        for (size_t i = 0; i < nZKeys; i++) {
+            auto k = SpendingKey::random();
+            vZKeys.push_back(std::make_pair(k, k.address()));
+        }
+        boost::this_thread::interruption_point();
+
+        LOCK(cs_wallet);
+        // The wallet may have been locked, encrypted or topped up meanwhile
+        if (!IsLocked()) {
+            if (setKeyPool.size() + vKeys.size() > nTargetSize + 1)
+                vKeys.resize(nTargetSize + 1 - std::min<size_t>(setKeyPool.size(), nTargetSize + 1));
+            AddKeysToKeyPool(vKeys);
+        }
+        if (!IsCrypted())
+            dequeZKeyPool.insert(dequeZKeyPool.end(), vZKeys.begin(), vZKeys.end());
+    }
+}
+
+void CWallet::NotifyKeyPoolRefill()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+    condKeyPoolRefill.notify_one();
+}
+
+void ThreadTopUpKeyPool(CWallet* pwallet)
+{
+    RenameThread("horizen-keypool");
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->fKeyPoolRefillThread = true;
+    }
+    try {
+        while (true)
+        {
+            try {
+                pwallet->RefillKeyPools();
+            } catch (const std::exception& e) {
+                // A failed write leaves the pools as they were, try again on the next wake-up
+                LogPrintf("ThreadTopUpKeyPool(): %s\n", e.what());
+            }
+            boost::unique_lock<boost::mutex> lock(pwallet->mutexKeyPoolRefill);
+            pwallet->condKeyPoolRefill.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+    } catch (const boost::thread_interrupted&) {
+        LOCK(pwallet->cs_wallet);
+        pwallet->fKeyPoolRefillThread = false;
+        throw;
+    }
+}
+
+void CWallet::QueueViewingKeyScan(const CBlockIndex* pindex, bool fConnected)
+{
+    LOCK(cs_wallet);
+    if (!fViewingKeyScanThread)
+        return;
+    AssertLockHeld(cs_main);
+    // The scanner has got as far as the block before pindex
+    if (!locViewingKeyScan)
+        locViewingKeyScan = chainActive.GetLocator(pindex->pprev);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexViewingKeyScan);
+        dequeViewingKeyScan.push_back(std::make_pair(pindex, fConnected));
+    }
+    condViewingKeyScan.notify_one();
+}
+
+bool CWallet::ScanViewingKeys(const std::vector<std::pair<const CBlockIndex*, bool> >& vBlocks)
+{
+    NoteDecryptorMap decryptors;
+    GetViewingKeyDecryptors(decryptors);
+
+    // Only the blocks before one that cannot be read are scanned
+    size_t nBlocks = vBlocks.size();
+    std::vector<CBlock> vBlockData(nBlocks);
+    if (!decryptors.empty()) {
+        for (size_t i = 0; i < vBlocks.size(); i++) {
+            if (vBlocks[i].second && !ReadBlockFromDisk(vBlockData[i], vBlocks[i].first)) {
+                LogPrintf("ScanViewingKeys(): failed to read block %s at height %d\n",
+                          vBlocks[i].first->GetBlockHash().ToString(), vBlocks[i].first->nHeight);
+                nBlocks = i;
+                vBlockData.resize(nBlocks);
+                break;
+            }
+        }
+    }
+
+    // Each thread tries its own contiguous share of the keys against every
+    // transaction, so merging the shares in order keeps the first matching
+    // key in map order
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    nThreads = std::max(1, std::min(std::min(nThreads, MAX_RESCAN_THREADS), (int)decryptors.size()));
+    std::vector<NoteDecryptorMap> vShares(nThreads);
+    size_t n = 0;
+    for (const NoteDecryptorMap::value_type& item : decryptors)
+        vShares[n++ * nThreads / decryptors.size()].insert(item);
+
+    // Notes found by each share, per block and transaction
+    std::vector<std::vector<std::vector<mapNoteData_t> > > vNoteData(nThreads);
+    auto scan = [this, &vShares, &vBlockData, &vNoteData](int nShare) {
+        vNoteData[nShare].resize(vBlockData.size());
+        for (size_t i = 0; i < vBlockData.size(); i++) {
+            BOOST_FOREACH(const CTransaction& tx, vBlockData[i].vtx)
+                vNoteData[nShare][i].push_back(FindMyNotes(tx, vShares[nShare]));
         }
+    };
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread([&scan, i]() { scan(i); });
+    scan(0);
+    threadGroup.join_all();
+    boost::this_thread::interruption_point();
+
+    LOCK2(cs_main, cs_wallet);
+    const CBlockIndex* pindexScanned = NULL;
+    for (size_t i = 0; i < nBlocks; i++) {
+        const CBlockIndex* pindex = vBlocks[i].first;
+        const CBlock& block = vBlockData[i];
+        for (size_t j = 0; j < block.vtx.size(); j++) {
+            const CTransaction& tx = block.vtx[j];
+            mapNoteData_t noteData;
+            for (int s = 0; s < nThreads; s++)
+                noteData.insert(vNoteData[s][i][j].begin(), vNoteData[s][i][j].end());
+            if (noteData.empty())
+                continue;
+            // Keep what was found for our spending keys on block connection
+            std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(tx.GetHash());
+            if (mi != mapWallet.end()) {
+                for (const mapNoteData_t::value_type& item : mi->second.mapNoteData)
+                    noteData[item.first] = item.second;
+            }
+            if (AddToWalletIfInvolvingMe(tx, &block, true, noteData, IsMine(tx)))
+                MarkAffectedTransactionsDirty(tx);
+        }
+        pindexScanned = vBlocks[i].second ? pindex : pindex->pprev;
+        nViewingKeyScanHeight = vBlocks[i].second ? pindex->nHeight : pindex->nHeight - 1;
+    }
+
+    if (nBlocks < vBlocks.size()) {
+        // Put the blocks from the one that could not be read back in front
+        // of those queued since, and save the scanner's progress until then
+        {
+            boost::unique_lock<boost::mutex> lock(mutexViewingKeyScan);
+            dequeViewingKeyScan.insert(dequeViewingKeyScan.begin(), vBlocks.begin() + nBlocks, vBlocks.end());
+        }
+        if (pindexScanned)
+            locViewingKeyScan = chainActive.GetLocator(pindexScanned);
+        return false;
+    }
+
+    bool fCaughtUp;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexViewingKeyScan);
+        fCaughtUp = dequeViewingKeyScan.empty();
     }
+    if (fCaughtUp)
+        locViewingKeyScan = boost::none;
+    else if (pindexScanned)
+        locViewingKeyScan = chainActive.GetLocator(pindexScanned);
     return true;
 }
 
+boost::optional<int> CWallet::GetViewingKeyScanHeight() const
+{
+    LOCK(cs_wallet);
+    if (!fViewingKeyScanThread)
+        return boost::none;
+    return nViewingKeyScanHeight;
+}
+
+void ThreadScanViewingKeys(CWallet* pwallet)
+{
+    RenameThread("horizen-vkscan");
+    {
+        // Under cs_main, so that no block is half synced one way and half
+        // the other
+        LOCK2(cs_main, pwallet->cs_wallet);
+        pwallet->nViewingKeyScanHeight = chainActive.Height();
+        pwallet->fViewingKeyScanThread = true;
+    }
+    try {
+        int64_t nRetryMillis = 0;
+        while (true)
+        {
+            // After a failure, wait a while before trying the same blocks again
+            if (nRetryMillis > 0)
+                MilliSleep(nRetryMillis);
+
+            std::vector<std::pair<const CBlockIndex*, bool> > vBlocks;
+            {
+                boost::unique_lock<boost::mutex> lock(pwallet->mutexViewingKeyScan);
+                while (pwallet->dequeViewingKeyScan.empty())
+                    pwallet->condViewingKeyScan.wait(lock);
+                std::deque<std::pair<const CBlockIndex*, bool> >& deque = pwallet->dequeViewingKeyScan;
+                size_t nTake = std::min<size_t>(deque.size(), RESCAN_CHUNK_SIZE);
+                vBlocks.assign(deque.begin(), deque.begin() + nTake);
+                deque.erase(deque.begin(), deque.begin() + nTake);
+            }
+
+            bool fScanned = false;
+            try {
+                fScanned = pwallet->ScanViewingKeys(vBlocks);
+            } catch (const std::exception& e) {
+                // Scanning a block again finds the same notes, so the whole
+                // chunk goes back in front of the queue
+                LogPrintf("ThreadScanViewingKeys(): %s\n", e.what());
+                boost::unique_lock<boost::mutex> lock(pwallet->mutexViewingKeyScan);
+                pwallet->dequeViewingKeyScan.insert(pwallet->dequeViewingKeyScan.begin(), vBlocks.begin(), vBlocks.end());
+            }
+            nRetryMillis = fScanned ? 0 : std::min<int64_t>(std::max<int64_t>(2 * nRetryMillis, 1000), 60 * 1000);
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Blocks left in the queue are rescanned on the next startup, as
+        // the saved best block is the scanner's
+        LOCK2(cs_main, pwallet->cs_wallet);
+        pwallet->fViewingKeyScanThread = false;
+        throw;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -3123,8 +3903,14 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // With the refill thread running, only top up here once the pool
+        // has run dry
+        if (!IsLocked()) {
+            if (fKeyPoolRefillThread && !setKeyPool.empty())
+                NotifyKeyPoolRefill();
+            else
+                TopUpKeyPool();
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -3673,67 +4459,74 @@ void CWallet::GetFilteredNotes(std::vector<CNotePlaintextEntry> & outEntries, st
 
     LOCK2(cs_main, cs_wallet);
 
-    for (auto & p : mapWallet) {
-        CWalletTx wtx = p.second;
-
-        // Filter the transactions before checking for notes
-        if (!CheckFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < minDepth) {
+    // Collect the candidate notes from the address index, in the same
+    // (transaction, JoinSplit, output) order a walk of mapWallet would give
+    auto& mapIndex = ignoreSpent ? mapUnspentNotesByAddress : mapNotesByAddress;
+    std::set<JSOutPoint> setCandidates;
+    for (auto& item : mapIndex) {
+        if (fFilterAddress && !(item.first == filterPaymentAddress)) {
             continue;
         }
+        setCandidates.insert(item.second.begin(), item.second.end());
+    }
 
-        if (wtx.mapNoteData.size() == 0) {
+    for (const JSOutPoint& jsop : setCandidates) {
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(jsop.hash);
+        if (mi == mapWallet.end() || !mi->second.mapNoteData.count(jsop)) {
             continue;
         }
+        const CWalletTx& wtx = mi->second;
 
-        for (auto & pair : wtx.mapNoteData) {
-            JSOutPoint jsop = pair.first;
-            CNoteData nd = pair.second;
-            PaymentAddress pa = nd.address;
+        // Filter the transactions before checking for notes
+        if (!CheckFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < minDepth) {
+            continue;
+        }
 
-            // skip notes which belong to a different payment address in the wallet
-            if (fFilterAddress && !(pa == filterPaymentAddress)) {
-                continue;
-            }
+        const CNoteData& nd = wtx.mapNoteData.at(jsop);
+        PaymentAddress pa = nd.address;
 
-            // skip note which has been spent
-            if (ignoreSpent && nd.nullifier && IsSpent(*nd.nullifier)) {
-                continue;
+        // skip note which has been spent
+        if (ignoreSpent && nd.nullifier && IsSpent(*nd.nullifier)) {
+            // and forget it for good once the spend can't be reorged out
+            if (IsSpentDeeperThan(mapTxNullifiers, *nd.nullifier, WITNESS_CACHE_SIZE)) {
+                mapUnspentNotesByAddress[pa].erase(jsop);
             }
+            continue;
+        }
 
-            // skip notes which cannot be spent
-            if (ignoreUnspendable && !HaveSpendingKey(pa)) {
-                continue;
-            }
+        // skip notes which cannot be spent
+        if (ignoreUnspendable && !HaveSpendingKey(pa)) {
+            continue;
+        }
 
-            int i = jsop.js; // Index into CTransaction.vjoinsplit
-            int j = jsop.n; // Index into JSDescription.ciphertexts
+        int i = jsop.js; // Index into CTransaction.vjoinsplit
+        int j = jsop.n; // Index into JSDescription.ciphertexts
 
-            // Get cached decryptor
-            ZCNoteDecryption decryptor;
-            if (!GetNoteDecryptor(pa, decryptor)) {
-                // Note decryptors are created when the wallet is loaded, so it should always exist
-                throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", CZCPaymentAddress(pa).ToString()));
-            }
+        // Get cached decryptor
+        ZCNoteDecryption decryptor;
+        if (!GetNoteDecryptor(pa, decryptor)) {
+            // Note decryptors are created when the wallet is loaded, so it should always exist
+            throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", CZCPaymentAddress(pa).ToString()));
+        }
 
-            // determine amount of funds in the note
-            auto hSig = wtx.vjoinsplit[i].h_sig(*pzcashParams, wtx.joinSplitPubKey);
-            try {
-                NotePlaintext plaintext = NotePlaintext::decrypt(
-                        decryptor,
-                        wtx.vjoinsplit[i].ciphertexts[j],
-                        wtx.vjoinsplit[i].ephemeralKey,
-                        hSig,
-                        (unsigned char) j);
-
-                outEntries.push_back(CNotePlaintextEntry{jsop, plaintext});
-
-            } catch (const note_decryption_failed &err) {
-                // Couldn't decrypt with this spending key
-                throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", CZCPaymentAddress(pa).ToString()));
-            } catch (const std::exception &exc) {
-                // Unexpected failure
-                throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", CZCPaymentAddress(pa).ToString(), exc.what()));
-            }
+        // determine amount of funds in the note
+        auto hSig = wtx.vjoinsplit[i].h_sig(*pzcashParams, wtx.joinSplitPubKey);
+        try {
+            NotePlaintext plaintext = NotePlaintext::decrypt(
+                    decryptor,
+                    wtx.vjoinsplit[i].ciphertexts[j],
+                    wtx.vjoinsplit[i].ephemeralKey,
+                    hSig,
+                    (unsigned char) j);
+
+            outEntries.push_back(CNotePlaintextEntry{jsop, plaintext});
+
+        } catch (const note_decryption_failed &err) {
+            // Couldn't decrypt with this spending key
+            throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", CZCPaymentAddress(pa).ToString()));
+        } catch (const std::exception &exc) {
+            // Unexpected failure
+            throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", CZCPaymentAddress(pa).ToString(), exc.what()));
         }
     }
 }
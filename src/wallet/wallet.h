@@ -25,6 +25,7 @@
 #include "base58.h"
 
 #include <algorithm>
+#include <deque>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -59,6 +60,24 @@ static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //  Should be large enough that we can expect not to reorg beyond our cache
 //  unless there is some exceptional network disruption.
 static const unsigned int WITNESS_CACHE_SIZE = COINBASE_MATURITY;
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of rescan read/match threads
+static const int MAX_RESCAN_THREADS = 16;
+//! Number of blocks a rescan applies per cs_main hold, and reads ahead
+static const int RESCAN_CHUNK_SIZE = 100;
+//! -keypool default
+static const unsigned int DEFAULT_KEYPOOL_SIZE = 100;
+//! -zkeypool default
+static const unsigned int DEFAULT_ZKEYPOOL_SIZE = 10;
+//! Most keys the key pool refill thread adds per database transaction
+static const unsigned int KEYPOOL_REFILL_BATCH = 100;
+//! -viewingkeythread default
+static const bool DEFAULT_VIEWINGKEY_THREAD = true;
+//! -shieldthreads default (0 = one per core)
+static const int DEFAULT_SHIELD_THREADS = 2;
+//! Maximum number of threads proving the transactions of a z_shieldcoinbase
+static const int MAX_SHIELD_THREADS = 16;
 
 class CBlockIndex;
 class CCoinControl;
@@ -487,7 +506,7 @@ public:
         MarkDirty();
     }
 
-    void SetNoteData(mapNoteData_t &noteData);
+    void SetNoteData(const mapNoteData_t &noteData);
 
     //! filter decides which addresses will count towards the debit
     CAmount GetDebit(const isminefilter& filter) const;
@@ -660,8 +679,42 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool& fOnlyCoinbaseCoinsRet, bool& fNeedCoinbaseCoinsRet, const CCoinControl *coinControl = NULL) const;
 
+    //! If set, new keys are written through this handle and its open
+    //! transaction (wallet encryption, key pool top-ups)
     CWalletDB *pwalletdbEncryption;
 
+    //! Spending keys generated ahead of GenerateNewZKey, with their addresses
+    std::deque<std::pair<libzcash::SpendingKey, libzcash::PaymentAddress> > dequeZKeyPool;
+
+    //! Wakes up ThreadTopUpKeyPool
+    boost::mutex mutexKeyPoolRefill;
+    boost::condition_variable condKeyPoolRefill;
+    bool fKeyPoolRefillThread;
+
+    /**
+     * Blocks connected (true) or disconnected (false) that
+     * ThreadScanViewingKeys has yet to look at. While it runs, notes to the
+     * addresses we only have viewing keys for are left to it rather than
+     * found during block connection.
+     */
+    std::deque<std::pair<const CBlockIndex*, bool> > dequeViewingKeyScan;
+    boost::mutex mutexViewingKeyScan;
+    boost::condition_variable condViewingKeyScan;
+    bool fViewingKeyScanThread;
+    //! Height of the last block scanned for notes to viewing keys
+    int nViewingKeyScanHeight;
+    /**
+     * While the scanner is behind the tip, the locator of the last block it
+     * has scanned. SetBestChain saves it in place of the tip's, so blocks
+     * it has not got to are rescanned on the next startup.
+     */
+    boost::optional<CBlockLocator> locViewingKeyScan;
+
+    void QueueViewingKeyScan(const CBlockIndex* pindex, bool fConnected);
+
+    void AddGeneratedKey(const CKey& secret, const CPubKey& pubkey);
+    void AddKeysToKeyPool(const std::vector<std::pair<CKey, CPubKey> >& vKeys);
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -692,6 +745,24 @@ private:
     void AddToSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Indexes over mapWallet for coin and note queries, so they don't have
+     * to walk every wallet transaction. The unspent indexes hold every output
+     * and note of ours that may still be unspent. Entries are dropped once
+     * spent by a transaction buried deeper than WITNESS_CACHE_SIZE, which is
+     * as far as the wallet expects a reorg to go. The output index depends on
+     * IsMine, so it is rebuilt on next use after keys or scripts are added.
+     */
+    mutable std::map<CScript, std::set<COutPoint> > mapUnspentOutputsByScript;
+    mutable bool fOutputIndexStale;
+    std::map<libzcash::PaymentAddress, std::set<JSOutPoint> > mapNotesByAddress;
+    mutable std::map<libzcash::PaymentAddress, std::set<JSOutPoint> > mapUnspentNotesByAddress;
+
+    void IndexWalletTx(const CWalletTx& wtx);
+    void RebuildOutputIndex() const;
+    template <class T>
+    bool IsSpentDeeperThan(const TxSpendMap<T>& mapSpends, const T& outpoint, int nDepth) const;
+
 public:
     /*
      * Size of the incremental witness cache for the notes in our wallet.
@@ -714,6 +785,35 @@ protected:
      */
     void DecrementNoteWitnesses(const CBlockIndex* pindex);
 
+    /**
+     * While ScanForWalletTransactions is running, the height of the last block
+     * it has applied. The rescan releases cs_main between chunks, so the tip
+     * can move while notes it has found are still witnessed at this height.
+     */
+    boost::optional<int> nRescanHeight;
+    //! Serializes calls to ScanForWalletTransactions
+    CCriticalSection cs_rescan;
+    /**
+     * True if the witnesses of nd are being brought up to date by a rescan
+     * and must be left alone when the wallet's other witnesses are at
+     * nTipHeight.
+     */
+    bool IsNoteAwaitingRescan(const CNoteData& nd, int nTipHeight) const;
+
+    /**
+     * Transactions whose note data (witnesses, witness heights or nullifiers)
+     * has changed since they were last written. SetBestChain only rewrites
+     * these, and forgets them once the write has been committed.
+     */
+    std::set<uint256> setNoteDataDirty;
+    /**
+     * A SetBestChain call that has been left to the wallet flushing thread.
+     * Repeated calls between two flushes are written once, with the latest
+     * locator.
+     */
+    boost::optional<CBlockLocator> locBestChainPending;
+    bool fAsyncBestChain;
+
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
         if (!walletdb.TxnBegin()) {
@@ -722,14 +822,14 @@ protected:
             return;
         }
         try {
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                auto wtx = wtxItem.second;
+            for (const uint256& hash : setNoteDataDirty) {
+                auto mi = mapWallet.find(hash);
                 // We skip transactions for which mapSproutNoteData is empty.
                 //This covers transactions that have no Sprout
                 // (i.e. are purely transparent), as well as shielding and unshielding
                 // transactions in which we only have transparent addresses involved.
-                if (!(wtx.mapNoteData.empty())) {
-                    if (!walletdb.WriteTx(wtxItem.first, wtx)) {
+                if (mi != mapWallet.end() && !(mi->second.mapNoteData.empty())) {
+                    if (!walletdb.WriteTx(hash, mi->second)) {
                         LogPrintf("SetBestChain(): Failed to write CWalletTx, aborting atomic write\n");
                         walletdb.TxnAbort();
                         return;
@@ -741,11 +841,18 @@ protected:
                 walletdb.TxnAbort();
                 return;
             }
-            if (!walletdb.WriteBestBlock(loc)) {
+            // Don't let a restart skip blocks the viewing key scanner
+            // hasn't got to
+            if (!walletdb.WriteBestBlock(locViewingKeyScan ? *locViewingKeyScan : loc)) {
                 LogPrintf("SetBestChain(): Failed to write best block, aborting atomic write\n");
                 walletdb.TxnAbort();
                 return;
             }
+            if (nRescanHeight && !walletdb.WriteRescanHeight(*nRescanHeight)) {
+                LogPrintf("SetBestChain(): Failed to write rescan height, aborting atomic write\n");
+                walletdb.TxnAbort();
+                return;
+            }
         } catch (const std::exception &exc) {
             // Unexpected failure
             LogPrintf("SetBestChain(): Unexpected error during atomic write:\n");
@@ -758,6 +865,8 @@ protected:
             LogPrintf("SetBestChain(): Couldn't commit atomic write\n");
             return;
         }
+        setNoteDataDirty.clear();
+        locBestChainPending = boost::none;
     }
 
 private:
@@ -821,6 +930,14 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nWitnessCacheSize = 0;
+        nRescanHeight = boost::none;
+        fOutputIndexStale = true;
+        locBestChainPending = boost::none;
+        fAsyncBestChain = false;
+        fKeyPoolRefillThread = false;
+        fViewingKeyScanThread = false;
+        nViewingKeyScanHeight = -1;
+        locViewingKeyScan = boost::none;
     }
 
     /**
@@ -897,7 +1014,14 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, bool fIncludeZeroValue=false, bool fIncludeCoinBase=true, bool fIncludeCommunityFund=true) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    /**
+     * Pick coins from vCoins worth at least nTargetValue: a single coin of
+     * exactly that value, all the smaller coins if they add up to it, an
+     * exact subset of them if the branch and bound search (fUseBnB) finds
+     * one, or else the closer of the best subset found by stochastic search
+     * and the smallest larger coin.
+     */
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseBnB = true) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
     bool IsSpent(const uint256& nullifier) const;
@@ -959,10 +1083,14 @@ public:
     bool AddZKey(const libzcash::SpendingKey &key);
     //! Adds spending key to the store, without saving it to disk (used by LoadWallet)
     bool LoadZKey(const libzcash::SpendingKey &key);
+    //! As above, with the address and note decryptor of the key derived already
+    bool LoadZKey(const libzcash::SpendingKey &key, const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor);
     //! Load spending key metadata (used by LoadWallet)
     bool LoadZKeyMetadata(const libzcash::PaymentAddress &addr, const CKeyMetadata &meta);
     //! Adds an encrypted spending key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedZKey(const libzcash::PaymentAddress &addr, const libzcash::ReceivingKey &rk, const std::vector<unsigned char> &vchCryptedSecret);
+    //! As above, with the note decryptor of the key derived already
+    bool LoadCryptedZKey(const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor, const std::vector<unsigned char> &vchCryptedSecret);
     //! Adds an encrypted spending key to the store, and saves it to disk (virtual method, declared in crypter.h)
     bool AddCryptedSpendingKey(const libzcash::PaymentAddress &address, const libzcash::ReceivingKey &rk, const std::vector<unsigned char> &vchCryptedSecret);
 
@@ -971,6 +1099,8 @@ public:
     bool RemoveViewingKey(const libzcash::ViewingKey &vk);
     //! Adds a viewing key to the store, without saving it to disk (used by LoadWallet)
     bool LoadViewingKey(const libzcash::ViewingKey &dest);
+    //! As above, with the address and note decryptor of the key derived already
+    bool LoadViewingKey(const libzcash::ViewingKey &vk, const libzcash::PaymentAddress &addr, const ZCNoteDecryption &decryptor);
 
     /** 
      * Increment the next transaction order id
@@ -984,11 +1114,14 @@ public:
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                  const mapNoteData_t& noteData, bool fIsMine);
     void EraseFromWallet(const uint256 &hash);
     void WitnessNoteCommitment(
          std::vector<uint256> commitments,
          std::vector<boost::optional<ZCIncrementalWitness>>& witnesses,
          uint256 &final_anchor);
+    /** Must be called without cs_main held: the rescan takes it per chunk. */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
@@ -1011,6 +1144,14 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    /**
+     * Bring the key pool and the spending key pool up to size, generating
+     * the keys before taking cs_wallet. Run by ThreadTopUpKeyPool.
+     */
+    void RefillKeyPools();
+    //! Have ThreadTopUpKeyPool (if running) refill the key pools
+    void NotifyKeyPoolRefill();
+    friend void ThreadTopUpKeyPool(CWallet* pwallet);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -1029,7 +1170,16 @@ public:
         const ZCNoteDecryption& dec,
         const uint256& hSig,
         uint8_t n) const;
+    boost::optional<uint256> GetNoteNullifier(
+        const JSDescription& jsdesc,
+        const libzcash::PaymentAddress& address,
+        const ZCNoteDecryption& dec,
+        const uint256& dhsecret,
+        const uint256& hSig,
+        uint8_t n) const;
     mapNoteData_t FindMyNotes(const CTransaction& tx) const;
+    mapNoteData_t FindMyNotes(const CTransaction& tx, const NoteDecryptorMap& decryptors,
+                              const NoteDecryptorMap* pexclude = NULL) const;
     bool IsFromMe(const uint256& nullifier) const;
     void GetNoteWitnesses(
          std::vector<JSOutPoint> notes,
@@ -1049,8 +1199,28 @@ public:
     CAmount GetCredit(const CTransaction& tx, const isminefilter& filter) const;
     CAmount GetChange(const CTransaction& tx) const;
     void ChainTip(const CBlockIndex *pindex, const CBlock *pblock, ZCIncrementalMerkleTree tree, bool added);
-    /** Saves witness caches and best block locator to disk. */
+    /**
+     * Saves witness caches and best block locator to disk. Once the wallet
+     * flushing thread is running this is left to FlushBestChain().
+     */
     void SetBestChain(const CBlockLocator& loc);
+    //! Write out the pending SetBestChain call, if any
+    void FlushBestChain();
+    //! Leave SetBestChain writes to the wallet flushing thread
+    void SetAsyncBestChain(bool fAsync);
+    /**
+     * Find the notes to viewing-key-only addresses in the given connected
+     * (true) and disconnected (false) blocks, trying the keys on several
+     * threads. Run by ThreadScanViewingKeys. Returns false if a block could
+     * not be read: it and the blocks after it are queued again.
+     */
+    bool ScanViewingKeys(const std::vector<std::pair<const CBlockIndex*, bool> >& vBlocks);
+    /**
+     * The height up to which notes to viewing keys have been found, if
+     * ThreadScanViewingKeys is running.
+     */
+    boost::optional<int> GetViewingKeyScanHeight() const;
+    friend void ThreadScanViewingKeys(CWallet* pwallet);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
@@ -1077,6 +1247,12 @@ public:
         return setKeyPool.size();
     }
 
+    unsigned int GetZKeyPoolSize()
+    {
+        AssertLockHeld(cs_wallet); // dequeZKeyPool
+        return dequeZKeyPool.size();
+    }
+
     bool SetDefaultKey(const CPubKey &vchPubKey);
 
     //! signify that a particular wallet feature is now used. this may change nWalletVersion and nWalletMaxVersion if those are lower
@@ -1187,4 +1363,9 @@ public:
     }
 };
 
+/** Keeps the key pools of pwallet topped up in the background */
+void ThreadTopUpKeyPool(CWallet* pwallet);
+/** Finds the notes to pwallet's viewing keys in new blocks in the background */
+void ThreadScanViewingKeys(CWallet* pwallet);
+
 #endif // BITCOIN_WALLET_WALLET_H
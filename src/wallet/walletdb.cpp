@@ -21,6 +21,8 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
+
 using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
@@ -183,6 +185,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock"), locator);
 }
 
+bool CWalletDB::WriteRescanHeight(int nHeight)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("rescanheight"), nHeight);
+}
+
+bool CWalletDB::ReadRescanHeight(int& nHeight)
+{
+    return Read(std::string("rescanheight"), nHeight);
+}
+
+bool CWalletDB::EraseRescanHeight()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("rescanheight"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -396,15 +415,169 @@ public:
     }
 };
 
-bool
+static bool DecodeTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    auto verifier = libzcash::ProofVerifier::Strict();
+    if (!(CheckTransaction(wtx, state, verifier) && (wtx.GetHash() == hash) && state.IsValid()))
+    {
+        // Don't consider REJECT_CHECKBLOCKATHEIGHT_NOT_FOUND error code as a failure. It can appear because a tx
+        // is a pre-chainsplit tx, so it is perfectly fine in this case.
+        if (state.GetRejectCode() != REJECT_CHECKBLOCKATHEIGHT_NOT_FOUND)
+            return false;
+    }
+    return true;
+}
+
+static bool DecodeKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue,
+                      CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash;
+
+    if (strType == "key")
+    {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try
+    {
+        ssValue >> hash;
+    }
+    catch (...) {}
+
+    bool fSkipCheck = false;
+
+    if (!hash.IsNull())
+    {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash)
+        {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * A record read from the wallet database. Transactions and keys are decoded
+ * and checked by Decode(), which doesn't touch the wallet and so can run on
+ * many records at once; everything else is left to ReadKeyValue.  For Sprout
+ * keys this includes deriving their address and note decryptor, which costs
+ * a scalar multiplication or two per key.
+ */
+class CWalletRecord {
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+
+    bool fDecoded;
+    bool fValid;
+    string strErr;
+    uint256 hash;
+    CWalletTx wtx;
+    CPubKey vchPubKey;
+    CKey key;
+    libzcash::PaymentAddress addr;
+    libzcash::SpendingKey sk;
+    libzcash::ViewingKey vk;
+    char fYes;
+    std::vector<unsigned char> vchCryptedSecret;
+    ZCNoteDecryption decryptor;
+
+    CWalletRecord(const CDataStream& ssKeyIn, const CDataStream& ssValueIn)
+        : ssKey(ssKeyIn), ssValue(ssValueIn), fDecoded(false), fValid(false), fYes(0) {}
+
+    static bool IsDecodedType(const string& strType)
+    {
+        return strType == "tx" || strType == "key" || strType == "wkey" ||
+               strType == "zkey" || strType == "czkey" || strType == "vkey";
+    }
+
+    void Decode()
+    {
+        try {
+            if (strType == "tx") {
+                fValid = DecodeTx(ssKey, ssValue, hash, wtx);
+            } else if (strType == "zkey") {
+                ssKey >> addr;
+                ssValue >> sk;
+                // The key is stored under the address it derives
+                addr = sk.address();
+                decryptor = ZCNoteDecryption(sk.receiving_key());
+                fValid = true;
+            } else if (strType == "czkey") {
+                ssKey >> addr;
+                uint256 rkValue;
+                ssValue >> rkValue;
+                ssValue >> vchCryptedSecret;
+                decryptor = ZCNoteDecryption(libzcash::ReceivingKey(rkValue));
+                fValid = true;
+            } else if (strType == "vkey") {
+                ssKey >> vk;
+                ssValue >> fYes;
+                if (fYes == '1') {
+                    addr = vk.address();
+                    decryptor = ZCNoteDecryption(vk.sk_enc);
+                }
+                fValid = true;
+            } else {
+                fValid = DecodeKey(strType, ssKey, ssValue, vchPubKey, key, strErr);
+            }
+        } catch (...) {
+            fValid = false;
+        }
+        fDecoded = true;
+    }
+};
+
+static bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
-             CWalletScanState &wss, string& strType, string& strErr)
+             CWalletScanState &wss, string& strType, string& strErr, CWalletRecord* prec)
 {
     try {
         // Unserialize
         // Taking advantage of the fact that pair serialization
         // is just the two items serialized one after the other
-        ssKey >> strType;
+        if (prec) {
+            strType = prec->strType;
+            if (strType.empty())
+                return false;
+        } else {
+            ssKey >> strType;
+        }
         if (strType == "name")
         {
             string strAddress;
@@ -419,19 +592,16 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
-            CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            auto verifier = libzcash::ProofVerifier::Strict();
-            if (!(CheckTransaction(wtx, state, verifier) && (wtx.GetHash() == hash) && state.IsValid()))
-            {
-                // Don't consider REJECT_CHECKBLOCKATHEIGHT_NOT_FOUND error code as a failure. It can appear because a tx
-                // is a pre-chainsplit tx, so it is perfectly fine in this case.
-                if (state.GetRejectCode() != REJECT_CHECKBLOCKATHEIGHT_NOT_FOUND)
+            uint256 hashDecoded;
+            CWalletTx wtxDecoded;
+            if (prec && prec->fDecoded) {
+                if (!prec->fValid)
                     return false;
+            } else if (!DecodeTx(ssKey, ssValue, hashDecoded, wtxDecoded)) {
+                return false;
             }
+            const uint256& hash = prec && prec->fDecoded ? prec->hash : hashDecoded;
+            CWalletTx& wtx = prec && prec->fDecoded ? prec->wtx : wtxDecoded;
 
             // Undo serialize changes in 31600
             if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
@@ -490,12 +660,19 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "vkey")
         {
-            libzcash::ViewingKey vk;
-            ssKey >> vk;
-            char fYes;
-            ssValue >> fYes;
-            if (fYes == '1')
-                pwallet->LoadViewingKey(vk);
+            if (prec && prec->fDecoded) {
+                if (!prec->fValid)
+                    return false;
+                if (prec->fYes == '1')
+                    pwallet->LoadViewingKey(prec->vk, prec->addr, prec->decryptor);
+            } else {
+                libzcash::ViewingKey vk;
+                ssKey >> vk;
+                char fYes;
+                ssValue >> fYes;
+                if (fYes == '1')
+                    pwallet->LoadViewingKey(vk);
+            }
 
             // Viewing keys have no birthday information for now,
             // so set the wallet birthday to the beginning of time.
@@ -503,12 +680,20 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "zkey")
         {
-            libzcash::PaymentAddress addr;
-            ssKey >> addr;
-            libzcash::SpendingKey key;
-            ssValue >> key;
+            bool fLoaded;
+            if (prec && prec->fDecoded) {
+                if (!prec->fValid)
+                    return false;
+                fLoaded = pwallet->LoadZKey(prec->sk, prec->addr, prec->decryptor);
+            } else {
+                libzcash::PaymentAddress addr;
+                ssKey >> addr;
+                libzcash::SpendingKey key;
+                ssValue >> key;
+                fLoaded = pwallet->LoadZKey(key);
+            }
 
-            if (!pwallet->LoadZKey(key))
+            if (!fLoaded)
             {
                 strErr = "Error reading wallet database: LoadZKey failed";
                 return false;
@@ -518,62 +703,21 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
-            CKey key;
-            CPrivKey pkey;
-            uint256 hash;
-
             if (strType == "key")
-            {
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
 
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try
-            {
-                ssValue >> hash;
-            }
-            catch (...) {}
-
-            bool fSkipCheck = false;
-
-            if (!hash.IsNull())
-            {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash)
-                {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            CPubKey vchPubKeyDecoded;
+            CKey keyDecoded;
+            if (prec && prec->fDecoded) {
+                if (!prec->fValid) {
+                    strErr = prec->strErr;
                     return false;
                 }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            } else if (!DecodeKey(strType, ssKey, ssValue, vchPubKeyDecoded, keyDecoded, strErr)) {
                 return false;
             }
+            const CPubKey& vchPubKey = prec && prec->fDecoded ? prec->vchPubKey : vchPubKeyDecoded;
+            const CKey& key = prec && prec->fDecoded ? prec->key : keyDecoded;
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -612,17 +756,25 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "czkey")
         {
-            libzcash::PaymentAddress addr;
-            ssKey >> addr;
-            // Deserialization of a pair is just one item after another
-            uint256 rkValue;
-            ssValue >> rkValue;
-            libzcash::ReceivingKey rk(rkValue);
-            vector<unsigned char> vchCryptedSecret;
-            ssValue >> vchCryptedSecret;
+            bool fLoaded;
+            if (prec && prec->fDecoded) {
+                if (!prec->fValid)
+                    return false;
+                fLoaded = pwallet->LoadCryptedZKey(prec->addr, prec->decryptor, prec->vchCryptedSecret);
+            } else {
+                libzcash::PaymentAddress addr;
+                ssKey >> addr;
+                // Deserialization of a pair is just one item after another
+                uint256 rkValue;
+                ssValue >> rkValue;
+                libzcash::ReceivingKey rk(rkValue);
+                vector<unsigned char> vchCryptedSecret;
+                ssValue >> vchCryptedSecret;
+                fLoaded = pwallet->LoadCryptedZKey(addr, rk, vchCryptedSecret);
+            }
             wss.nCKeys++;
 
-            if (!pwallet->LoadCryptedZKey(addr, rk, vchCryptedSecret))
+            if (!fLoaded)
             {
                 strErr = "Error reading wallet database: LoadCryptedZKey failed";
                 return false;
@@ -720,6 +872,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
     return true;
 }
 
+bool
+ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
+             CWalletScanState &wss, string& strType, string& strErr)
+{
+    return ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr, NULL);
+}
+
 static bool IsKeyType(string strType)
 {
     return (strType== "key" || strType == "wkey" ||
@@ -728,12 +887,41 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
-DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
+/** Decode the transaction and key records of vRecords on all cores */
+static int DecodeWalletRecords(vector<CWalletRecord>& vRecords)
+{
+    vector<CWalletRecord*> vDecode;
+    BOOST_FOREACH(CWalletRecord& rec, vRecords) {
+        if (CWalletRecord::IsDecodedType(rec.strType))
+            vDecode.push_back(&rec);
+    }
+
+    // Not worth starting threads for a handful of records
+    int nThreads = std::max(1, std::min(GetNumCores(), (int)(vDecode.size() / 64)));
+    std::atomic<size_t> nNext(0);
+    auto decode = [&vDecode, &nNext]() {
+        for (size_t i = nNext++; i < vDecode.size(); i = nNext++)
+            vDecode[i]->Decode();
+    };
+
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(decode);
+    decode();
+    threadGroup.join_all();
+    return nThreads;
+}
+
+DBErrors CWalletDB::LoadWallet(CWallet* pwallet, bool fParallelDecode)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeRead = 0, nTimeDecode = 0, nTimeApply = 0;
+    int nThreads = 0;
+    vector<CWalletRecord> vRecords;
 
     try {
         LOCK(pwallet->cs_wallet);
@@ -766,10 +954,31 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
+            vRecords.push_back(CWalletRecord(ssKey, ssValue));
+        }
+        pcursor->close();
+        nTimeRead = GetTimeMicros();
+
+        // Transactions (with their cached witnesses) and keys are the bulk
+        // of the work; decode them in parallel, then apply every record in
+        // database order as before.
+        for (CWalletRecord& rec : vRecords) {
+            try {
+                rec.ssKey >> rec.strType;
+            } catch (const std::exception&) {
+                rec.strType.clear();
+            }
+        }
+        // Records left undecoded are decoded by ReadKeyValue one at a time
+        if (fParallelDecode)
+            nThreads = DecodeWalletRecords(vRecords);
+        nTimeDecode = GetTimeMicros();
 
+        for (CWalletRecord& rec : vRecords)
+        {
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            if (!ReadKeyValue(pwallet, rec.ssKey, rec.ssValue, wss, strType, strErr, &rec))
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -787,7 +996,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        vRecords.clear();
+        nTimeApply = GetTimeMicros();
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -835,6 +1045,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         pwallet->wtxOrdered.insert(make_pair(entry.nOrderPos, CWallet::TxPair((CWalletTx*)0, &entry)));
     }
 
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrintf("Wallet load: read %.2fms, decode %.2fms (%d threads), apply %.2fms, upgrade/reorder %.2fms\n",
+              (nTimeRead - nTimeStart) * 0.001, (nTimeDecode - nTimeRead) * 0.001, nThreads,
+              (nTimeApply - nTimeDecode) * 0.001, (nTimeEnd - nTimeApply) * 0.001);
+
     return result;
 }
 
@@ -921,8 +1136,10 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet, vector<CWalletTx>& vWtx)
     return DB_LOAD_OK;
 }
 
-void ThreadFlushWalletDB(const string& strFile)
+void ThreadFlushWalletDB(CWallet* pwallet)
 {
+    const string& strFile = pwallet->strWalletFile;
+
     // Make this thread recognisable as the wallet flushing thread
     RenameThread("horizen-wallet");
 
@@ -933,53 +1150,64 @@ void ThreadFlushWalletDB(const string& strFile)
     if (!GetBoolArg("-flushwallet", true))
         return;
 
+    // Best block updates, with the witness caches that go with them, are
+    // written from here so that block validation doesn't wait on them.
+    // Once interrupted, SetBestChain writes synchronously again.
+    pwallet->SetAsyncBestChain(true);
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64_t nLastWalletUpdate = GetTime();
-    while (true)
-    {
-        MilliSleep(500);
-
-        if (nLastSeen != nWalletDBUpdated)
+    try {
+        while (true)
         {
-            nLastSeen = nWalletDBUpdated;
-            nLastWalletUpdate = GetTime();
-        }
+            MilliSleep(500);
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
-        {
-            TRY_LOCK(bitdb.cs_db,lockDb);
-            if (lockDb)
+            pwallet->FlushBestChain();
+
+            if (nLastSeen != nWalletDBUpdated)
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = bitdb.mapFileUseCount.begin();
-                while (mi != bitdb.mapFileUseCount.end())
-                {
-                    nRefCount += (*mi).second;
-                    mi++;
-                }
+                nLastSeen = nWalletDBUpdated;
+                nLastWalletUpdate = GetTime();
+            }
 
-                if (nRefCount == 0)
+            if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+            {
+                TRY_LOCK(bitdb.cs_db,lockDb);
+                if (lockDb)
                 {
-                    boost::this_thread::interruption_point();
-                    map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
-                    if (mi != bitdb.mapFileUseCount.end())
+                    // Don't do this if any databases are in use
+                    int nRefCount = 0;
+                    map<string, int>::iterator mi = bitdb.mapFileUseCount.begin();
+                    while (mi != bitdb.mapFileUseCount.end())
                     {
-                        LogPrint("db", "Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64_t nStart = GetTimeMillis();
-
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
+                        nRefCount += (*mi).second;
+                        mi++;
+                    }
 
-                        bitdb.mapFileUseCount.erase(mi++);
-                        LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
+                    if (nRefCount == 0)
+                    {
+                        boost::this_thread::interruption_point();
+                        map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
+                        if (mi != bitdb.mapFileUseCount.end())
+                        {
+                            LogPrint("db", "Flushing wallet.dat\n");
+                            nLastFlushed = nWalletDBUpdated;
+                            int64_t nStart = GetTimeMillis();
+
+                            // Flush wallet.dat so it's self contained
+                            bitdb.CloseDb(strFile);
+                            bitdb.CheckpointLSN(strFile);
+
+                            bitdb.mapFileUseCount.erase(mi++);
+                            LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
+                        }
                     }
                 }
             }
         }
+    } catch (const boost::thread_interrupted&) {
+        pwallet->SetAsyncBestChain(false);
+        throw;
     }
 }
 
@@ -102,6 +102,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteRescanHeight(int nHeight);
+    bool ReadRescanHeight(int& nHeight);
+    bool EraseRescanHeight();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
@@ -129,7 +133,8 @@ public:
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 
     DBErrors ReorderTransactions(CWallet* pwallet);
-    DBErrors LoadWallet(CWallet* pwallet);
+    //! Load every record into pwallet, decoding transactions and keys on all cores unless fParallelDecode is false
+    DBErrors LoadWallet(CWallet* pwallet, bool fParallelDecode = true);
     DBErrors FindWalletTx(CWallet* pwallet, std::vector<uint256>& vTxHash, std::vector<CWalletTx>& vWtx);
     DBErrors ZapWalletTx(CWallet* pwallet, std::vector<CWalletTx>& vWtx);
     static bool Recover(CDBEnv& dbenv, const std::string& filename, bool fOnlyKeys);
@@ -153,6 +158,6 @@ private:
 };
 
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
-void ThreadFlushWalletDB(const std::string& strFile);
+void ThreadFlushWalletDB(CWallet* pwallet);
 
 #endif // BITCOIN_WALLET_WALLETDB_H
@@ -90,6 +90,14 @@ public:
                                  const uint256& h_sig,
                                  unsigned char nonce
                                 );
+    // As above, given decryptor.dhsecret(ephemeralKey)
+    static NotePlaintext decrypt(const ZCNoteDecryption& decryptor,
+                                 const ZCNoteDecryption::Ciphertext& ciphertext,
+                                 const uint256& ephemeralKey,
+                                 const uint256& dhsecret,
+                                 const uint256& h_sig,
+                                 unsigned char nonce
+                                );
 
     ZCNoteEncryption::Ciphertext encrypt(ZCNoteEncryption& encryptor,
                                          const uint256& pk_enc
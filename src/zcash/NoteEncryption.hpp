@@ -78,6 +78,20 @@ public:
                       unsigned char nonce
                      ) const;
 
+    // Computes the Diffie-Hellman secret for notes with ephemeral key `epk`.
+    // The outputs of a JoinSplit share one ephemeral key, so trying all of
+    // them against this key needs only one scalar multiplication.
+    uint256 dhsecret(const uint256 &epk) const;
+
+    // As decrypt, given dhsecret(epk). The MAC is checked before anything
+    // is decrypted, so a note for another key is rejected cheaply.
+    Plaintext decryptWithSecret(const Ciphertext &ciphertext,
+                                const uint256 &epk,
+                                const uint256 &dhsecret,
+                                const uint256 &hSig,
+                                unsigned char nonce
+                               ) const;
+
     friend inline bool operator==(const NoteDecryption& a, const NoteDecryption& b) {
         return a.sk_enc == b.sk_enc && a.pk_enc == b.pk_enc;
     }
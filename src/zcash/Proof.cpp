@@ -228,6 +228,11 @@ ProofVerifier ProofVerifier::Strict() {
     return ProofVerifier(true);
 }
 
+ProofVerifier ProofVerifier::StrictUnbatched() {
+    initialize_curve_params();
+    return ProofVerifier(true, false);
+}
+
 ProofVerifier ProofVerifier::Disabled() {
     initialize_curve_params();
     return ProofVerifier(false);
@@ -242,6 +247,9 @@ bool ProofVerifier::check(
 )
 {
     if (perform_verification) {
+        if (batch_pairings) {
+            return r1cs_ppzksnark_online_verifier_batched_strong_IC<curve_pp>(vk, pvk, primary_input, proof);
+        }
         return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
     } else {
         return true;
@@ -240,8 +240,10 @@ void initialize_curve_params();
 class ProofVerifier {
 private:
     bool perform_verification;
+    bool batch_pairings;
 
-    ProofVerifier(bool perform_verification) : perform_verification(perform_verification) { }
+    ProofVerifier(bool perform_verification, bool batch_pairings = true) :
+        perform_verification(perform_verification), batch_pairings(batch_pairings) { }
 
 public:
     // ProofVerifier should never be copied
@@ -254,6 +256,11 @@ public:
     // all proofs using libsnark's API.
     static ProofVerifier Strict();
 
+    // Like Strict(), but checks each pairing-product equation with its
+    // own final exponentiation instead of batching them. Used to benchmark
+    // the batched check against libsnark's reference verifier.
+    static ProofVerifier StrictUnbatched();
+
     // Creates a verification context that performs no
     // verification, used when avoiding duplicate effort
     // such as during reindexing.
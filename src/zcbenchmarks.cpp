@@ -151,12 +151,13 @@ std::vector<double> benchmark_create_joinsplit_threaded(int nThreads)
     return ret;
 }
 
-double benchmark_verify_joinsplit(const JSDescription &joinsplit)
+double benchmark_verify_joinsplit(const JSDescription &joinsplit, bool fBatchPairings)
 {
     struct timeval tv_start;
     timer_start(tv_start);
     uint256 pubKeyHash;
-    auto verifier = libzcash::ProofVerifier::Strict();
+    auto verifier = fBatchPairings ? libzcash::ProofVerifier::Strict()
+                                   : libzcash::ProofVerifier::StrictUnbatched();
     joinsplit.Verify(*pzcashParams, verifier, pubKeyHash);
     return timer_stop(tv_start);
 }
@@ -284,12 +285,14 @@ double benchmark_large_tx()
     return timer_stop(tv_start);
 }
 
-double benchmark_try_decrypt_notes(size_t nAddrs)
+double benchmark_try_decrypt_notes(size_t nAddrs, bool fBatched)
 {
     CWallet wallet;
+    std::vector<ZCNoteDecryption> decryptors;
     for (int i = 0; i < nAddrs; i++) {
         auto sk = libzcash::SpendingKey::random();
         wallet.AddSpendingKey(sk);
+        decryptors.push_back(ZCNoteDecryption(sk.receiving_key()));
     }
 
     auto sk = libzcash::SpendingKey::random();
@@ -297,7 +300,24 @@ double benchmark_try_decrypt_notes(size_t nAddrs)
 
     struct timeval tv_start;
     timer_start(tv_start);
-    auto nd = wallet.FindMyNotes(tx);
+    if (fBatched) {
+        auto nd = wallet.FindMyNotes(tx);
+    } else {
+        // Trial-decrypt each output with each key, deriving the DH secret
+        // every time, as FindMyNotes used to.
+        for (const JSDescription& jsdesc : tx.vjoinsplit) {
+            auto hSig = jsdesc.h_sig(*pzcashParams, tx.joinSplitPubKey);
+            for (uint8_t j = 0; j < jsdesc.ciphertexts.size(); j++) {
+                for (const ZCNoteDecryption& dec : decryptors) {
+                    try {
+                        libzcash::NotePlaintext::decrypt(
+                            dec, jsdesc.ciphertexts[j], jsdesc.ephemeralKey, hSig, j);
+                    } catch (const libzcash::note_decryption_failed &err) {
+                    }
+                }
+            }
+        }
+    }
     return timer_stop(tv_start);
 }
 
@@ -454,6 +474,37 @@ double benchmark_sendtoaddress(CAmount amount)
     return timer_stop(tv_start);
 }
 
+double benchmark_select_coins(size_t nCoins, bool fUseBnB)
+{
+    CWallet wallet;
+    std::vector<CWalletTx> vWtx;
+    vWtx.reserve(nCoins);
+    for (size_t i = 0; i < nCoins; i++) {
+        CMutableTransaction mtx;
+        mtx.nLockTime = i;
+        mtx.vout.resize(1);
+        // Payout wallets collect many coins of round values
+        mtx.vout[0].nValue = (GetRand(1000) + 1) * COIN / 1000;
+        vWtx.push_back(CWalletTx(&wallet, mtx));
+    }
+    std::vector<COutput> vCoins;
+    for (const CWalletTx& wtx : vWtx) {
+        vCoins.push_back(COutput(&wtx, 0, 6 * 24, true));
+    }
+    // Something a few of the coins add up to exactly
+    CAmount nTarget = 0;
+    for (size_t i = 0; i < std::min<size_t>(nCoins, 3); i++) {
+        nTarget += vWtx[i].vout[0].nValue;
+    }
+
+    std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+    CAmount nValueRet;
+    struct timeval tv_start;
+    timer_start(tv_start);
+    wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet, fUseBnB);
+    return timer_stop(tv_start);
+}
+
 double benchmark_loadwallet()
 {
     pre_wallet_load();
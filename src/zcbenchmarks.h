@@ -10,13 +10,14 @@ extern double benchmark_create_joinsplit();
 extern std::vector<double> benchmark_create_joinsplit_threaded(int nThreads);
 extern double benchmark_solve_equihash();
 extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
-extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
+extern double benchmark_verify_joinsplit(const JSDescription &joinsplit, bool fBatchPairings = true);
 extern double benchmark_verify_equihash();
 extern double benchmark_large_tx();
-extern double benchmark_try_decrypt_notes(size_t nAddrs);
+extern double benchmark_try_decrypt_notes(size_t nAddrs, bool fBatched = true);
 extern double benchmark_increment_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
 extern double benchmark_sendtoaddress(CAmount amount);
+extern double benchmark_select_coins(size_t nCoins, bool fUseBnB = true);
 extern double benchmark_loadwallet();
 extern double benchmark_listunspent();
 